@@ -0,0 +1,213 @@
+// cache.c - Cache block operations (Zicboz, Zicbom)
+//
+// The cbo instructions are emitted with .insn so that the kernel still builds
+// with a plain -march (see Makefile). They use the MISC-MEM major opcode with funct3 = 2 and
+// rd = x0; the immediate selects the operation.
+
+#ifdef CACHE_TRACE
+#define TRACE
+#endif
+
+#ifdef CACHE_DEBUG
+#define DEBUG
+#endif
+
+#include "cache.h"
+#include "memory.h"
+#include "trap.h"
+#include "console.h"
+#include "halt.h"
+
+#include <stdint.h>
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+#define CBO_CLEAN 1
+#define CBO_FLUSH 2
+#define CBO_ZERO 4
+
+// Block size assumed for cbo.clean and cbo.flush. The Zicbom block size is not
+// discoverable without a device tree; QEMU and current cores use 64 bytes.
+
+#define CBOM_BLOCK_SIZE 64
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static inline void cbo_zero(void * p);
+static inline void cbo_clean(const void * p);
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+char cache_initialized = 0;
+size_t cache_zero_block_size = 0;
+char cache_cbom_supported = 0;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void cache_init(void) {
+    unsigned char * pp;
+    size_t cnt;
+
+    trace("%s()", __func__);
+
+    // Zicboz: fill a page with ones and zero one block at the start. If the
+    // instruction is not supported (or menvcfg.CBZE is not set), it traps as an
+    // illegal instruction and the page is unchanged. Otherwise the number of
+    // zero bytes is the block size.
+
+    pp = memory_reserve_page();
+    if (pp == NULL)
+        panic("cache_init: no free page");
+
+    for (cnt = 0; cnt < PAGE_SIZE; cnt++)
+        pp[cnt] = 0xff;
+
+    trap_probe_begin();
+    cbo_zero(pp);
+    if (trap_probe_end() == 0) {
+        for (cnt = 0; cnt < PAGE_SIZE && pp[cnt] == 0; cnt++)
+            continue;
+
+        // Must be a power of two that divides the page size
+        if (cnt != 0 && (cnt & (cnt - 1)) == 0)
+            cache_zero_block_size = cnt;
+    }
+
+    // Zicbom: cbo.clean traps if unsupported
+
+    trap_probe_begin();
+    cbo_clean(pp);
+    cache_cbom_supported = (trap_probe_end() == 0);
+
+    memory_free_page(pp);
+
+    kprintf("         Cache: Zicboz %s (block %zu bytes), Zicbom %s\n",
+        cache_zero_block_size ? "yes" : "no", cache_zero_block_size,
+        cache_cbom_supported ? "yes" : "no");
+
+    cache_initialized = 1;
+}
+
+void cache_zero(void * p, size_t n) {
+    const size_t blksz = cache_zero_block_size;
+    uintptr_t start, end;
+
+    if (blksz == 0 || n < blksz) {
+        cache_zero_stores(p, n);
+        return;
+    }
+
+    // Whole blocks in the middle, stores for the partial blocks at either end
+
+    start = ((uintptr_t)p + blksz - 1) & ~(blksz - 1);
+    end = ((uintptr_t)p + n) & ~(blksz - 1);
+
+    if (end <= start) {
+        cache_zero_stores(p, n);
+        return;
+    }
+
+    cache_zero_stores(p, start - (uintptr_t)p);
+    cache_zero_blocks((void*)start, end - start);
+    cache_zero_stores((void*)end, (uintptr_t)p + n - end);
+}
+
+void cache_zero_stores(void * p, size_t n) {
+    unsigned char * bp = p;
+    uint64_t * wp;
+
+    while (n != 0 && ((uintptr_t)bp & 7) != 0) {
+        *bp++ = 0;
+        n -= 1;
+    }
+
+    wp = (uint64_t *)bp;
+
+    while (n >= 64) {
+        wp[0] = 0; wp[1] = 0; wp[2] = 0; wp[3] = 0;
+        wp[4] = 0; wp[5] = 0; wp[6] = 0; wp[7] = 0;
+        wp += 8;
+        n -= 64;
+    }
+
+    while (n >= 8) {
+        *wp++ = 0;
+        n -= 8;
+    }
+
+    bp = (unsigned char *)wp;
+
+    while (n != 0) {
+        *bp++ = 0;
+        n -= 1;
+    }
+}
+
+void cache_zero_blocks(void * p, size_t n) {
+    const size_t blksz = cache_zero_block_size;
+    char * bp = p;
+
+    assert (blksz != 0);
+
+    while (n != 0) {
+        cbo_zero(bp);
+        bp += blksz;
+        n -= blksz;
+    }
+}
+
+#ifdef CACHE_DMA_NONCOHERENT
+
+void cache_clean_range(const void * p, size_t n) {
+    const char * bp;
+
+    if (!cache_cbom_supported)
+        return;
+
+    __sync_synchronize();
+
+    bp = (const char *)((uintptr_t)p & ~(uintptr_t)(CBOM_BLOCK_SIZE - 1));
+    while (bp < (const char *)p + n) {
+        cbo_clean(bp);
+        bp += CBOM_BLOCK_SIZE;
+    }
+
+    __sync_synchronize();
+}
+
+void cache_flush_range(const void * p, size_t n) {
+    const char * bp;
+
+    if (!cache_cbom_supported)
+        return;
+
+    __sync_synchronize();
+
+    bp = (const char *)((uintptr_t)p & ~(uintptr_t)(CBOM_BLOCK_SIZE - 1));
+    while (bp < (const char *)p + n) {
+        asm volatile (".insn i 0x0F, 2, x0, %0, %1"
+            :: "r" (bp), "i" (CBO_FLUSH) : "memory");
+        bp += CBOM_BLOCK_SIZE;
+    }
+
+    __sync_synchronize();
+}
+
+#endif
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static inline void cbo_zero(void * p) {
+    asm volatile (".insn i 0x0F, 2, x0, %0, %1"
+        :: "r" (p), "i" (CBO_ZERO) : "memory");
+}
+
+static inline void cbo_clean(const void * p) {
+    asm volatile (".insn i 0x0F, 2, x0, %0, %1"
+        :: "r" (p), "i" (CBO_CLEAN) : "memory");
+}
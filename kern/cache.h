@@ -0,0 +1,87 @@
+// cache.h - Cache block operations (Zicboz, Zicbom)
+//
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// COMPILE-TIME CONFIGURATION
+//
+
+// Define CACHE_DMA_NONCOHERENT on platforms where devices do not snoop the
+// CPU caches. QEMU virt is coherent, so cache_dma_clean and cache_dma_flush
+// compile to nothing by default.
+
+// EXPORTED VARIABLE DECLARATIONS
+//
+
+extern char cache_initialized;
+
+// Size in bytes of the block operated on by cbo.zero, or 0 if the hart does
+// not support Zicboz. Set by cache_init.
+
+extern size_t cache_zero_block_size;
+
+// Nonzero if the hart supports Zicbom (cbo.clean and cbo.flush).
+
+extern char cache_cbom_supported;
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void cache_init(void)
+// Probes for Zicboz and Zicbom. Must be called after memory_init (it needs a
+// free page to test with); until then, cache_zero uses plain stores.
+
+extern void cache_init(void);
+
+// void cache_zero(void * p, size_t n)
+// Zeroes /n/ bytes at /p/. Uses cbo.zero for the whole cache blocks in the
+// range if the hart supports it, and 64-bit stores otherwise.
+
+extern void cache_zero(void * p, size_t n);
+
+// void cache_zero_stores(void * p, size_t n)
+// Zeroes /n/ bytes at /p/ using 64-bit stores only.
+
+extern void cache_zero_stores(void * p, size_t n);
+
+// void cache_zero_blocks(void * p, size_t n)
+// Zeroes /n/ bytes at /p/ using cbo.zero only. Both /p/ and /n/ must be
+// multiples of cache_zero_block_size, which must not be 0.
+
+extern void cache_zero_blocks(void * p, size_t n);
+
+// void cache_dma_clean(const void * p, size_t n)
+// void cache_dma_flush(const void * p, size_t n)
+// Make a buffer coherent with a device on a non-coherent platform. Call
+// cache_dma_clean before the device reads a buffer the CPU has written, and
+// cache_dma_flush after the device has written a buffer, before the CPU reads
+// it. Both do nothing unless CACHE_DMA_NONCOHERENT is defined.
+
+static inline void cache_dma_clean(const void * p, size_t n);
+static inline void cache_dma_flush(const void * p, size_t n);
+
+#ifdef CACHE_DMA_NONCOHERENT
+extern void cache_clean_range(const void * p, size_t n);
+extern void cache_flush_range(const void * p, size_t n);
+#endif
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline void cache_dma_clean(const void * p, size_t n) {
+#ifdef CACHE_DMA_NONCOHERENT
+    cache_clean_range(p, n);
+#endif
+}
+
+static inline void cache_dma_flush(const void * p, size_t n) {
+#ifdef CACHE_DMA_NONCOHERENT
+    cache_flush_range(p, n);
+#endif
+}
+
+#endif // _CACHE_H_
@@ -8,6 +8,7 @@
 
 #include "string.h"
 #include "intr.h"
+#include "spinlock.h"
 
 //           INTERNAL FUNCTION DECLARATIONS
 //           
@@ -19,6 +20,15 @@ static void vprintf_putc(char c, void * aux);
 
 int console_initialized = 0;
 
+//           INTERNAL GLOBAL VARIABLES
+//          
+
+//           Keeps lines printed by different harts from being interleaved.
+
+static struct spinlock console_lock = {
+	.name = "console"
+};
+
 //           EXPORTED FUNCTION DEFINITIONS
 //          
 
@@ -138,12 +148,12 @@ size_t console_vprintf(const char * fmt, va_list ap) {
   size_t nout;
 
   if (intr_initialized)
-    saved_intr_state = intr_disable();
+    saved_intr_state = spinlock_acquire(&console_lock);
 
 	nout = vgprintf(vprintf_putc, NULL, fmt, ap);
 
   if (intr_initialized)
-    intr_restore(saved_intr_state);
+    spinlock_release(&console_lock, saved_intr_state);
   
   return nout;
 }
@@ -248,6 +248,16 @@ static inline void csrc_mstatus(intptr_t mask) {
 #define RISCV_SSTATUS_SPP (1UL << 8)
 #define RISCV_SSTATUS_SUM (1UL << 18)
 
+// sstatus.FS tracks the state of the FP registers. While it is Off, any FP
+// instruction raises an illegal instruction exception. Writing an FP register
+// or fcsr sets it to Dirty.
+
+#define RISCV_SSTATUS_FS (3UL << 13)
+#define RISCV_SSTATUS_FS_OFF (0UL << 13)
+#define RISCV_SSTATUS_FS_INITIAL (1UL << 13)
+#define RISCV_SSTATUS_FS_CLEAN (2UL << 13)
+#define RISCV_SSTATUS_FS_DIRTY (3UL << 13)
+
 static inline intptr_t csrr_sstatus(void) {
     intptr_t val;
 
@@ -263,6 +273,36 @@ static inline void csrc_sstatus(intptr_t mask) {
     asm inline ("csrrc zero, sstatus, %0" :: "r" (mask));
 }
 
+// time, cycle (enabled for S and U mode in start.s)
+
+static inline uint64_t csrr_time(void) {
+    uint64_t val;
+
+    asm inline volatile ("rdtime %0" : "=r" (val));
+    return val;
+}
+
+static inline uint64_t csrr_cycle(void) {
+    uint64_t val;
+
+    asm inline volatile ("rdcycle %0" : "=r" (val));
+    return val;
+}
+
+// stimecmp (Sstc extension, CSR 0x14d). Accessible in S mode only if the
+// extension is present and menvcfg.STCE is set (see start.s).
+
+static inline uint64_t csrr_stimecmp(void) {
+    uint64_t val;
+
+    asm inline volatile ("csrr %0, 0x14d" : "=r" (val));
+    return val;
+}
+
+static inline void csrw_stimecmp(uint64_t val) {
+    asm inline volatile ("csrw 0x14d, %0" :: "r" (val));
+}
+
 // satp
 
 #define RISCV_SATP_MODE_Sv39 8
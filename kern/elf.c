@@ -9,6 +9,7 @@
 #include "console.h"
 #include "config.h"
 #include "memory.h"
+#include "cache.h"
 
 
 // ELF magic numbers and constants
@@ -171,7 +172,7 @@ int elf_load(struct io_intf *io, void (**entryptr)(void)) {
 
             // Zero out the remaining memory if memsz > filesz
             if (phdr.p_memsz > phdr.p_filesz) {
-                memset((void*)(phdr.p_vaddr + phdr.p_filesz), 0, (size_t)(phdr.p_memsz - phdr.p_filesz));
+                cache_zero((void*)(phdr.p_vaddr + phdr.p_filesz), (size_t)(phdr.p_memsz - phdr.p_filesz));
             }
             else if (phdr.p_memsz < phdr.p_filesz) {
                 return -EBADFMT;
@@ -6,6 +6,7 @@
 #include "halt.h"
 #include "memory.h"
 #include "syscall.h"
+#include "thread.h"
 
 #include <stddef.h>
 
@@ -47,10 +48,41 @@ static const char * const excp_names[] = {
     [RISCV_SCAUSE_STORE_PAGE_FAULT] = "Store page fault"
 };
 
+// Set while a trap probe is active, see trap_probe_begin().
+
+static volatile int probe_active;
+static volatile int probe_faults;
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
 void smode_excp_handler(unsigned int code, struct trap_frame * tfr) {
+    if (probe_active) {
+        // Skip the instruction (2 bytes if compressed, 4 otherwise)
+        probe_faults++;
+        if ((*(const uint16_t *)tfr->sepc & 3) == 3)
+            tfr->sepc += 4;
+        else
+            tfr->sepc += 2;
+        return;
+    }
+
+    // The kernel touches user pages directly (SUM is set), so it can take an
+    // A/D fault on a user page, e.g. while copying a syscall argument.
+
+    switch (code) {
+    case RISCV_SCAUSE_LOAD_PAGE_FAULT:
+        if (memory_handle_ad_fault((void*)csrr_stval(), PTE_R))
+            return;
+        break;
+    case RISCV_SCAUSE_STORE_PAGE_FAULT:
+        if (memory_handle_ad_fault((void*)csrr_stval(), PTE_W))
+            return;
+        break;
+    default:
+        break;
+    }
+
 	default_excp_handler(code, tfr);
 }
 
@@ -60,13 +92,43 @@ void umode_excp_handler(unsigned int code, struct trap_frame * tfr) {
     case RISCV_SCAUSE_ECALL_FROM_UMODE:
         syscall_handler(tfr);
         break;
+    case RISCV_SCAUSE_ILLEGAL_INSTR:
+        if (!thread_fp_trap()) // first FP instruction since switched in?
+            default_excp_handler(code, tfr);
+        break;
+    case RISCV_SCAUSE_INSTR_PAGE_FAULT:
+        if (!memory_handle_ad_fault((void*)csrr_stval(), PTE_X))
+            default_excp_handler(code, tfr);
+        break;
+    case RISCV_SCAUSE_LOAD_PAGE_FAULT:
+        if (!memory_handle_ad_fault((void*)csrr_stval(), PTE_R))
+            default_excp_handler(code, tfr);
+        break;
     case RISCV_SCAUSE_STORE_PAGE_FAULT:
-        memory_handle_page_fault((void*)csrr_stval());
+        if (!memory_handle_ad_fault((void*)csrr_stval(), PTE_W))
+            memory_handle_page_fault((void*)csrr_stval());
         break;
     default:
         default_excp_handler(code, tfr);
         break;
     }
+
+    // A thread that enters the kernel often through system calls or faults
+    // must still give up the hart when its slice runs out.
+
+    thread_preempt_check();
+}
+
+void trap_probe_begin(void) {
+    probe_faults = 0;
+    probe_active = 1;
+    __sync_synchronize();
+}
+
+int trap_probe_end(void) {
+    __sync_synchronize();
+    probe_active = 0;
+    return probe_faults;
 }
 
 void default_excp_handler (
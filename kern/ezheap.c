@@ -19,6 +19,7 @@
 #include "string.h"
 #include "halt.h"
 #include "memory.h"
+#include "spinlock.h"
 
 #include <stdint.h>
 
@@ -33,6 +34,18 @@ char heap_initialized = 0;
 static void * heap_start;
 static void * heap_end;
 
+static struct spinlock heap_lock = {
+    .name = "heap"
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+// Carves a block of /size/ bytes (a multiple of 16, at most a page) out of the
+// current heap block or a new page. Must be called with heap_lock held.
+
+static void * alloc_block(size_t size);
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -45,7 +58,8 @@ void heap_init(void * start, void * end) {
 }
 
 void * kmalloc(size_t size) {
-    void * new_block;
+    int saved_intr_state;
+    void * block;
 
     trace("%s(%zu)", __func__, size);
 
@@ -55,6 +69,41 @@ void * kmalloc(size_t size) {
     if (PAGE_SIZE < size)
         panic("heap alloc request too large");
     
+    saved_intr_state = spinlock_acquire(&heap_lock);
+    block = alloc_block(size);
+    spinlock_release(&heap_lock, saved_intr_state);
+
+    return block;
+}
+
+void * kcalloc(size_t n, size_t size) {
+    void * ptr;
+
+    trace("%s(%zu,%zu)", __func__, n, size);
+
+    if (SIZE_MAX / size < n)
+        panic("heap alloc request too large");
+
+    ptr = kmalloc(n * size);
+    memset(ptr, 0, n * size);
+    return ptr;
+}
+
+void * krealloc(void * ptr, size_t size) {
+    panic("krealloc not implemented");
+}
+
+void kfree(void * ptr) {
+    trace("%s(%p)", __func__, ptr);
+    // do nothing
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static void * alloc_block(size_t size) {
+    void * new_block;
+
     // If the request fits in the current heap block, allocate from it.
 
     if (size <= heap_end - heap_start) {
@@ -80,25 +129,3 @@ void * kmalloc(size_t size) {
     } else
         return new_block;
 }
-
-void * kcalloc(size_t n, size_t size) {
-    void * ptr;
-
-    trace("%s(%zu,%zu)", __func__, n, size);
-
-    if (SIZE_MAX / size < n)
-        panic("heap alloc request too large");
-
-    ptr = kmalloc(n * size);
-    memset(ptr, 0, n * size);
-    return ptr;
-}
-
-void * krealloc(void * ptr, size_t size) {
-    panic("krealloc not implemented");
-}
-
-void kfree(void * ptr) {
-    trace("%s(%p)", __func__, ptr);
-    // do nothing
-}
@@ -5,6 +5,7 @@
 #define _FS_H_
 
 #include "io.h"
+#include "lock.h"
 
 // MACROS
 #define IOCTL_GETLEN        1
@@ -54,6 +55,7 @@ typedef struct file_t {
     uint64_t byte_len;
     uint64_t inode;
     uint64_t flag;
+    struct lock pos_lock;   // held across each read, write and seek (see kfs.c)
 } file_t;
 
 extern void fs_init(void);
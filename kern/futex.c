@@ -0,0 +1,246 @@
+// futex.c - Fast user-space locking support
+//
+
+#ifdef FUTEX_TRACE
+#define TRACE
+#endif
+
+#ifdef FUTEX_DEBUG
+#define DEBUG
+#endif
+
+#include "futex.h"
+#include "thread.h"
+#include "memory.h"
+#include "halt.h"
+#include "console.h"
+#include "error.h"
+
+#include <stddef.h>
+
+// INTERNAL CONSTANTS
+//
+
+// Futexes are hashed by page, so that all futexes of a page share a bucket
+// and futex_page_busy looks at one bucket only.
+
+#define FUTEX_HASH_CNT 64
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// A futex exists only while threads sleep on it. It is created by the first
+// sleeper and freed by the last one to wake up. Freed futexes are kept on a
+// free list for reuse rather than given back to the heap, which does not
+// reclaim memory (see ezheap.c), so there are never more futexes than the most
+// threads that have slept on distinct words at once.
+
+struct futex {
+    const uint32_t * key; // physical address of the futex word
+    struct condition cond;
+    int nwaiters; // threads sleeping or woken but not yet running
+    struct futex * next; // next futex in hash bucket
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// The hash table and the futexes in it are protected by the thread manager
+// lock, which condition_wait releases only once the thread is on the wait
+// list of the futex.
+
+static struct futex * futex_hash[FUTEX_HASH_CNT];
+static struct futex * futex_free_list; // linked through next; carved from whole pages
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+// Returns the physical address of the futex word at user address /uaddr/, or
+// NULL if it is misaligned or not mapped. The thread manager lock must be held
+// so that compaction cannot move the page before we are done with it.
+
+static const uint32_t * futex_key(const uint32_t * uaddr);
+
+static struct futex ** futex_bucket(const void * pp);
+
+// Returns the futex with key /key/, or NULL if there is none. If /create/ is
+// set, a futex is created from the free list if there is none; NULL then means
+// the free list is empty (see futex_fill).
+
+static struct futex * futex_lookup(const uint32_t * key, int create);
+static void futex_free(struct futex * fx);
+
+// Makes sure the free list has an entry, carving a new page into futexes if
+// it is empty. Returns 0, or -ENOMEM if memory is out of pages. Must be called
+// without the thread manager lock held, since taking a page may need the
+// balloon driver.
+
+static int futex_fill(void);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int futex_wait(const uint32_t * uaddr, uint32_t val) {
+    const uint32_t * key;
+    struct futex * fx;
+    int saved_intr_state;
+    int result;
+
+    trace("%s(%p,%u)", __func__, uaddr, (unsigned int)val);
+
+    if (futex_fill() < 0)
+        return -ENOMEM;
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    key = futex_key(uaddr);
+    if (key == NULL) {
+        thrmgr_lock_release(saved_intr_state);
+        return -EINVAL;
+    }
+
+    // The owner changes the word before calling futex_wake, which needs the
+    // lock we hold, so a wake-up cannot slip in between the check and the
+    // wait.
+
+    if (*(volatile const uint32_t *)key != val) {
+        thrmgr_lock_release(saved_intr_state);
+        return -EAGAIN;
+    }
+
+    // Another hart may have used up the entry futex_fill left us
+
+    fx = futex_lookup(key, 1);
+    if (fx == NULL) {
+        thrmgr_lock_release(saved_intr_state);
+        return -ENOMEM;
+    }
+
+    fx->nwaiters++;
+    result = condition_wait_intr(&fx->cond);
+
+    if (--fx->nwaiters == 0)
+        futex_free(fx);
+
+    thrmgr_lock_release(saved_intr_state);
+    return result;
+}
+
+int futex_wake(const uint32_t * uaddr, int cnt) {
+    const uint32_t * key;
+    struct futex * fx;
+    int saved_intr_state;
+    int woken = 0;
+
+    trace("%s(%p,%d)", __func__, uaddr, cnt);
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    key = futex_key(uaddr);
+    if (key == NULL) {
+        thrmgr_lock_release(saved_intr_state);
+        return -EINVAL;
+    }
+
+    fx = futex_lookup(key, 0);
+
+    // Woken threads stay counted in nwaiters until they run, so the futex
+    // is not freed under us.
+
+    while (fx != NULL && woken < cnt && condition_signal(&fx->cond) >= 0)
+        woken++;
+
+    thrmgr_lock_release(saved_intr_state);
+    return woken;
+}
+
+int futex_page_busy(const void * pp) {
+    const struct futex * fx;
+
+    for (fx = *futex_bucket(pp); fx != NULL; fx = fx->next) {
+        if ((uintptr_t)fx->key / PAGE_SIZE == (uintptr_t)pp / PAGE_SIZE)
+            return 1;
+    }
+
+    return 0;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+const uint32_t * futex_key(const uint32_t * uaddr) {
+    if ((uintptr_t)uaddr % sizeof(uint32_t) != 0)
+        return NULL;
+
+    return memory_translate_user(uaddr, PTE_R | PTE_U);
+}
+
+struct futex ** futex_bucket(const void * pp) {
+    return &futex_hash[(uintptr_t)pp / PAGE_SIZE % FUTEX_HASH_CNT];
+}
+
+struct futex * futex_lookup(const uint32_t * key, int create) {
+    struct futex ** const bucket = futex_bucket(key);
+    struct futex * fx;
+
+    for (fx = *bucket; fx != NULL; fx = fx->next) {
+        if (fx->key == key)
+            return fx;
+    }
+
+    if (!create)
+        return NULL;
+
+    fx = futex_free_list;
+    if (fx == NULL)
+        return NULL;
+    futex_free_list = fx->next;
+
+    fx->key = key;
+    fx->nwaiters = 0;
+    fx->next = *bucket;
+    *bucket = fx;
+    return fx;
+}
+
+int futex_fill(void) {
+    struct futex * page;
+    int saved_intr_state;
+    int empty;
+    int i;
+
+    saved_intr_state = thrmgr_lock_acquire();
+    empty = (futex_free_list == NULL);
+    thrmgr_lock_release(saved_intr_state);
+
+    if (!empty)
+        return 0;
+
+    page = memory_reserve_page();
+    if (page == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(struct futex); i++)
+        condition_init(&page[i].cond, "futex");
+
+    saved_intr_state = thrmgr_lock_acquire();
+    for (i = 0; i < PAGE_SIZE / sizeof(struct futex); i++) {
+        page[i].next = futex_free_list;
+        futex_free_list = &page[i];
+    }
+    thrmgr_lock_release(saved_intr_state);
+    return 0;
+}
+
+void futex_free(struct futex * fx) {
+    struct futex ** link = futex_bucket(fx->key);
+
+    while (*link != fx)
+        link = &(*link)->next;
+
+    // Nothing waits on the condition any more, so it can be reused as is
+
+    *link = fx->next;
+    fx->next = futex_free_list;
+    futex_free_list = fx;
+}
@@ -0,0 +1,46 @@
+// futex.h - Fast user-space locking support
+//
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <stdint.h>
+
+// A futex is a 32-bit word in user memory. User programs implement locks and
+// condition variables with atomic operations on the word, and enter the kernel
+// only to sleep when they cannot make progress and to wake sleepers. Futexes
+// are keyed by the physical address of the word, so threads that map the same
+// word at different virtual addresses meet on the same futex. A page with
+// sleepers on one of its futexes is not migrated by memory compaction.
+
+// Operations of the futex system call; must match user/syscall.h
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// int futex_wait(const uint32_t * uaddr, uint32_t val)
+// Puts the running thread to sleep on the futex at user address /uaddr/ if the
+// word there still holds /val/. Checking the word and going to sleep are
+// atomic with respect to futex_wake. Returns 0 after being woken, -EAGAIN if
+// the word did not hold /val/, -EINVAL if /uaddr/ is not an aligned address
+// of a mapped user page, -ENOMEM if there is no memory to track the sleeper,
+// or -EINTR if the process is exiting.
+
+extern int futex_wait(const uint32_t * uaddr, uint32_t val);
+
+// int futex_wake(const uint32_t * uaddr, int cnt)
+// Wakes up to /cnt/ threads sleeping on the futex at user address /uaddr/,
+// longest sleeper first. Returns the number of threads woken, or -EINVAL if
+// /uaddr/ is not an aligned address of a mapped user page.
+
+extern int futex_wake(const uint32_t * uaddr, int cnt);
+
+// Returns 1 if a thread sleeps on a futex in the physical page /pp/, 0
+// otherwise. Called by memory compaction, which holds the thread manager lock.
+
+extern int futex_page_busy(const void * pp);
+
+#endif // _FUTEX_H_
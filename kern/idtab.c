@@ -0,0 +1,110 @@
+// idtab.c - Growable tables of objects indexed by small integer ids
+//
+
+#include "idtab.h"
+#include "memory.h"
+#include "error.h"
+#include "halt.h"
+
+// INTERNAL MACRO DEFINITIONS
+//
+
+// A free slot holds the id of the next free slot plus one, shifted left and
+// tagged with bit 0, so that it cannot be mistaken for an object pointer. The
+// end of the free list (-1) is stored as 1.
+
+#define FREE_LINK(next) ((void *)((((uintptr_t)((next) + 1)) << 1) | 1))
+#define FREE_NEXT(slot) ((int)((uintptr_t)(slot) >> 1) - 1)
+
+#define SLOT(tab,id) ((tab)->chunk[(id) / IDTAB_CHUNK_IDS][(id) % IDTAB_CHUNK_IDS])
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+// Adds a chunk to the table and puts its ids on the free list. Returns 0 on
+// success or -EAGAIN if the table is at its limit or out of pages.
+
+static int idtab_grow(struct idtab * tab);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void idtab_init(struct idtab * tab, int limit) {
+    int i;
+
+    assert (0 < limit && limit <= IDTAB_MAX_IDS);
+
+    for (i = 0; i < IDTAB_MAX_CHUNKS; i++)
+        tab->chunk[i] = NULL;
+
+    tab->size = 0;
+    tab->limit = limit;
+    tab->free_head = -1;
+    tab->used = 0;
+}
+
+int idtab_alloc(struct idtab * tab, void * obj) {
+    int result;
+    int id;
+
+    assert (((uintptr_t)obj & 1) == 0);
+
+    if (tab->free_head < 0) {
+        result = idtab_grow(tab);
+        if (result < 0)
+            return result;
+    }
+
+    id = tab->free_head;
+    tab->free_head = FREE_NEXT(SLOT(tab, id));
+    SLOT(tab, id) = obj;
+    tab->used++;
+    return id;
+}
+
+void idtab_free(struct idtab * tab, int id) {
+    assert (idtab_get(tab, id) != NULL);
+
+    SLOT(tab, id) = FREE_LINK(tab->free_head);
+    tab->free_head = id;
+    tab->used--;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+int idtab_grow(struct idtab * tab) {
+    void ** chunk;
+    int first, last;
+    int id;
+
+    first = tab->size;
+
+    if (first >= tab->limit)
+        return -EAGAIN;
+    
+    // memory_reserve_page neither sleeps nor panics, so we can call it with
+    // the owner's spinlock held. The slots are all written below, so the page
+    // need not be zeroed.
+
+    chunk = memory_reserve_page();
+    if (chunk == NULL)
+        return -EAGAIN;
+
+    last = first + IDTAB_CHUNK_IDS;
+    if (last > tab->limit)
+        last = tab->limit;
+
+    for (id = first; id < last; id++)
+        chunk[id - first] = FREE_LINK((id+1 < last) ? id+1 : tab->free_head);
+    
+    tab->free_head = first;
+
+    // Publish the chunk before the new size, for idtab_get without a lock
+
+    tab->chunk[first / IDTAB_CHUNK_IDS] = chunk;
+    __sync_synchronize();
+    tab->size = last;
+
+    return 0;
+}
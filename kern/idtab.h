@@ -0,0 +1,76 @@
+// idtab.h - Growable tables of objects indexed by small integer ids
+//
+
+#ifndef _IDTAB_H_
+#define _IDTAB_H_
+
+#include "memory.h" // PAGE_SIZE
+
+#include <stdint.h>
+
+// An id table maps ids 0, 1, 2, ... to object pointers. It is a two-level
+// table: a fixed directory of chunk pointers, each chunk a page of slots taken
+// from the page allocator when the table grows. Free slots are linked into a
+// free list through the slots themselves, so allocating and freeing an id is
+// O(1). Chunks are never freed, and a chunk pointer never changes once set,
+// which lets idtab_get read the table without a lock.
+//
+// The owner of a table serializes idtab_alloc and idtab_free with a lock of
+// its choosing (the thread manager lock for thread ids, proctab_lock for
+// process ids). Objects must be at least 2-byte aligned.
+
+#define IDTAB_CHUNK_IDS ((int)(PAGE_SIZE / sizeof(void *)))
+#define IDTAB_MAX_CHUNKS 16
+#define IDTAB_MAX_IDS (IDTAB_CHUNK_IDS * IDTAB_MAX_CHUNKS)
+
+struct idtab {
+    void ** chunk[IDTAB_MAX_CHUNKS];
+    volatile int size; // ids covered by allocated chunks
+    int limit; // the table does not grow past this many ids
+    int free_head; // first free id or -1
+    int used; // ids in use
+};
+
+// Initializes an empty table that will hold up to /limit/ ids. No memory is
+// allocated until the first idtab_alloc.
+
+extern void idtab_init(struct idtab * tab, int limit);
+
+// Assigns a free id to /obj/ and returns it. The most recently freed id is
+// reused first; the ids of a new chunk are handed out in increasing order.
+// Grows the table by a chunk if there are no free ids. Returns -EAGAIN if the
+// table is at its limit or no page is available for a new chunk.
+
+extern int idtab_alloc(struct idtab * tab, void * obj);
+
+// Returns /id/ to the free list. The id must be in use.
+
+extern void idtab_free(struct idtab * tab, int id);
+
+static inline int idtab_size(const struct idtab * tab);
+static inline void * idtab_get(const struct idtab * tab, int id);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+// Returns one more than the largest id the table can currently hold. Use as
+// the bound when iterating over all ids.
+
+static inline int idtab_size(const struct idtab * tab) {
+    return tab->size;
+}
+
+// Returns the object with the given id, or NULL if the id is not in use or is
+// out of range.
+
+static inline void * idtab_get(const struct idtab * tab, int id) {
+    void * obj;
+
+    if (id < 0 || tab->size <= id)
+        return NULL;
+
+    obj = tab->chunk[id / IDTAB_CHUNK_IDS][id % IDTAB_CHUNK_IDS];
+    return ((uintptr_t)obj & 1) ? NULL : obj;
+}
+
+#endif // _IDTAB_H_
@@ -15,6 +15,8 @@
 #include "csr.h"
 #include "plic.h"
 #include "timer.h"
+#include "smp.h"
+#include "console.h"
 
 #include <stddef.h>
 
@@ -33,10 +35,17 @@ char intr_initialized = 0;
 // INTERNAL GLOBAL VARIABLE DEFINITIONS
 //
 
+// External interrupts are only routed to hart 0 (see plic.c), so the ISR
+// statistics are only updated there and need no lock. Times are in mtime
+// ticks and cover the ISR call, during which interrupts are disabled.
+
 static struct {
     void (*isr)(int,void*);
     void * isr_aux;
     int prio;
+    unsigned long cnt; // ISR calls
+    uint64_t time_total; // time spent in the ISR
+    uint64_t time_max; // longest ISR call
 } isrtab[NIRQ];
 
 // INTERNAL FUNCTION DECLARATIONS
@@ -54,7 +63,7 @@ void intr_init(void) {
     plic_init();
 
     csrw_sip(0); // clear all pending interrupts
-    csrw_sie(RISCV_SIE_SEIE); //enable interrupts from plic
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_SSIE); //enable interrupts from plic and IPIs
 
     intr_initialized = 1;
 }
@@ -86,9 +95,22 @@ void intr_disable_irq(int irqno) {
     plic_disable_irq(irqno);
 }
 
+void intr_report(void) {
+    int i;
+
+    kprintf("irq      calls  total us    max us\n");
+
+    for (i = 0; i < NIRQ; i++) {
+        if (isrtab[i].cnt == 0)
+            continue;
+        kprintf("%3d  %9lu  %8lu  %8lu\n", i, isrtab[i].cnt,
+            ticks_to_us(isrtab[i].time_total), ticks_to_us(isrtab[i].time_max));
+    }
+}
+
 // void intr_handler(int code, struct trap_frame * tfr)
 // Called from trapasm.s to handle an interrupt. Dispataches to
-// timer_intr_handler and extern_intr_handler.
+// timer_intr_handler, extern_intr_handler and smp_ipi_handler.
 
 void intr_handler(int code, struct trap_frame * tfr) {
     switch (code) {
@@ -98,21 +120,30 @@ void intr_handler(int code, struct trap_frame * tfr) {
     case RISCV_SCAUSE_INTR_EXCODE_STI:
         timer_intr_handler(tfr);
         break;
+    case RISCV_SCAUSE_INTR_EXCODE_SSI:
+        smp_ipi_handler();
+        break;
     default:
         panic("unhandled interrupt");
         break;
     }
 
-    // If we were running user mode, yield thread.
+    // Switch threads if the time slice has run out or a higher-priority
+    // thread is waiting, whether we interrupted user mode or the kernel.
+    // Other interrupts, such as a UART or block device completion, leave the
+    // thread running.
 
     if ((tfr->sstatus & RISCV_SSTATUS_SPP) == 0)
-        thread_yield();
+        thread_preempt_check();
+    else
+        thread_preempt_kernel();
 }
 
 // INTERNAL FUNCTION DEFINITIONS
 //
 
 void extern_intr_handler(void) {
+    uint64_t t0, t;
     int irqno;
 
     irqno = plic_claim_irq();
@@ -126,7 +157,14 @@ void extern_intr_handler(void) {
     if (isrtab[irqno].isr == NULL)
         panic("unhandled irq");
     
+    t0 = csrr_time();
     isrtab[irqno].isr(irqno, isrtab[irqno].isr_aux);
+    t = csrr_time() - t0;
+
+    isrtab[irqno].cnt++;
+    isrtab[irqno].time_total += t;
+    if (isrtab[irqno].time_max < t)
+        isrtab[irqno].time_max = t;
 
     plic_close_irq(irqno);
 }
@@ -38,6 +38,12 @@ extern void intr_register_isr (
 extern void intr_enable_irq(int irqno);
 extern void intr_disable_irq(int irqno);
 
+// Prints the number of calls and the total and longest run time of each ISR
+// that has run. ISRs run with interrupts disabled, so the longest run bounds
+// the interrupt latency they add. Deferred work is reported by workq_report.
+
+extern void intr_report(void);
+
 // INLINE FUNCTION DEFINITIONS
 //
 
@@ -10,7 +10,18 @@
 boot_block_t boot_block;
 file_t file_array[MAX_FILES];
 struct io_intf* vioblk_io;
-static struct lock FSLock;
+// FSLock protects the boot block and file_array. Both are read far more often
+// than they change, so it is a reader-writer lock and readers of different
+// files run in parallel. Each open file also has a pos_lock, held across a
+// whole read, write or seek, so that threads sharing the file do not race on
+// its position. BlkLock only serializes the seek and transfer pairs on
+// vioblk_io, which has a single device position shared by all files. Locks
+// are taken in that order.
+static struct rwlock FSLock;
+static struct lock BlkLock;
+
+static long fs_devread(uint64_t pos, void* buf, unsigned long n);
+static long fs_devwrite(uint64_t pos, const void* buf, unsigned long n);
 
 
 // FUNCTION DECLARATIONS
@@ -31,10 +42,12 @@ int fs_mount(struct io_intf* io) {
     for(int i = 0; i < MAX_FILES; i++) {
         file_array[i].flag = 0;     // sets the flags for each of our file structs to 0
         file_array[i].io.refcnt = 0;    // sets the refcnt for each of our file structs to 0
+        lock_init(&file_array[i].pos_lock, "KFSPosLock");
     }
 
     //Initialize the lock
-    lock_init(&FSLock, "KFSLock");
+    rwlock_init(&FSLock, "KFSLock");
+    lock_init(&BlkLock, "KFSBlkLock");
     
     trace("File Mount Successful!\n"); 
     return 0;       // return 0 if everything was successful
@@ -50,7 +63,7 @@ int fs_open(const char* name, struct io_intf** io) {
     dentry_t dentry;
     // creates an fs_ops struct that will have how our file can read,write, etc.
     console_printf("Thread <%s> trying to open file %s and acquire KFS Lock\n", thread_name(running_thread()), name);
-    lock_acquire(&FSLock);   //  Acquire the Read/Write Lock before opening
+    rwlock_acquire_read(&FSLock);   //  Looking up the directory only needs a read hold
     static const struct io_ops fs_ops = {   
 		.close = fs_close,      // sets .close interface to fs one
 		.read = fs_read,        // sets .read interface to fs one
@@ -64,12 +77,24 @@ int fs_open(const char* name, struct io_intf** io) {
             break;
         }
     }
+    if(i == boot_block.num_dentry) {    // checks if we didnt find file
+        rwlock_release_read(&FSLock);
+        return -EBADFMT;    // returns bad file management error code
+    }
+    // Claiming a file struct needs a write hold. If another thread is already
+    // upgrading, step aside and queue up as a writer instead; the dentry stays
+    // valid because the directory does not change after mounting.
+    if(rwlock_upgrade(&FSLock) < 0) {
+        rwlock_release_read(&FSLock);
+        rwlock_acquire_write(&FSLock);
+    }
     for(j = 0; j < MAX_FILES; j++) {       // finds an empty slot in the file struct array
         if(file_array[j].flag == 0) {   // if the flag is 0 exit (flag 0 means file is not open)
             break;
         }
     }
-    if(i == boot_block.num_dentry || j == MAX_FILES) {    // checks if we didnt find file or too many files or open
+    if(j == MAX_FILES) {    // checks if too many files are open
+        rwlock_release_write(&FSLock);
         return -EBADFMT;    // returns bad file management error code
     }
     file_array[j].io.ops = &fs_ops;     // Set io ops to the fs_ops struct created earlier
@@ -78,19 +103,15 @@ int fs_open(const char* name, struct io_intf** io) {
     file_array[j].flag = 1;     // Set the file flag to 1 to indicate it is open
     *io = &file_array[j].io;    // Sets the given pointer to the io interfance for the file
     file_array[j].io.refcnt += 1; 
+    rwlock_downgrade(&FSLock);      // the slot is ours, let other threads open files while we read the length
     uint32_t offset = (file_array[j].inode + 1)*FS_BLKSZ;       // calculates the offset to the file's byte_len
-    error = ioseek(vioblk_io, offset);      // sets the vioblk position to the offset
-    if(error < 0) {
-            lock_release(&FSLock);
-            return error;     
-    }
-    error = ioread(vioblk_io, &file_array[j].byte_len, sizeof(uint32_t));      // reads 4 byte for the file's byte length
+    error = fs_devread(offset, &file_array[j].byte_len, sizeof(uint32_t));      // reads 4 byte for the file's byte length
     if(error < 0) {
-            lock_release(&FSLock);
+            rwlock_release_read(&FSLock);
             return error;     
     }
     trace("File was successfully opened and initialized!");
-    lock_release(&FSLock);   // Release the read/write lock after opening
+    rwlock_release_read(&FSLock);   // Release the read/write lock after opening
     console_printf("Thread <%s> finished opening file %s and released KFS Lock\n", thread_name(running_thread()), name);
     return 0;   
 }
@@ -99,6 +120,7 @@ int fs_open(const char* name, struct io_intf** io) {
 // Purpose: Closes a file by setting the flag to 0
 void fs_close(struct io_intf* io) {
     file_t* close_file = (file_t*) io;      // gets a pointer to the file we want to close
+    rwlock_acquire_write(&FSLock);   // file_array changes when the last reference goes away
     io->refcnt -= 1;
     if(io->refcnt == 0){
         close_file->flag = 0;       // sets the flag to 0 to indicate that file is closed
@@ -106,6 +128,7 @@ void fs_close(struct io_intf* io) {
     }
     else
         trace("File not yet closed, other references still exist\n");
+    rwlock_release_write(&FSLock);
     return;
 }
 // Input: io_intf* (io), void* (buf), unsigned long (n)
@@ -117,7 +140,8 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
         return -EINVAL;     // check error code
     }
     file_t* my_file = (file_t*) io;     // gets the file pointer
-    lock_acquire(&FSLock);   //  Acquire the Read/Write Lock before writing
+    rwlock_acquire_read(&FSLock);   //  Writing file data leaves the directory alone, so a read hold is enough
+    lock_acquire(&my_file->pos_lock);   // the position must not move under us
     uint64_t f_pos = my_file->file_pos;     // gets the file position
     // console_printf("File Pos: %d\n", my_file->file_pos);
     uint64_t f_len = my_file->byte_len;     // gets the file length
@@ -135,39 +159,33 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
     uint64_t db_addr;
     int error; 
     for(int i = db_start; i <= db_end; i++) {       // starts the data block start
-        error = ioseek(vioblk_io, inode_addr+sizeof(db_num)*(i+1));      // sets the vioblk position to inode address
+        error = fs_devread(inode_addr+sizeof(db_num)*(i+1), &db_num, sizeof(db_num));      // reads from the inode offset address (gets the datablock num)
         if(error < 0) {
-            lock_release(&FSLock);
-            return error;     // if the ioseek fails return an error
-        }
-        error = ioread(vioblk_io, &db_num, sizeof(db_num));      // reads from the inode offset address (gets the datablock num)
-        if(error < 0) {
-            lock_release(&FSLock);
-            return error;     
+            lock_release(&my_file->pos_lock);
+            rwlock_release_read(&FSLock);
+            return error;     // if the read fails return an error
         }
        
         db_addr = (boot_block.num_inodes + db_num + 1) * FS_BLKSZ;  // calculates the address of the data block
-        error = ioseek(vioblk_io, db_addr + db_pos);        //  set the position to the address of the datablock
-        if(error < 0) {
-            lock_release(&FSLock);
-            return error;     
-        }
         if ((db_pos + n) <= FS_BLKSZ){      // checks if the amount of we want to write exceeds the blksz
-            error = iowrite(vioblk_io, buf + num_write, n);     // write n bytes to correct location in buf
+            error = fs_devwrite(db_addr + db_pos, buf + num_write, n);     // write n bytes to correct location in buf
             if(error < 0) {
-                lock_release(&FSLock);
+                lock_release(&my_file->pos_lock);
+                rwlock_release_read(&FSLock);
                 return error;     
             }
             num_write += n;     // increase the number num_write
             my_file->file_pos += num_write;     // increase the file position by the number of bytes written
             trace("Successfully wrote %d bytes to file position!", num_write);     
-            lock_release(&FSLock);
+            lock_release(&my_file->pos_lock);
+            rwlock_release_read(&FSLock);
             return num_write;       // return number written
         }
         else {
-            error = iowrite(vioblk_io, buf + num_write, FS_BLKSZ - db_pos);      // write n bytes to correct location in buf
+            error = fs_devwrite(db_addr + db_pos, buf + num_write, FS_BLKSZ - db_pos);      // write n bytes to correct location in buf
             if(error < 0) {
-                lock_release(&FSLock);
+                lock_release(&my_file->pos_lock);
+                rwlock_release_read(&FSLock);
                 return error;     
             }
             num_write += (FS_BLKSZ - db_pos);       // increase the number num_write
@@ -176,7 +194,8 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
         }
     }
     trace("Successfully wrote %d bytes to file position!", num_write);
-    lock_release(&FSLock);   // Release the read/write lock after writing
+    lock_release(&my_file->pos_lock);
+    rwlock_release_read(&FSLock);   // Release the read/write lock after writing
     return num_write;       // return number written
 }
 // Input: io_intf* (io), void* (buf), unsigned long (n)
@@ -188,6 +207,8 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n) {
         return -EINVAL; // check error code
     }
     file_t* my_file = (file_t*) io;     // sets up file struct pointer
+    rwlock_acquire_read(&FSLock);   //  Other readers may hold the lock at the same time
+    lock_acquire(&my_file->pos_lock);   // but not of the same position
     uint64_t f_pos = my_file->file_pos;     // store file position
     uint64_t f_len = my_file->byte_len;     // store byt elength
     uint64_t inode = my_file->inode;        // store inode number
@@ -205,42 +226,34 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n) {
     uint32_t db_num;
     uint64_t db_addr;
     int error; 
-    // check if current thread already has the lock
-    lock_acquire(&FSLock);   //  Acquire the Read/Write Lock before reading
     for(int i = db_start; i <= db_end; i++) {   // runs from the data block start to data block end 
-        error = ioseek(vioblk_io, inode_addr+(i+1)*sizeof(db_num));     // set position within vioblock
+        error = fs_devread(inode_addr+(i+1)*sizeof(db_num), &db_num, sizeof(db_num));     // read the data block number
         if(error < 0) {
-            lock_release(&FSLock);
-            return error;     
-        }
-        error = ioread(vioblk_io, &db_num, sizeof(db_num));     // read the data block number
-        if(error < 0) {
-            lock_release(&FSLock);
+            lock_release(&my_file->pos_lock);
+            rwlock_release_read(&FSLock);
             return error;     
         }
         
         db_addr = (boot_block.num_inodes + db_num + 1) * FS_BLKSZ;      // calculates the offset for data block addr
-        error = ioseek(vioblk_io, db_addr + db_pos);        // set position within vioblock to data block addr
-        if(error < 0) {
-            lock_release(&FSLock);
-            return error;     
-        }
         if ((db_pos + n) <= FS_BLKSZ){      // check if amount we are trying to read exceeds the block size
-            error = ioread(vioblk_io, buf + num_read, n);   // read from address
+            error = fs_devread(db_addr + db_pos, buf + num_read, n);   // read from address
             if(error < 0) {
-                lock_release(&FSLock);
+                lock_release(&my_file->pos_lock);
+                rwlock_release_read(&FSLock);
                 return error;     
             }
             num_read += n;      // increment the number of bytes read
             my_file->file_pos += num_read;      // increment the file_pos   
             trace("Successfully read file!"); 
-            lock_release(&FSLock);
+            lock_release(&my_file->pos_lock);
+            rwlock_release_read(&FSLock);
             return num_read;    // return num read
         }
         else {
-            error = ioread(vioblk_io, buf + num_read, FS_BLKSZ - db_pos);       // read from address
+            error = fs_devread(db_addr + db_pos, buf + num_read, FS_BLKSZ - db_pos);       // read from address
             if(error < 0) {
-                lock_release(&FSLock);
+                lock_release(&my_file->pos_lock);
+                rwlock_release_read(&FSLock);
                 return error;     
             }
             num_read += (FS_BLKSZ - db_pos);        // increment number of bytes read
@@ -249,7 +262,8 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n) {
         }
     }
     trace("Successfully read file!"); 
-    lock_release(&FSLock);   // Release the read/write lock after reading
+    lock_release(&my_file->pos_lock);
+    rwlock_release_read(&FSLock);   // Release the read/write lock after reading
     return num_read;    // return num read
 }
 
@@ -257,12 +271,13 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n) {
 // Output: int (error)
 // Purpose: Performs a device-specific function based on cmd.
 int fs_ioctl(struct io_intf* io, int cmd, void* arg) {
-    // TODO please add locking
-    lock_acquire(&FSLock);   //  Acquire the Read/Write Lock before performing ioctl
     int result;
     if(io == NULL) {
         return -EINVAL; // check error code
     }
+    rwlock_acquire_read(&FSLock);   //  None of the commands change the directory or file_array
+    lock_acquire(&((file_t*) io)->pos_lock);    // GETPOS and SETPOS must not interleave with a read or write
+
     switch(cmd) {
         case(IOCTL_GETLEN): // if we are trying to get length run fs_getlen
             result = fs_getlen((file_t*) io, arg);
@@ -279,7 +294,8 @@ int fs_ioctl(struct io_intf* io, int cmd, void* arg) {
         default:    // return 
             result = -EINVAL;
     }
-    lock_release(&FSLock);   // Release the read/write lock after performing ioctl
+    lock_release(&((file_t*) io)->pos_lock);
+    rwlock_release_read(&FSLock);   // Release the read/write lock after performing ioctl
     return result;  // return result
 }
 
@@ -325,4 +341,34 @@ int fs_getblksz(file_t* fd, void* arg) {
     *((uint64_t*)arg) = FS_BLKSZ;   // gets the block size
 
     return 0;   // return 0 if successful
-}
\ No newline at end of file
+}
+
+// Input: uint64_t (pos), void* (buf), unsigned long (n)
+// Output: long (bytes read or error code)
+// Purpose: Reads n bytes at byte offset pos of the disk. The seek and the read
+// are done under BlkLock so that another thread cannot move the shared device
+// position in between.
+static long fs_devread(uint64_t pos, void* buf, unsigned long n) {
+    long result;
+    lock_acquire(&BlkLock);
+    result = ioseek(vioblk_io, pos);    // sets the vioblk position to pos
+    if(result >= 0) {
+        result = ioread(vioblk_io, buf, n);     // reads n bytes from pos
+    }
+    lock_release(&BlkLock);
+    return result;
+}
+
+// Input: uint64_t (pos), const void* (buf), unsigned long (n)
+// Output: long (bytes written or error code)
+// Purpose: Writes n bytes at byte offset pos of the disk, like fs_devread.
+static long fs_devwrite(uint64_t pos, const void* buf, unsigned long n) {
+    long result;
+    lock_acquire(&BlkLock);
+    result = ioseek(vioblk_io, pos);    // sets the vioblk position to pos
+    if(result >= 0) {
+        result = iowrite(vioblk_io, buf, n);    // writes n bytes at pos
+    }
+    lock_release(&BlkLock);
+    return result;
+}
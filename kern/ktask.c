@@ -0,0 +1,241 @@
+// ktask.c - Stackless kernel tasks
+//
+
+#ifdef KTASK_TRACE
+#define TRACE
+#endif
+
+#ifdef KTASK_DEBUG
+#define DEBUG
+#endif
+
+#include "ktask.h"
+#include "thread.h"
+#include "timer.h"
+#include "console.h"
+#include "halt.h"
+
+#include <stddef.h>
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+// Task states. A task that calls ktask_wait becomes WAITING while its step
+// function is still running, and may be woken and READY again before the step
+// function returns; the runner only picks it up after that.
+
+#define KTASK_IDLE 0 // not started, or finished
+#define KTASK_READY 1 // on the run queue
+#define KTASK_RUNNING 2 // step function running
+#define KTASK_WAITING 3 // on the wait list of a condition
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static char ktask_initialized = 0;
+
+// Ready tasks in the order they became ready, and the condition the runner
+// waits on when there are none. Protected by the thread manager lock.
+
+static struct ktask * run_head;
+static struct ktask * run_tail;
+static struct condition run_cond;
+
+// Tasks that were ever started, newest first
+
+static struct ktask * ktask_list;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void ktask_runner(void * aux);
+
+// Appends /task/ to the run queue and wakes the runner. Must be called with
+// the thread manager lock held.
+
+static void make_ready(struct ktask * task);
+
+static const char * state_name(int state);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void ktask_init(void) {
+    int tid;
+
+    if (ktask_initialized)
+        return;
+
+    ktask_initialized = 1;
+    condition_init(&run_cond, "ktask");
+
+    tid = thread_spawn("ktask", ktask_runner, NULL);
+    if (tid < 0)
+        panic("ktask_init: thread_spawn failed");
+}
+
+void ktask_setup (
+    struct ktask * task, const char * name,
+    int (*step)(struct ktask * task), void * arg)
+{
+    task->name = name;
+    task->step = step;
+    task->arg = arg;
+    task->state = KTASK_IDLE;
+    task->listed = 0;
+    task->next = NULL;
+    task->all_next = NULL;
+    task->step_cnt = 0;
+    task->wait_cnt = 0;
+    task->step_max = 0;
+}
+
+void ktask_start(struct ktask * task) {
+    int saved_intr_state;
+
+    trace("%s(%s)", __func__, task->name);
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    if (!task->listed) {
+        task->listed = 1;
+        task->all_next = ktask_list;
+        ktask_list = task;
+    }
+
+    if (task->state == KTASK_IDLE)
+        make_ready(task);
+
+    thrmgr_lock_release(saved_intr_state);
+}
+
+void ktask_wait(struct ktask * task, struct condition * cond) {
+    assert (task->state == KTASK_RUNNING);
+
+    task->state = KTASK_WAITING;
+    task->wait_cnt++;
+    task->next = NULL;
+
+    if (cond->task_tail != NULL)
+        cond->task_tail->next = task;
+    else
+        cond->task_head = task;
+    cond->task_tail = task;
+}
+
+int ktask_wake_all(struct condition * cond) {
+    int cnt = 0;
+
+    while (ktask_wake_one(cond))
+        cnt++;
+
+    return cnt;
+}
+
+int ktask_wake_one(struct condition * cond) {
+    struct ktask * const task = cond->task_head;
+
+    if (task == NULL)
+        return 0;
+
+    cond->task_head = task->next;
+    if (cond->task_head == NULL)
+        cond->task_tail = NULL;
+
+    assert (task->state == KTASK_WAITING);
+    make_ready(task);
+    return 1;
+}
+
+void ktask_report(void) {
+    const struct ktask * task;
+
+    kprintf("ktask             state     steps     waits  max step us\n");
+
+    for (task = ktask_list; task != NULL; task = task->all_next) {
+        kprintf("%16s  %7s  %8lu  %8lu  %11lu\n", task->name,
+            state_name(task->state), task->step_cnt, task->wait_cnt,
+            ticks_to_us(task->step_max));
+    }
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void ktask_runner(void * aux __attribute__ ((unused))) {
+    struct ktask * task;
+    int saved_intr_state;
+    uint64_t t0, t1;
+    int result;
+
+    for (;;) {
+        saved_intr_state = thrmgr_lock_acquire();
+
+        while (run_head == NULL)
+            condition_wait(&run_cond);
+
+        task = run_head;
+        run_head = task->next;
+        if (run_head == NULL)
+            run_tail = NULL;
+        task->next = NULL;
+        task->state = KTASK_RUNNING;
+
+        thrmgr_lock_release(saved_intr_state);
+
+        debug("ktask: running <%s>", task->name);
+
+        t0 = get_mtime();
+        result = task->step(task);
+        t1 = get_mtime();
+
+        saved_intr_state = thrmgr_lock_acquire();
+
+        task->step_cnt++;
+        if (task->step_max < t1 - t0)
+            task->step_max = t1 - t0;
+
+        switch (result) {
+        case KTASK_DONE:
+            assert (task->state == KTASK_RUNNING);
+            task->state = KTASK_IDLE;
+            break;
+        case KTASK_YIELD:
+            assert (task->state == KTASK_RUNNING);
+            make_ready(task);
+            break;
+        case KTASK_WAIT:
+            // Waiting, or already woken and back on the run queue
+            assert (task->state != KTASK_RUNNING);
+            break;
+        default:
+            panic("ktask: bad step result");
+        }
+
+        thrmgr_lock_release(saved_intr_state);
+    }
+}
+
+void make_ready(struct ktask * task) {
+    task->state = KTASK_READY;
+    task->next = NULL;
+
+    if (run_tail != NULL)
+        run_tail->next = task;
+    else
+        run_head = task;
+    run_tail = task;
+
+    condition_signal(&run_cond);
+}
+
+const char * state_name(int state) {
+    static const char * const names[] = {
+        [KTASK_IDLE] = "idle",
+        [KTASK_READY] = "ready",
+        [KTASK_RUNNING] = "running",
+        [KTASK_WAITING] = "waiting"
+    };
+
+    return names[state];
+}
@@ -0,0 +1,90 @@
+// ktask.h - Stackless kernel tasks
+//
+
+#ifndef _KTASK_H_
+#define _KTASK_H_
+
+#include "thread.h" // struct condition
+
+#include <stdint.h>
+
+// A kernel task is a state machine driven by a step function instead of a
+// thread with its own stack. Each time the task is run, its step function is
+// called on the shared task runner thread, advances the task as far as it can
+// without blocking, and returns. To wait, the step function calls ktask_wait
+// on a condition, with the thread manager lock held, and returns KTASK_WAIT;
+// the next broadcast or signal of the condition runs the task again. State
+// that must survive a wait lives in the task's owner, not on the stack, so a
+// waiting task costs a struct ktask instead of a kernel stack page.
+//
+// Step functions share one thread and must not block: no condition_wait,
+// sleep locks or alarm_sleep. Spinlocks and the thread manager lock are fine.
+// Tasks suit driver and file system background work that is mostly waiting,
+// such as a device state machine driven by interrupts.
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// Values returned by a step function
+
+#define KTASK_DONE 0 // the task has finished; ktask_start runs it again
+#define KTASK_WAIT 1 // the task called ktask_wait
+#define KTASK_YIELD 2 // run the task again after the other ready tasks
+
+// A task is owned by its creator and must stay valid while started. The
+// scheduling fields are protected by the thread manager lock.
+
+struct ktask {
+    const char * name;
+    int (*step)(struct ktask * task);
+    void * arg;
+    char state; // see ktask.c
+    char listed; // on the list of tasks for ktask_report
+    struct ktask * next; // link in the run queue or a condition's wait list
+    struct ktask * all_next; // link in the list of tasks for ktask_report
+    unsigned long step_cnt; // step function calls
+    unsigned long wait_cnt; // waits on a condition
+    uint64_t step_max; // longest step, in mtime ticks
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Starts the task runner thread. Must be called after thread_init; calls after
+// the first do nothing, so drivers that use tasks call it in their attach
+// function.
+
+extern void ktask_init(void);
+
+// Initializes a task whose step function is /step/. The argument /arg/ is for
+// the step function's use, through task->arg.
+
+extern void ktask_setup (
+    struct ktask * task, const char * name,
+    int (*step)(struct ktask * task), void * arg);
+
+// Makes a task ready to run. Does nothing if the task is already ready,
+// running or waiting. May be called from an ISR.
+
+extern void ktask_start(struct ktask * task);
+
+// Puts the running task on the wait list of /cond/. Must be called from the
+// task's step function with the thread manager lock held, after checking the
+// condition waited for, and the step function must then return KTASK_WAIT.
+
+extern void ktask_wait(struct ktask * task, struct condition * cond);
+
+// int ktask_wake_all(struct condition * cond)
+// int ktask_wake_one(struct condition * cond)
+// Make the tasks waiting on /cond/, or the one that has waited longest, ready
+// to run. Return the number of tasks woken. Called by condition_broadcast and
+// condition_signal with the thread manager lock held.
+
+extern int ktask_wake_all(struct condition * cond);
+extern int ktask_wake_one(struct condition * cond);
+
+// Prints the state and step counts of every task that was started.
+
+extern void ktask_report(void);
+
+#endif // _KTASK_H_
@@ -0,0 +1,97 @@
+// lock.c - Sleep lock statistics
+//
+
+#include "lock.h"
+#include "string.h"
+#include "timer.h"
+
+// INTERNAL CONSTANTS
+//
+
+// Number of distinct lock names we keep a profile for. Locks with further
+// names all share the last profile, which is reported as "(other)".
+
+#define LOCK_PROF_CNT 32
+
+// EXPORTED GLOBAL VARIABLE DEFINITIONS
+//
+
+unsigned long lock_acquire_cnt;
+unsigned long lock_contended_cnt;
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct lock_prof lock_prof_table[LOCK_PROF_CNT];
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void lock_get_stats(struct lockstat * st) {
+    int saved_intr_state;
+
+    saved_intr_state = thrmgr_lock_acquire();
+    st->acquires = lock_acquire_cnt;
+    st->contended = lock_contended_cnt;
+    st->ctxsw = thread_ctxsw_count();
+    thrmgr_lock_release(saved_intr_state);
+}
+
+struct lock_prof * lock_prof_lookup(const char * name) {
+    struct lock_prof * prof;
+    int saved_intr_state;
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    for (prof = lock_prof_table; prof < lock_prof_table+LOCK_PROF_CNT-1; prof++) {
+        if (prof->name == NULL) {
+            prof->name = name;
+            break;
+        }
+        if (strcmp(prof->name, name) == 0)
+            break;
+    }
+
+    if (prof->name == NULL)
+        prof->name = "(other)";
+
+    thrmgr_lock_release(saved_intr_state);
+    return prof;
+}
+
+void lock_report(unsigned int n) {
+    const struct lock_prof * order[LOCK_PROF_CNT];
+    const struct lock_prof * prof;
+    unsigned int cnt;
+    unsigned int i, j;
+
+    // Sort the profiles in use by number of contended acquisitions. We read
+    // the counters without locking; a count that moves while we print does no
+    // harm.
+
+    cnt = 0;
+
+    for (i = 0; i < LOCK_PROF_CNT; i++) {
+        prof = &lock_prof_table[i];
+        if (prof->name == NULL)
+            continue;
+        for (j = cnt; j > 0 && order[j-1]->contended < prof->contended; j--)
+            order[j] = order[j-1];
+        order[j] = prof;
+        cnt++;
+    }
+
+    if (n < cnt)
+        cnt = n;
+
+    kprintf("lock              acquires  contended   wait us    max us"
+        "   hold us    max us\n");
+
+    for (i = 0; i < cnt; i++) {
+        prof = order[i];
+        kprintf("%16s  %8lu  %9lu  %8lu  %8lu  %8lu  %8lu\n",
+            prof->name, prof->acquires, prof->contended,
+            ticks_to_us(prof->wait_total), ticks_to_us(prof->wait_max),
+            ticks_to_us(prof->hold_total), ticks_to_us(prof->hold_max));
+    }
+}
@@ -16,23 +16,113 @@
 #include "thread.h"
 #include "halt.h"
 #include "console.h"
+#include "error.h"
+#include "csr.h"
+
+#include <stdint.h>
+
+// Contention profile of all sleep locks that share a name, such as the
+// VIOLock of each block device. Times are in timer ticks, read with rdtime.
+// Updated with the thread manager lock held; see lock_report in lock.c.
+
+struct lock_prof {
+    const char * name;
+    unsigned long acquires; // acquisitions
+    unsigned long contended; // acquisitions that had to wait
+    uint64_t wait_total; // time spent waiting by contended acquisitions
+    uint64_t wait_max;
+    uint64_t hold_total; // time the lock was held
+    uint64_t hold_max;
+};
 
 struct lock {
     struct condition cond;
     int tid; // thread holding lock or -1
+    struct lock_prof * prof; // profile for cond.name
+    uint64_t held_since; // rdtime when tid took the lock
+};
+
+// Lock statistics since boot, returned by lock_get_stats and the lockstat
+// system call. The layout is shared with user programs (user/syscall.h).
+
+struct lockstat {
+    unsigned long acquires; // lock_acquire calls that took a lock
+    unsigned long contended; // acquires that had to wait for the holder
+    unsigned long ctxsw; // context switches on all harts
 };
 
+// Counters updated by lock_acquire with the thread manager lock held (lock.c)
+
+extern unsigned long lock_acquire_cnt;
+extern unsigned long lock_contended_cnt;
+
+extern void lock_get_stats(struct lockstat * st);
+
+// Returns the profile for locks named name, creating it if needed. Called by
+// lock_init and rwlock_init.
+
+extern struct lock_prof * lock_prof_lookup(const char * name);
+
+// Prints the profiles of the n most contended locks to the console.
+
+extern void lock_report(unsigned int n);
+
+// A reader-writer sleep lock. Any number of readers may hold it at once, or a
+// single writer. Writers are preferred: once a writer is waiting, new readers
+// wait until it has had its turn, so a steady stream of readers cannot starve
+// it. A reader may upgrade to writer, and a writer may downgrade to reader,
+// without letting anyone else in between.
+
+struct rwlock {
+    struct condition readers_cond; // readers waiting for writers to finish
+    struct condition writers_cond; // writers waiting in line
+    struct condition upgrade_cond; // upgrading reader waiting for the others
+    int nreaders; // threads holding the lock for reading
+    int writer; // thread holding the lock for writing or -1
+    int waiting_writers; // writers in line, including an upgrading reader
+    int upgrading; // reader waiting in rwlock_upgrade or -1
+    struct lock_prof * prof; // profile for the lock name
+    uint64_t held_since; // rdtime when the lock last stopped being free
+};
+
+static inline void lock_prof_wait(struct lock_prof * prof, uint64_t t);
+static inline void lock_prof_hold(struct lock_prof * prof, uint64_t t);
+
 static inline void lock_init(struct lock * lk, const char * name);
 static inline void lock_acquire(struct lock * lk);
 static inline void lock_release(struct lock * lk);
 
+static inline void rwlock_init(struct rwlock * rw, const char * name);
+static inline void rwlock_acquire_read(struct rwlock * rw);
+static inline void rwlock_release_read(struct rwlock * rw);
+static inline void rwlock_acquire_write(struct rwlock * rw);
+static inline void rwlock_release_write(struct rwlock * rw);
+static inline int rwlock_upgrade(struct rwlock * rw);
+static inline void rwlock_downgrade(struct rwlock * rw);
+
 // INLINE FUNCTION DEFINITIONS
 //
 
+// Account t ticks of waiting or holding to prof. The caller holds the thread
+// manager lock.
+
+static inline void lock_prof_wait(struct lock_prof * prof, uint64_t t) {
+    prof->wait_total += t;
+    if (prof->wait_max < t)
+        prof->wait_max = t;
+}
+
+static inline void lock_prof_hold(struct lock_prof * prof, uint64_t t) {
+    prof->hold_total += t;
+    if (prof->hold_max < t)
+        prof->hold_max = t;
+}
+
 static inline void lock_init(struct lock * lk, const char * name) {
     trace("%s(<%s:%p>", __func__, name, lk);
     condition_init(&lk->cond, name);
     lk->tid = -1;
+    lk->prof = lock_prof_lookup(name);
 }
 
 /*
@@ -40,36 +130,250 @@ static inline void lock_init(struct lock * lk, const char * name) {
     Outputs: none
     Description: This function allows a thread to acquire a lock if it is not
     already acquired. If it is already acquired by the same thread, the fxn exits.
-    If it is acquired by a different thread, the current thread waits for the condition
-    specified in the lock struct
+    If it is acquired by a different thread, the current thread waits until
+    lock_release hands the lock over to it. Waiters get the lock in the order
+    they started waiting.
 */
 static inline void lock_acquire(struct lock * lk) {
-    // TODO: FIXME implement this
+    int saved_intr_state;
+    uint64_t t0;
+
     trace("%s(<%s:%p>", __func__, lk->cond.name, lk);
     if(lk->tid == running_thread()) {
         return;
     }
-    intr_disable();
-    
-    // While the thread is claimed by a different thread, wait for the lock condition
-    while (lk->tid != -1 && lk->tid != running_thread()) {
-        condition_wait(&lk->cond);
+    // The thread manager lock makes the test and the wait atomic with respect
+    // to lock_release on another hart.
+    saved_intr_state = thrmgr_lock_acquire();
+
+    lock_acquire_cnt++;
+    lk->prof->acquires++;
+
+    if (lk->tid == -1) {
+        //  Lock is free: set current thread to the tid of the lock to acquire it
+        lk->tid = running_thread();
+    } else {
+        // Wait in line. lock_release makes us the owner before waking us, so
+        // no other thread can take the lock in between.
+        lock_contended_cnt++;
+        lk->prof->contended++;
+        t0 = csrr_time();
+        while (lk->tid != running_thread()) {
+            condition_wait(&lk->cond);
+        }
+        lock_prof_wait(lk->prof, csrr_time() - t0);
     }
-    //  Set current thread to the tid of the lock to acquire it
-    lk->tid = running_thread();
+
+    lk->held_since = csrr_time();
+
+    thrmgr_lock_release(saved_intr_state);
 }
 
 static inline void lock_release(struct lock * lk) {
     trace("%s(<%s:%p>", __func__, lk->cond.name, lk);
 
+    int saved_intr_state;
+
     assert (lk->tid == running_thread());
     
-    lk->tid = -1;
-    condition_broadcast(&lk->cond);
+    // Hand the lock directly to the longest waiting thread, if any. Waking
+    // only that thread avoids a stampede of waiters that would all run just
+    // to find the lock taken again.
+
+    saved_intr_state = thrmgr_lock_acquire();
+    lock_prof_hold(lk->prof, csrr_time() - lk->held_since);
+    lk->tid = condition_signal(&lk->cond);
+    thrmgr_lock_release(saved_intr_state);
+}
+
+static inline void rwlock_init(struct rwlock * rw, const char * name) {
+    trace("%s(<%s:%p>", __func__, name, rw);
+    condition_init(&rw->readers_cond, name);
+    condition_init(&rw->writers_cond, name);
+    condition_init(&rw->upgrade_cond, name);
+    rw->nreaders = 0;
+    rw->writer = -1;
+    rw->waiting_writers = 0;
+    rw->upgrading = -1;
+    rw->prof = lock_prof_lookup(name);
+}
+
+/*
+    Inputs: rwlock * rw
+    Outputs: none
+    Description: Acquires rw for reading. Waits while a writer holds the lock
+    or is waiting for it. A reader must not acquire the same lock again before
+    releasing it, since a writer arriving in between would block it for good.
+*/
+static inline void rwlock_acquire_read(struct rwlock * rw) {
+    int saved_intr_state;
+    uint64_t t0;
+
+    trace("%s(<%s:%p>", __func__, rw->readers_cond.name, rw);
+    assert (rw->writer != running_thread());
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    lock_acquire_cnt++;
+    rw->prof->acquires++;
+
+    if (rw->writer != -1 || rw->waiting_writers > 0) {
+        lock_contended_cnt++;
+        rw->prof->contended++;
+        t0 = csrr_time();
+        while (rw->writer != -1 || rw->waiting_writers > 0)
+            condition_wait(&rw->readers_cond);
+        lock_prof_wait(rw->prof, csrr_time() - t0);
+    }
+
+    // Hold time is counted per stretch of read holds, from the first reader
+    // in to the last reader out, since readers overlap.
+
+    if (rw->nreaders++ == 0)
+        rw->held_since = csrr_time();
+    thrmgr_lock_release(saved_intr_state);
+}
+
+static inline void rwlock_release_read(struct rwlock * rw) {
+    int saved_intr_state;
+    int tid;
+
+    trace("%s(<%s:%p>", __func__, rw->readers_cond.name, rw);
+
+    saved_intr_state = thrmgr_lock_acquire();
+    assert (rw->nreaders > 0);
+    rw->nreaders--;
+
+    if (rw->nreaders == 0)
+        lock_prof_hold(rw->prof, csrr_time() - rw->held_since);
+
+    // An upgrading reader goes first once it is the only reader left.
+    // Otherwise the last reader out hands the lock to the first writer in
+    // line, the same way lock_release does.
+
+    if (rw->upgrading != -1) {
+        if (rw->nreaders == 1)
+            condition_broadcast(&rw->upgrade_cond);
+    } else if (rw->nreaders == 0 && rw->waiting_writers > 0) {
+        tid = condition_signal(&rw->writers_cond);
+        if (tid != -1) {
+            rw->writer = tid;
+            rw->waiting_writers--;
+        }
+    }
+
+    thrmgr_lock_release(saved_intr_state);
+}
+
+/*
+    Inputs: rwlock * rw
+    Outputs: none
+    Description: Acquires rw for writing. If the lock is held or other writers
+    are in line, the thread waits its turn. The releasing thread makes us the
+    owner before waking us, so no reader can slip in between.
+*/
+static inline void rwlock_acquire_write(struct rwlock * rw) {
+    int saved_intr_state;
+    uint64_t t0;
+
+    trace("%s(<%s:%p>", __func__, rw->writers_cond.name, rw);
+    assert (rw->writer != running_thread());
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    lock_acquire_cnt++;
+    rw->prof->acquires++;
+
+    if (rw->writer == -1 && rw->nreaders == 0 && rw->waiting_writers == 0) {
+        rw->writer = running_thread();
+    } else {
+        lock_contended_cnt++;
+        rw->prof->contended++;
+        t0 = csrr_time();
+        rw->waiting_writers++;
+        while (rw->writer != running_thread())
+            condition_wait(&rw->writers_cond);
+        lock_prof_wait(rw->prof, csrr_time() - t0);
+    }
+
+    rw->held_since = csrr_time();
+
+    thrmgr_lock_release(saved_intr_state);
+}
+
+static inline void rwlock_release_write(struct rwlock * rw) {
+    int saved_intr_state;
+    int tid;
+
+    trace("%s(<%s:%p>", __func__, rw->writers_cond.name, rw);
+    assert (rw->writer == running_thread());
+
+    // Pass the lock to the next writer if there is one (writer preference),
+    // otherwise let all waiting readers in at once.
+
+    saved_intr_state = thrmgr_lock_acquire();
+    lock_prof_hold(rw->prof, csrr_time() - rw->held_since);
+    tid = condition_signal(&rw->writers_cond);
+    rw->writer = tid;
+    if (tid != -1)
+        rw->waiting_writers--;
+    else
+        condition_broadcast(&rw->readers_cond);
+    thrmgr_lock_release(saved_intr_state);
+}
+
+/*
+    Inputs: rwlock * rw
+    Outputs: 0 on success, -EBUSY if another reader is already upgrading
+    Description: Turns a read hold of rw into a write hold. New readers are
+    held off while we wait for the other readers to leave. Only one reader can
+    upgrade at a time; if this fails, the caller still holds the lock for
+    reading and must release it before acquiring it for writing, since the
+    other upgrader is waiting for it to leave.
+*/
+static inline int rwlock_upgrade(struct rwlock * rw) {
+    int saved_intr_state;
+
+    trace("%s(<%s:%p>", __func__, rw->upgrade_cond.name, rw);
+
+    saved_intr_state = thrmgr_lock_acquire();
+    assert (rw->nreaders > 0);
+
+    if (rw->upgrading != -1) {
+        thrmgr_lock_release(saved_intr_state);
+        return -EBUSY;
+    }
+
+    rw->upgrading = running_thread();
+    rw->waiting_writers++;
+
+    while (rw->nreaders > 1)
+        condition_wait(&rw->upgrade_cond);
+
+    rw->nreaders--;
+    rw->waiting_writers--;
+    rw->upgrading = -1;
+    rw->writer = running_thread();
+
+    thrmgr_lock_release(saved_intr_state);
+    return 0;
+}
+
+// Turns a write hold of rw into a read hold. Waiting readers are let in too,
+// unless a writer is in line, in which case they keep waiting behind it.
+
+static inline void rwlock_downgrade(struct rwlock * rw) {
+    int saved_intr_state;
+
+    trace("%s(<%s:%p>", __func__, rw->readers_cond.name, rw);
+    assert (rw->writer == running_thread());
 
-    //console_printf("Thread <%s:%d> released lock <%s:%p> and lk->tid is %d\n",
-    //    thread_name(running_thread()), running_thread(),
-    //    lk->cond.name, lk, lk->tid);
+    saved_intr_state = thrmgr_lock_acquire();
+    rw->writer = -1;
+    rw->nreaders++;
+    if (rw->waiting_writers == 0)
+        condition_broadcast(&rw->readers_cond);
+    thrmgr_lock_release(saved_intr_state);
 }
 
-#endif // _LOCK_H_
\ No newline at end of file
+#endif // _LOCK_H_
@@ -26,6 +26,9 @@ x#define DEBUG
 #include "string.h"
 #include "process.h"
 #include "config.h"
+#include "smp.h"
+#include "workq.h"
+#include "ktask.h"
 
 
 void main(void) {
@@ -41,7 +44,10 @@ void main(void) {
     devmgr_init();
     thread_init();
     procmgr_init();
+    workq_init();
+    ktask_init();
     timer_init();
+    smp_init();
 
     // Attach NS16550a serial devices
 
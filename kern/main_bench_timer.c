@@ -0,0 +1,63 @@
+// main_bench_timer.c - Timer interrupt latency benchmark
+//
+// Sleeps on an alarm BENCH_SLEEPS times and measures how long after the
+// requested wake-up time the thread resumes. The difference covers timer
+// interrupt delivery, the timer ISR and the switch back to the sleeping
+// thread. Run with Sstc (the default QEMUOPTS) and with run-bench-timer-clint,
+// which turns Sstc off so that every re-arm goes through M mode.
+
+#ifdef MAIN_TRACE
+#define TRACE
+#endif
+
+#ifdef MAIN_DEBUG
+#define DEBUG
+#endif
+
+#include "console.h"
+#include "memory.h"
+#include "intr.h"
+#include "thread.h"
+#include "timer.h"
+
+#define BENCH_SLEEPS 1000
+#define BENCH_SLEEP_US 500
+#define NS_PER_TICK (1000000000 / TIMER_FREQ)
+
+void main(void) {
+    struct alarm al;
+    uint64_t lat, lat_min, lat_max, lat_sum;
+    int i;
+
+    console_init();
+    memory_init();
+    intr_init();
+    thread_init();
+    timer_init();
+    intr_enable();
+
+    alarm_init(&al, "bench");
+
+    lat_min = UINT64_MAX;
+    lat_max = 0;
+    lat_sum = 0;
+
+    for (i = 0; i < BENCH_SLEEPS; i++) {
+        alarm_reset(&al);
+        alarm_sleep_us(&al, BENCH_SLEEP_US);
+        lat = get_mtime() - al.twake;
+
+        lat_sum += lat;
+        if (lat < lat_min)
+            lat_min = lat;
+        if (lat_max < lat)
+            lat_max = lat;
+    }
+
+    console_printf("\nTimer latency over %d sleeps of %d us (Sstc %s)\n",
+        BENCH_SLEEPS, BENCH_SLEEP_US, timer_sstc_enabled ? "on" : "off");
+    console_printf("min %lu ns  avg %lu ns  max %lu ns\n",
+        (unsigned long)(lat_min * NS_PER_TICK),
+        (unsigned long)(lat_sum * NS_PER_TICK / BENCH_SLEEPS),
+        (unsigned long)(lat_max * NS_PER_TICK));
+}
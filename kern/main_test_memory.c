@@ -106,6 +106,44 @@ void main(void) {
     */
 
 
+    console_printf("\nTest 7: Contiguous allocation with compaction\n");
+    //Fill memory with user pages (tagged with their page number) alternating
+    //with free pages, so that no free 2 MB run is left in 8 MB of RAM, then ask
+    //for one. The user pages in the way must be migrated and keep their
+    //contents. The pages are mapped one at a time, since
+    //memory_alloc_and_map_range would use 64 KB pages, which compaction does
+    //not move.
+    procmgr_init();
+    static void * holes[1024];
+    int npages = 0;
+    unsigned long * tags = (unsigned long *)0xC0000000;
+    while(npages < 1024 && memory_free_page_count() > 16){
+        memory_alloc_and_map_page(0xC0000000 + npages*PAGE_SIZE, PTE_R | PTE_W | PTE_U);
+        holes[npages++] = memory_reserve_page();
+    }
+    for(int i=0; i<npages; i++){
+        tags[i*PAGE_SIZE/sizeof(unsigned long)] = i;
+        if(holes[i] != NULL)
+            memory_free_page(holes[i]);
+    }
+    void * run = memory_alloc_contig(MEGA_SIZE/PAGE_SIZE, MEGA_SIZE);
+    struct memory_compact_stats cstats;
+    memory_get_compact_stats(&cstats);
+    int moved_ok = (cstats.pages_migrated != 0);
+    for(int i=0; i<npages; i++){
+        if(tags[i*PAGE_SIZE/sizeof(unsigned long)] != i)
+            moved_ok = 0;
+    }
+    if(run != NULL && moved_ok)
+        console_printf("Got 2 MB run at %p, user pages migrated and intact\n", run);
+    else
+        console_printf("Contiguous allocation failed :(\n");
+    memory_compact_report();
+    if(run != NULL)
+        memory_free_contig(run, MEGA_SIZE/PAGE_SIZE);
+    memory_unmap_and_free_user();
+
+
     console_printf("\n---------------End of Tests---------------\n");
 
 
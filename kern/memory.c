@@ -24,6 +24,11 @@
 #include "error.h"
 #include "thread.h"
 #include "process.h"
+#include "timer.h"
+#include "trap.h"
+#include "cache.h"
+#include "spinlock.h"
+#include "futex.h"
 
 #include <stdint.h>
 
@@ -50,8 +55,14 @@ extern char _kimg_end[];
 // INTERNAL TYPE DEFINITIONS
 //
 
+// Free pages are kept on a doubly-linked list so that compaction can take an
+// arbitrary free page off the list.
+
 union linked_page {
-    union linked_page * next;
+    struct {
+        union linked_page * next;
+        union linked_page * prev;
+    };
     char padding[PAGE_SIZE];
 };
 
@@ -73,6 +84,42 @@ struct pte {
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define POFFSET(vma) ((vma) & 0xFFF)
 
+#define RAM_PAGE_CNT (RAM_SIZE / PAGE_SIZE)
+#define MEGA_PAGE_CNT (MEGA_SIZE / PAGE_SIZE)
+#define NO_RUN ((size_t)-1)
+
+// Svnapot: a 64 KB page is mapped by 16 identical leaf PTEs with the N bit set
+// and the low four bits of the PPN replaced by 0b1000.
+
+#define NAPOT_PAGE_CNT 16
+#define NAPOT_SIZE (NAPOT_PAGE_CNT * PAGE_SIZE)
+#define NAPOT_PPN_64K 0x8
+
+// memory_space_clone refuses to start a copy that would leave fewer than this
+// many free pages, so that a fork storm fails forks instead of running the
+// kernel out of pages for stacks and page tables.
+
+#define CLONE_RESERVE_PAGES 32
+
+// A compaction pass migrates at most this many pages per hold of the thread
+// manager lock and mem_lock (see compact_run).
+
+#define COMPACT_BATCH 16
+
+// INTERNAL TYPE DEFINITIONS (CONT.)
+//
+
+// State of a compaction pass. Pages [start,start+cnt) are being emptied.
+// batch_left counts down the migrations allowed before the locks are dropped.
+
+struct compact_ctx {
+    size_t start;
+    size_t cnt;
+    size_t migrated;
+    size_t batch_left;
+    int failed;
+};
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -101,9 +148,53 @@ static inline struct pte leaf_pte (
 static inline struct pte ptab_pte (
     const struct pte * ptab, uint_fast8_t g_flag);
 static inline struct pte null_pte(void);
+static inline struct pte napot_pte (
+    const void * pptr, uint_fast8_t rwxug_flags);
+static inline void * pte_pageptr(const struct pte * pte, uintptr_t vma);
+static inline void set_pte_flags(struct pte * pte, uint_fast8_t rwxug_flags);
+
+static void probe_svnapot(void);
+static int alloc_and_map_napot(uintptr_t vma, uint_fast8_t rwxug_flags);
+static void demote_napot(struct pte * root, uintptr_t vma);
 
 static inline void sfence_vma(void);
 
+static void free_list_insert(union linked_page * page);
+static void free_list_append(union linked_page * page);
+static void free_list_remove(union linked_page * page);
+static void * take_free_page(void);
+
+static inline size_t page_index(const void * pp);
+static inline void * index_to_page(size_t idx);
+static inline int bitmap_test(const uint64_t * map, size_t idx);
+static inline void bitmap_set(uint64_t * map, size_t idx);
+static inline void bitmap_clear(uint64_t * map, size_t idx);
+
+static void walk_user_leaves (
+    struct pte * root, void (*fn)(struct pte * pte, void * aux), void * aux);
+static void for_each_process_leaf (
+    void (*fn)(struct pte * pte, void * aux), void * aux);
+
+static void scan_leaf(struct pte * pte, void * aux);
+static void count_leaf(struct pte * pte, void * aux);
+static void mark_movable_leaf(struct pte * pte, void * aux);
+static void migrate_leaf(struct pte * pte, void * aux);
+
+static size_t find_free_run(size_t cnt, size_t align_cnt);
+static size_t take_free_run(size_t cnt, size_t align_cnt);
+static size_t choose_window(size_t cnt, size_t align_cnt);
+static size_t compact_run(size_t cnt, size_t align_cnt);
+
+// IMPORTED FUNCTION DECLARATIONS
+//
+
+// Returns a page taken back from the memory balloon, or NULL if the balloon is
+// empty (vioballoon.c). Called when the free page list runs dry.
+// vioballoon_reclaimable_count returns the number of pages it could take back.
+
+extern void * vioballoon_reclaim_page(void);
+extern size_t vioballoon_reclaimable_count(void);
+
 uintptr_t memory_space_switch(uintptr_t mtag) {
     uintptr_t old_mtag = csrrw_satp(mtag);
     sfence_vma();
@@ -114,6 +205,48 @@ uintptr_t memory_space_switch(uintptr_t mtag) {
 //
 
 static union linked_page * free_list;
+static union linked_page * free_list_tail;
+static size_t free_page_cnt;
+
+// One bit per page of RAM. A page is set in free_map iff it is on free_list.
+// movable_map is scratch space for compaction: a page is set iff it is a user
+// page that may be migrated.
+
+static uint64_t free_map[(RAM_PAGE_CNT + 63) / 64];
+static uint64_t movable_map[(RAM_PAGE_CNT + 63) / 64];
+
+// Index of the first page given to the page allocator (pages before it belong
+// to the kernel image and the heap).
+
+static size_t first_free_idx;
+
+// free_gen counts calls to memory_free_page; memory_compact_idle does not try
+// again until it changes.
+
+static unsigned long free_gen;
+static unsigned long compact_idle_gen;
+
+static struct memory_compact_stats compact_stats;
+
+// Window of the compaction pass in progress, NO_RUN if none. Only one pass
+// runs at a time. Pages of the window that are freed during the pass go to
+// the pass instead of the free list (see memory_free_page).
+
+static size_t compact_start = NO_RUN;
+static size_t compact_cnt;
+
+// mem_lock protects the free list, the bitmaps and the compaction state.
+// Compaction also holds the thread manager lock (taken first) while it looks
+// at page tables, so that no process it is moving pages of can start running
+// on another hart.
+
+static struct spinlock mem_lock = {
+    .name = "memory"
+};
+
+// Set by memory_init if the hardware supports Svnapot
+
+static char napot_supported;
 
 static struct pte main_pt2[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
@@ -241,12 +374,15 @@ void memory_init(void) {
         free_list, RAM_END, page_cnt); // free_list is a linked list of pages
 
     // Put free pages on the free page list
-    // memory_alloc_page and memory_free_page).
+    // memory_alloc_page and memory_free_page). The list must be
+    // NULL-terminated so that running out of pages can be detected.
+
+    free_list = NULL;
+    first_free_idx = page_index(heap_end);
 
     for(void* pp = heap_end; pp < RAM_END; pp += PAGE_SIZE){ // free_list is a linked list of pages
         page = pp; // pp is a pointer to the page
-        page->next = free_list; // next points to the next page in the list
-        free_list = page; // free_list points to the current page
+        free_list_insert(page); // page becomes the head of the list
     }
     
     // Allow supervisor to access user memory. We could be more precise by only
@@ -255,6 +391,11 @@ void memory_init(void) {
 
     csrs_sstatus(RISCV_SSTATUS_SUM); // Supervisor User Memory access
 
+    probe_svnapot();
+    kprintf("       Svnapot: %s\n", napot_supported ? "yes" : "no");
+
+    cache_init();
+
     memory_initialized = 1;
 }
 
@@ -276,14 +417,13 @@ void * memory_alloc_page(void){
     // Purpose: Allocates a physical page of memory. Returns a pointer to the direct-mapped address of the page.
     void * pp;
 
-    if(free_list == NULL){
+    //1. Remove from free page list (or take one back from the balloon)
+    //2. return it
+    pp = memory_reserve_page();
+    if(pp == NULL){
         panic("The free list is empty, unable to alloc_page!");
     }
-    //1. Remove from free page list
-    //2. return it
-    pp = free_list; // pp points to the first page in the free list
-    free_list = free_list->next; // free_list points to the next page in the list
-    memset(pp, 0, PAGE_SIZE); // set the page to 0
+    cache_zero(pp, PAGE_SIZE); // set the page to 0 (cbo.zero if available)
     sfence_vma(); // Flush TLB
     return pp; // return the page
 }
@@ -292,11 +432,43 @@ void memory_free_page (void* pp){
     // Input: void*
     // Output: None
     // Purpose: Returns a physical memory page to the physical page allocator. The page must have been previously allocated by memory_alloc_page.
-    ((union linked_page*)pp)->next = free_list; // next points to the next page in the list
-    free_list = pp; // free_list points to the current page
+    int saved_intr_state;
+    size_t idx;
+
+    saved_intr_state = spinlock_acquire(&mem_lock);
+    idx = page_index(pp);
+    if(compact_start <= idx && idx < compact_start + compact_cnt)
+        bitmap_clear(movable_map, idx); // a user page of the window; it now belongs to the compaction pass
+    else
+        free_list_insert(pp); // pp becomes the head of the free list
+    free_gen++;
+    spinlock_release(&mem_lock, saved_intr_state);
     sfence_vma(); // Flush TLB
 }
 
+void * memory_reserve_page(void){
+    // Input: None
+    // Output: void*
+    // Purpose: Removes a page from the free page list without zeroing it. Takes a page back from the balloon if
+    // the list is empty. Returns NULL if both are empty.
+    int saved_intr_state;
+    void * pp;
+
+    saved_intr_state = spinlock_acquire(&mem_lock);
+    pp = take_free_page();
+    spinlock_release(&mem_lock, saved_intr_state);
+    if(pp == NULL)
+        pp = vioballoon_reclaim_page();
+    return pp;
+}
+
+size_t memory_free_page_count(void){
+    // Input: None
+    // Output: size_t
+    // Purpose: Returns the number of pages on the free page list.
+    return free_page_cnt;
+}
+
 void * memory_alloc_and_map_page (uintptr_t vma, uint_fast8_t rwxug_flags){
     // Input: uintptr_t, uint_fast8_t
     // Output: void*
@@ -315,7 +487,14 @@ void * memory_alloc_and_map_range (uintptr_t vma, size_t size, uint_fast8_t rwxu
     // Input: uintptr_t, size_t, uint_fast8_t
     // Output: void*
     // Purpose: Allocates and maps multiple physical pages in an address range. Equivalent to calling memory_alloc_and_map_page for every page in the range.
+    // Naturally aligned 64 KB blocks of the range are mapped as Svnapot pages when possible.
     for(uintptr_t pp = vma; pp < vma + size; pp += PAGE_SIZE){ // for each page in the range
+        if(napot_supported && aligned_addr(pp, NAPOT_SIZE) && NAPOT_SIZE <= vma + size - pp){
+            if(alloc_and_map_napot(pp, rwxug_flags)){
+                pp += NAPOT_SIZE - PAGE_SIZE;
+                continue;
+            }
+        }
         memory_alloc_and_map_page(pp, rwxug_flags); // allocates and maps a physical page
     }
     sfence_vma(); // Flush TLB
@@ -327,7 +506,11 @@ void memory_set_page_flags(const void *vp, uint8_t rwxug_flags){
     // Output: None
     // Purpose: Sets the flags of a page to the specified flags.
     struct pte * my_pte = walk_pt(active_space_root(), (uintptr_t)vp, 0); // walks the page table hierarchy to find the PTE for the specified virtual address
-    my_pte->flags = rwxug_flags | PTE_A | PTE_D | PTE_V; // set the flags of the PTE to the specified flags
+
+    if(my_pte->n) // all PTEs of a 64 KB page must be the same
+        demote_napot(active_space_root(), (uintptr_t)vp);
+
+    set_pte_flags(my_pte, rwxug_flags); // set the flags of the PTE to the specified flags
     sfence_vma(); //Flush TLB
 }
 
@@ -335,9 +518,21 @@ void memory_set_range_flags(const void *vp, size_t size, uint_fast8_t rwxug_flag
     // Input: const void*, size_t, uint_fast8_t
     // Output: None
     // Purpose: Changes the PTE flags for all pages in a mapped range.
+    struct pte * root = active_space_root();
+    struct pte * my_pte;
     const void *pp;
 
     for(pp = vp; pp-vp < size; pp+=PAGE_SIZE){ // for each page in the range
+        my_pte = walk_pt(root, (uintptr_t)pp, 0);
+
+        // A 64 KB page entirely inside the range keeps its mapping
+        if(my_pte != NULL && my_pte->n && aligned_ptr(pp, NAPOT_SIZE) && NAPOT_SIZE <= size - (pp-vp)){
+            for(int i = 0; i < NAPOT_PAGE_CNT; i++)
+                set_pte_flags(&my_pte[i], rwxug_flags);
+            pp += NAPOT_SIZE - PAGE_SIZE;
+            continue;
+        }
+
         memory_set_page_flags(pp, rwxug_flags); // set the flags of the page to the specified flags
     }
     sfence_vma(); //Flush TLB
@@ -356,7 +551,7 @@ void memory_unmap_and_free_user(void){
     for(vma = USER_START_VMA; vma < USER_END_VMA; vma+=PAGE_SIZE ){ // for each page in the user region
         cur_pte = walk_pt(root, vma, 0); // walks the page table hierarchy to find the PTE for the specified virtual address
         if(cur_pte != NULL && cur_pte->flags & PTE_U){ // if the PTE is not NULL and the U bit is set
-            memory_free_page(pagenum_to_pageptr(cur_pte->ppn)); // free the page
+            memory_free_page(pte_pageptr(cur_pte, vma)); // free the page (64 KB pages are freed page by page)
             cur_pte->flags &= ~PTE_V; // clear the V bit
             sfence_vma();   //Flush TLB
         }
@@ -380,6 +575,22 @@ int memory_validate_vptr_len (const void * vp, size_t len, uint_fast8_t rwxug_fl
     return 0;
 }
 
+void * memory_translate_user(const void * vp, uint_fast8_t rwxug_flags){
+    // Input: const void*, uint_fast8_t
+    // Output: void*
+    // Purpose: Translates a user virtual address to the direct-mapped address of the byte it refers to. Returns NULL if the page is not mapped with the specified permissions.
+    struct pte * my_pte;
+
+    if((uintptr_t)vp < USER_START_VMA || USER_END_VMA <= (uintptr_t)vp)
+        return NULL;
+
+    my_pte = walk_pt(active_space_root(), (uintptr_t)vp, 0);
+    if(my_pte == NULL || !(my_pte->flags & PTE_V) || (my_pte->flags & rwxug_flags) != rwxug_flags)
+        return NULL;
+
+    return pte_pageptr(my_pte, (uintptr_t)vp) + (uintptr_t)vp % PAGE_SIZE;
+}
+
 int memory_validate_vstr(const char * vs, uint_fast8_t ug_flags){
     // Input: const char*, uint_fast8_t
     // Output: int
@@ -396,7 +607,7 @@ int memory_validate_vstr(const char * vs, uint_fast8_t ug_flags){
         if(cur_pte == NULL || !(cur_pte->flags & ug_flags)) // if the PTE is NULL or the flags don't match
             return -EACCESS;
 
-        pma = (cur_pte->ppn)<<12 | p_offset; // get the physical memory address
+        pma = (uintptr_t)pte_pageptr(cur_pte, cur_vma) | p_offset; // get the physical memory address
         while(p_offset < PAGE_SIZE){    // for each byte in the page
             if(*(char *)pma == '\0')  // if the byte is null
                 return 0;
@@ -421,12 +632,142 @@ void memory_handle_page_fault(const void *vptr){
     }
 }
 
+int memory_handle_ad_fault(const void * vptr, uint_fast8_t rwx_flags){
+    // Input: const void*, uint_fast8_t
+    // Output: int
+    // Purpose: Emulates the hardware update of the A and D flags of a user page. Returns 1 if the fault was an A/D fault and has been handled, and 0 otherwise.
+    const uint_fast8_t uv_flags = PTE_U | PTE_V;
+    struct pte * my_pte;
+
+    if((uintptr_t)vptr < USER_START_VMA || USER_END_VMA <= (uintptr_t)vptr)
+        return 0;
+
+    my_pte = walk_pt(active_space_root(), (uintptr_t)vptr, 0);
+
+    if(my_pte == NULL || (my_pte->flags & uv_flags) != uv_flags)
+        return 0; // not mapped (e.g. stack growth), not ours to handle
+
+    if((my_pte->flags & rwx_flags) != rwx_flags)
+        return 0; // a real protection fault
+
+    my_pte->flags |= PTE_A;
+    if(rwx_flags & PTE_W)
+        my_pte->flags |= PTE_D;
+
+    sfence_vma();
+    return 1;
+}
+
+void memory_scan_user(uintptr_t mtag, struct memory_ws_sample * ws){
+    // Input: uintptr_t, struct memory_ws_sample*
+    // Output: None
+    // Purpose: Counts the mapped, accessed and dirty user pages of a memory space and clears their A and D flags.
+    memset(ws, 0, sizeof(struct memory_ws_sample));
+    walk_user_leaves(mtag_to_root(mtag), scan_leaf, ws);
+    sfence_vma(); // the space may be cached in the TLB under any ASID
+}
+
+void * memory_alloc_contig(size_t cnt, size_t align){
+    // Input: size_t, size_t
+    // Output: void*
+    // Purpose: Allocates cnt physically contiguous pages aligned to align bytes, compacting memory if needed. Returns NULL on failure.
+    const size_t align_cnt = align / PAGE_SIZE;
+    size_t idx;
+
+    if(cnt == 0 || align_cnt == 0 || (align & (align - 1)) != 0)
+        return NULL;
+
+    idx = take_free_run(cnt, align_cnt);
+    if(idx == NO_RUN)
+        idx = compact_run(cnt, align_cnt); // pages come back already off the free list
+
+    if(idx == NO_RUN)
+        return NULL;
+
+    cache_zero(index_to_page(idx), cnt * PAGE_SIZE);
+    sfence_vma(); // Flush TLB
+    return index_to_page(idx);
+}
+
+void memory_free_contig(void * pp, size_t cnt){
+    // Input: void*, size_t
+    // Output: None
+    // Purpose: Returns a run of pages allocated by memory_alloc_contig to the page allocator.
+    for(size_t i = 0; i < cnt; i++)
+        memory_free_page(pp + i * PAGE_SIZE);
+}
+
+void memory_compact_idle(void){
+    // Input: None
+    // Output: None
+    // Purpose: Keeps a free megapage run available. Called from the idle thread of every hart.
+    int saved_lock_state;
+    size_t idx;
+
+    if(compact_idle_gen == free_gen) // nothing was freed since we last looked
+        return;
+
+    saved_lock_state = spinlock_acquire(&mem_lock);
+    compact_idle_gen = free_gen;
+    idx = find_free_run(MEGA_PAGE_CNT, MEGA_PAGE_CNT);
+    spinlock_release(&mem_lock, saved_lock_state);
+
+    if(idx != NO_RUN)
+        return;
+
+    idx = compact_run(MEGA_PAGE_CNT, MEGA_PAGE_CNT);
+
+    // Put the run at the tail of the free list so that it is allocated
+    // last and stays contiguous for as long as possible.
+
+    if(idx != NO_RUN){
+        saved_lock_state = spinlock_acquire(&mem_lock);
+        for(size_t i = idx; i < idx + MEGA_PAGE_CNT; i++)
+            free_list_append(index_to_page(i));
+        compact_idle_gen = free_gen;
+        spinlock_release(&mem_lock, saved_lock_state);
+    }
+}
+
+void memory_get_compact_stats(struct memory_compact_stats * stats){
+    // Input: struct memory_compact_stats*
+    // Output: None
+    // Purpose: Returns the compaction statistics.
+    *stats = compact_stats;
+}
+
+void memory_compact_report(void){
+    // Input: None
+    // Output: None
+    // Purpose: Prints the compaction success rate and the cost per migrated page.
+    const struct memory_compact_stats * const cs = &compact_stats;
+
+    kprintf("Compaction: %u of %u passes succeeded, %lu pages migrated",
+        (unsigned int)cs->successes, (unsigned int)cs->attempts,
+        (unsigned long)cs->pages_migrated);
+
+    if(cs->pages_migrated != 0){
+        kprintf(", %lu ns per page\n", (unsigned long)
+            (cs->ticks * (1000000000UL / TIMER_FREQ) / cs->pages_migrated));
+    } else
+        kprintf("\n");
+}
+
 uintptr_t memory_space_clone(uint_fast16_t asid) { 
     // Input: uint_fast16_t 
     // Output: uintptr_t 
-    // Purpose: Clones the active memory space. Returns the new memory space tag.
+    // Purpose: Clones the active memory space. Returns the new memory space tag, or 0 if there are not enough free pages for the copy.
 
     struct pte *root = active_space_root(); // get the root page table
+    size_t user_cnt = 0;
+
+    // The copy needs a page for every user page plus its page tables. Check
+    // up front, since memory_alloc_page panics when it runs out.
+    walk_user_leaves(root, count_leaf, &user_cnt);
+    if(memory_free_page_count() + vioballoon_reclaimable_count() <
+        user_cnt + user_cnt / 256 + 3 + CLONE_RESERVE_PAGES)
+        return 0;
+
     struct pte *child_pt2 = (struct pte *)memory_alloc_page(); // allocate a physical page
     for (int i = 0; i < 3; i++) // for each page in the root
         child_pt2[i] = root[i]; // copy the page to the child
@@ -436,15 +777,14 @@ uintptr_t memory_space_clone(uint_fast16_t asid) {
         if(parent_pte0 != NULL && parent_pte0->flags & PTE_V){  // if the PTE is not NULL and the Valid bit is set
             struct pte* child_pte0 = walk_pt(child_pt2, vma, 1); // walk to the PTE0 for the child
             void * child_curpage = memory_alloc_page();            // allocate a physical page
-            void * parent_curpage = pagenum_to_pageptr(parent_pte0->ppn); // get the parent page ptr
+            void * parent_curpage = pte_pageptr(parent_pte0, vma); // get the parent page ptr
             memcpy(child_curpage, parent_curpage, PAGE_SIZE);           // copy the parent page to the child page
             *child_pte0 = *parent_pte0;                             // set the child PTE0 to the parent PTE0    
             child_pte0->ppn = pageptr_to_pagenum(child_curpage);    // set the ppn of the child PTE0 to the child page
+            child_pte0->n = 0;                                      // the child's pages are not contiguous
         }
     } 
 
-    free_list = free_list->next; // free_list points to the next page in the list
-    
     return ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) | pageptr_to_pagenum(child_pt2); // return the new memory space tag
 }
 
@@ -485,6 +825,372 @@ struct pte* walk_pt(struct pte* root, uintptr_t vma, int create) {
 // INTERNAL FUNCTION DEFINITIONS
 //
 
+static void free_list_insert(union linked_page * page){
+    // Pushes a page onto the head of the free list.
+    page->prev = NULL;
+    page->next = free_list;
+    if(free_list != NULL)
+        free_list->prev = page;
+    else
+        free_list_tail = page;
+    free_list = page;
+
+    bitmap_set(free_map, page_index(page));
+    free_page_cnt++;
+}
+
+static void free_list_append(union linked_page * page){
+    // Adds a page at the tail of the free list.
+    page->next = NULL;
+    page->prev = free_list_tail;
+    if(free_list_tail != NULL)
+        free_list_tail->next = page;
+    else
+        free_list = page;
+    free_list_tail = page;
+
+    bitmap_set(free_map, page_index(page));
+    free_page_cnt++;
+}
+
+static void free_list_remove(union linked_page * page){
+    // Unlinks a page from anywhere in the free list.
+    if(page->prev != NULL)
+        page->prev->next = page->next;
+    else
+        free_list = page->next;
+
+    if(page->next != NULL)
+        page->next->prev = page->prev;
+    else
+        free_list_tail = page->prev;
+
+    bitmap_clear(free_map, page_index(page));
+    free_page_cnt--;
+}
+
+static void * take_free_page(void){
+    // Pops the head of the free list, or returns NULL if it is empty. Must be called with mem_lock held.
+    union linked_page * page = free_list;
+
+    if(page == NULL)
+        return NULL;
+
+    free_list_remove(page); // free_list points to the next page in the list
+    return page;
+}
+
+static inline size_t page_index(const void * pp){
+    return (pp - RAM_START) / PAGE_SIZE;
+}
+
+static inline void * index_to_page(size_t idx){
+    return RAM_START + idx * PAGE_SIZE;
+}
+
+static inline int bitmap_test(const uint64_t * map, size_t idx){
+    return (map[idx / 64] >> (idx % 64)) & 1;
+}
+
+static inline void bitmap_set(uint64_t * map, size_t idx){
+    map[idx / 64] |= UINT64_C(1) << (idx % 64);
+}
+
+static inline void bitmap_clear(uint64_t * map, size_t idx){
+    map[idx / 64] &= ~(UINT64_C(1) << (idx % 64));
+}
+
+//Usage: Calls fn on every valid user leaf PTE of a memory space. Only the page tables that exist are visited, so a sparse address space is cheap to walk.
+static void walk_user_leaves (
+    struct pte * root, void (*fn)(struct pte * pte, void * aux), void * aux)
+{
+    struct pte * pte2;
+    struct pte * pte1;
+    struct pte * pte0;
+    struct pte * pt1;
+    struct pte * pt0;
+    uintptr_t vma;
+
+    vma = USER_START_VMA;
+    while(vma < USER_END_VMA){
+        pte2 = &root[VPN2(vma)];
+        if(!(pte2->flags & PTE_V) || (pte2->flags & (PTE_R | PTE_W | PTE_X))){
+            vma = round_down_addr(vma, GIGA_SIZE) + GIGA_SIZE; // no page table (or a gigapage)
+            continue;
+        }
+
+        pt1 = pagenum_to_pageptr(pte2->ppn);
+        pte1 = &pt1[VPN1(vma)];
+        if(!(pte1->flags & PTE_V) || (pte1->flags & (PTE_R | PTE_W | PTE_X))){
+            vma = round_down_addr(vma, MEGA_SIZE) + MEGA_SIZE; // no page table (or a megapage)
+            continue;
+        }
+
+        pt0 = pagenum_to_pageptr(pte1->ppn);
+        do {
+            pte0 = &pt0[VPN0(vma)];
+            if((pte0->flags & (PTE_U | PTE_V)) == (PTE_U | PTE_V))
+                fn(pte0, aux);
+            vma += PAGE_SIZE;
+        } while(vma < USER_END_VMA && VPN0(vma) != 0);
+    }
+}
+
+//Usage: Calls fn on every valid user leaf PTE of every process that has a thread and is not busy (see thread_process_busy). The caller holds the thread manager lock, so the set of such processes does not change.
+static void for_each_process_leaf (
+    void (*fn)(struct pte * pte, void * aux), void * aux)
+{
+    struct process * proc;
+
+    if(!procmgr_initialized) // proctab is not set up yet
+        return;
+
+    for(int i = 0; i < idtab_size(&proctab); i++){
+        proc = idtab_get(&proctab, i);
+        if(proc != NULL && proc->thread_cnt > 0 && !thread_process_busy(proc))
+            walk_user_leaves(mtag_to_root(proc->mtag), fn, aux);
+    }
+}
+
+static void scan_leaf(struct pte * pte, void * aux){
+    struct memory_ws_sample * const ws = aux;
+
+    ws->resident++;
+    if(pte->flags & PTE_A)
+        ws->accessed++;
+    if(pte->flags & PTE_D)
+        ws->dirty++;
+    pte->flags &= ~(PTE_A | PTE_D);
+}
+
+static void count_leaf(struct pte * pte, void * aux){
+    (void)pte;
+    (*(size_t *)aux)++;
+}
+
+static void mark_movable_leaf(struct pte * pte, void * aux){
+    const void * const pp = pagenum_to_pageptr(pte->ppn);
+
+    if(pte->n) // 64 KB pages are not migrated
+        return;
+
+    if(futex_page_busy(pp)) // futexes are keyed by physical address
+        return;
+
+    if(RAM_START <= pp && pp < RAM_END)
+        bitmap_set(movable_map, page_index(pp));
+}
+
+static void migrate_leaf(struct pte * pte, void * aux){
+    struct compact_ctx * const ctx = aux;
+    void * const pp = pagenum_to_pageptr(pte->ppn);
+    void * newpp;
+    size_t idx;
+
+    if(ctx->failed || ctx->batch_left == 0 || pte->n || pp < RAM_START || RAM_END <= pp)
+        return;
+
+    idx = page_index(pp);
+    if(idx < ctx->start || ctx->start + ctx->cnt <= idx)
+        return;
+
+    // A futex may have been created on the page since the window was chosen
+
+    if(futex_page_busy(pp)){
+        ctx->failed = 1;
+        return;
+    }
+
+    // The free pages of the window are off the free list, so the new page is
+    // always outside the window.
+
+    newpp = take_free_page();
+    if(newpp == NULL){
+        ctx->failed = 1;
+        return;
+    }
+
+    memcpy(newpp, pp, PAGE_SIZE);
+    pte->ppn = pageptr_to_pagenum(newpp);
+    bitmap_clear(movable_map, idx); // pp now belongs to the compaction pass
+    ctx->migrated++;
+    ctx->batch_left--;
+}
+
+//Usage: Returns the index of the first page of a free run of cnt pages aligned to align_cnt pages, or NO_RUN.
+static size_t find_free_run(size_t cnt, size_t align_cnt){
+    size_t start, i;
+
+    start = round_up_size(first_free_idx, align_cnt);
+    while(start + cnt <= RAM_PAGE_CNT){
+        for(i = start; i < start + cnt; i++){
+            if(!bitmap_test(free_map, i))
+                break;
+        }
+
+        if(i == start + cnt)
+            return start;
+
+        start = round_up_size(i + 1, align_cnt); // skip past the used page
+    }
+
+    return NO_RUN;
+}
+
+//Usage: Takes a free run of cnt pages aligned to align_cnt pages off the free list. Returns the index of its first page, or NO_RUN.
+static size_t take_free_run(size_t cnt, size_t align_cnt){
+    int saved_lock_state;
+    size_t idx;
+
+    saved_lock_state = spinlock_acquire(&mem_lock);
+
+    idx = find_free_run(cnt, align_cnt);
+    if(idx != NO_RUN){
+        for(size_t i = idx; i < idx + cnt; i++)
+            free_list_remove(index_to_page(i));
+    }
+
+    spinlock_release(&mem_lock, saved_lock_state);
+    return idx;
+}
+
+//Usage: Returns the index of the first page of the aligned window of cnt pages that can be emptied with the fewest migrations, or NO_RUN. Must be called with the thread manager lock and mem_lock held.
+static size_t choose_window(size_t cnt, size_t align_cnt){
+    size_t start, i;
+    size_t moves, best_moves, best_start;
+
+    // Each page we migrate needs a free page outside the window, and the free
+    // pages inside it are kept. Every window of cnt free and movable pages
+    // thus needs cnt free pages in all, whatever its mix.
+
+    if(free_page_cnt < cnt)
+        return NO_RUN;
+
+    // Find out which pages are user pages we can move. The window we pick must
+    // contain only free and movable pages, and we prefer the one needing the
+    // fewest migrations.
+
+    memset(movable_map, 0, sizeof(movable_map));
+    for_each_process_leaf(mark_movable_leaf, NULL);
+
+    best_start = NO_RUN;
+    best_moves = NO_RUN;
+
+    for(start = round_up_size(first_free_idx, align_cnt);
+        start + cnt <= RAM_PAGE_CNT; start += align_cnt)
+    {
+        moves = 0;
+        for(i = start; i < start + cnt; i++){
+            if(bitmap_test(movable_map, i))
+                moves++;
+            else if(!bitmap_test(free_map, i))
+                break; // pinned page: kernel, page table, balloon, ...
+        }
+
+        if(i == start + cnt && moves < best_moves){
+            best_start = start;
+            best_moves = moves;
+        }
+    }
+
+    return best_start;
+}
+
+//Usage: Empties an aligned window of cnt pages by migrating the user pages in it elsewhere. Returns the index of the first page, with all pages of the window off the free list, or NO_RUN. Must be called without mem_lock or the thread manager lock held.
+static size_t compact_run(size_t cnt, size_t align_cnt){
+    const uint64_t t0 = csrr_time();
+    int saved_intr_state, saved_lock_state;
+    struct compact_ctx ctx;
+    struct process * proc;
+    size_t i;
+
+    // Choose the window and isolate its free pages. Only one pass runs at a
+    // time; a hart that finds another pass in progress gives up.
+
+    saved_intr_state = thrmgr_lock_acquire();
+    saved_lock_state = spinlock_acquire(&mem_lock);
+
+    if(compact_start != NO_RUN){
+        spinlock_release(&mem_lock, saved_lock_state);
+        thrmgr_lock_release(saved_intr_state);
+        return NO_RUN;
+    }
+
+    compact_stats.attempts++;
+    ctx.start = choose_window(cnt, align_cnt);
+
+    if(ctx.start != NO_RUN){
+        compact_start = ctx.start;
+        compact_cnt = cnt;
+        for(i = ctx.start; i < ctx.start + cnt; i++){
+            if(bitmap_test(free_map, i))
+                free_list_remove(index_to_page(i));
+        }
+    } else
+        compact_stats.ticks += csrr_time() - t0;
+
+    spinlock_release(&mem_lock, saved_lock_state);
+    thrmgr_lock_release(saved_intr_state);
+
+    if(ctx.start == NO_RUN)
+        return NO_RUN;
+
+    ctx.cnt = cnt;
+    ctx.migrated = 0;
+    ctx.failed = 0;
+
+    // Move the user pages out, one process and at most COMPACT_BATCH pages at
+    // a time, dropping the locks in between so that other harts can schedule.
+    // A walk that ends with batch moves to spare has emptied the window of
+    // that process's pages.
+
+    for(int pid = 0; procmgr_initialized && pid < idtab_size(&proctab) && !ctx.failed; pid++){
+        do {
+            ctx.batch_left = COMPACT_BATCH;
+
+            saved_intr_state = thrmgr_lock_acquire();
+            saved_lock_state = spinlock_acquire(&mem_lock);
+
+            proc = idtab_get(&proctab, pid);
+            if(proc != NULL && proc->thread_cnt > 0 && !thread_process_busy(proc)){
+                walk_user_leaves(mtag_to_root(proc->mtag), migrate_leaf, &ctx);
+                sfence_vma(); // the space may be cached in the TLB under any ASID
+            }
+
+            spinlock_release(&mem_lock, saved_lock_state);
+            thrmgr_lock_release(saved_intr_state);
+        } while(ctx.batch_left == 0 && !ctx.failed);
+    }
+
+    // Pages still marked movable are still mapped, by a process that was
+    // busy when we got to it.
+
+    saved_lock_state = spinlock_acquire(&mem_lock);
+
+    for(i = ctx.start; i < ctx.start + cnt; i++){
+        if(bitmap_test(movable_map, i))
+            ctx.failed = 1;
+    }
+
+    compact_start = NO_RUN;
+    compact_stats.pages_migrated += ctx.migrated;
+
+    if(ctx.failed){
+        // Give back the pages we own: those that were free, have been
+        // migrated or were freed during the pass.
+        for(i = ctx.start; i < ctx.start + cnt; i++){
+            if(!bitmap_test(movable_map, i))
+                free_list_insert(index_to_page(i));
+        }
+    } else
+        compact_stats.successes++;
+
+    compact_stats.ticks += csrr_time() - t0;
+    spinlock_release(&mem_lock, saved_lock_state);
+
+    return ctx.failed ? NO_RUN : ctx.start;
+}
+
 static inline int wellformed_vma(uintptr_t vma) {
     // Address bits 63:38 must be all 0 or all 1
     uintptr_t const bits = (intptr_t)vma >> 38;
@@ -564,8 +1270,12 @@ static inline uintptr_t round_down_addr(uintptr_t addr, size_t blksz) {
 static inline struct pte leaf_pte (
     const void * pptr, uint_fast8_t rwxug_flags)
 {
+    // User pages start out with A and D clear so we can see them being used;
+    // kernel pages are never scanned and must not fault on first access.
+    const uint_fast8_t ad_flags = (rwxug_flags & PTE_U) ? 0 : PTE_A | PTE_D;
+
     return (struct pte) {
-        .flags = rwxug_flags | PTE_A | PTE_D | PTE_V,
+        .flags = rwxug_flags | ad_flags | PTE_V,
         .ppn = pageptr_to_pagenum(pptr)
     };
 }
@@ -583,6 +1293,113 @@ static inline struct pte null_pte(void) {
     return (struct pte) { };
 }
 
+//Usage: Use this function to create one of the 16 PTEs of a 64 KB Svnapot page. pptr must be 64 KB aligned.
+static inline struct pte napot_pte (
+    const void * pptr, uint_fast8_t rwxug_flags)
+{
+    struct pte pte = leaf_pte(pptr, rwxug_flags);
+
+    pte.ppn |= NAPOT_PPN_64K;
+    pte.n = 1;
+    return pte;
+}
+
+//Usage: Use this function to get the physical page mapped by a leaf PTE at vma. Handles Svnapot PTEs, whose PPN does not give the page directly.
+static inline void * pte_pageptr(const struct pte * pte, uintptr_t vma) {
+    if(pte->n)
+        return pagenum_to_pageptr((pte->ppn & ~(uintptr_t)(NAPOT_PAGE_CNT-1)) | (VPN0(vma) & (NAPOT_PAGE_CNT-1)));
+    else
+        return pagenum_to_pageptr(pte->ppn);
+}
+
+//Usage: Use this function to change the RWXUG flags of a leaf PTE. The A and D flags of user pages are kept; kernel pages always have them set.
+static inline void set_pte_flags(struct pte * pte, uint_fast8_t rwxug_flags) {
+    uint_fast8_t ad_flags = PTE_A | PTE_D;
+
+    if(rwxug_flags & PTE_U) // keep what we know about accesses to user pages
+        ad_flags = pte->flags & (PTE_A | PTE_D);
+
+    pte->flags = rwxug_flags | ad_flags | PTE_V;
+}
+
+//Usage: Detects Svnapot by mapping the first 64 KB of RAM as a 64 KB page at USER_START_VMA (unused this early) and reading through it. Without Svnapot the N bit is reserved and the read faults.
+static void probe_svnapot(void) {
+    const uintptr_t vma = USER_START_VMA;
+    const int test_page = 5;
+    struct pte * pte;
+    uint64_t val;
+    int faults;
+
+    for(int i = 0; i < NAPOT_PAGE_CNT; i++){
+        pte = walk_pt(main_pt2, vma + i * PAGE_SIZE, 1);
+        *pte = napot_pte(RAM_START, PTE_R);
+    }
+    sfence_vma();
+
+    trap_probe_begin();
+    val = *(volatile uint64_t *)(vma + test_page * PAGE_SIZE);
+    faults = trap_probe_end();
+
+    napot_supported = (faults == 0 &&
+        val == *(const uint64_t *)(RAM_START + test_page * PAGE_SIZE));
+
+    for(int i = 0; i < NAPOT_PAGE_CNT; i++)
+        *walk_pt(main_pt2, vma + i * PAGE_SIZE, 0) = null_pte();
+    sfence_vma();
+}
+
+//Usage: Maps a 64 KB aligned block at vma with a single Svnapot page. Returns 0 (and maps nothing) if part of the block is already mapped or there is no free 64 KB run.
+static int alloc_and_map_napot(uintptr_t vma, uint_fast8_t rwxug_flags) {
+    struct pte * root = active_space_root();
+    struct pte * ptes;
+    size_t idx;
+    void * pp;
+
+    ptes = walk_pt(root, vma, 1); // the 16 PTEs are in the same page table
+    for(int i = 0; i < NAPOT_PAGE_CNT; i++){
+        if(ptes[i].flags & PTE_V)
+            return 0;
+    }
+
+    // Only use a run that is already free. Compacting for every 64 KB block
+    // would make exec and page faults slow; the idle threads keep a free
+    // megapage run around (see memory_compact_idle).
+
+    idx = take_free_run(NAPOT_PAGE_CNT, NAPOT_PAGE_CNT);
+    if(idx == NO_RUN)
+        return 0;
+
+    pp = index_to_page(idx);
+    cache_zero(pp, NAPOT_SIZE);
+
+    for(int i = 0; i < NAPOT_PAGE_CNT; i++)
+        ptes[i] = napot_pte(pp, rwxug_flags);
+
+    return 1;
+}
+
+//Usage: Splits the 64 KB page containing vma into 16 ordinary PTEs mapping the same pages with the same flags.
+static void demote_napot(struct pte * root, uintptr_t vma) {
+    struct pte * ptes = walk_pt(root, round_down_addr(vma, NAPOT_SIZE), 0);
+
+    for(int i = 0; i < NAPOT_PAGE_CNT; i++){
+        ptes[i].ppn &= ~(uintptr_t)(NAPOT_PAGE_CNT-1);
+        ptes[i].ppn |= i;
+        ptes[i].n = 0;
+    }
+    sfence_vma();
+}
+
 static inline void sfence_vma(void) {
     asm inline ("sfence.vma" ::: "memory");
 }
+
+// Used when the kernel is built without the balloon driver.
+
+void * __attribute__ ((weak)) vioballoon_reclaim_page(void) {
+    return NULL;
+}
+
+size_t __attribute__ ((weak)) vioballoon_reclaimable_count(void) {
+    return 0;
+}
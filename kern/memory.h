@@ -13,7 +13,10 @@
 #define PAGE_SIZE (size_t)(1 << PAGE_ORDER) // the size of the smallest page
 
 // PTE flags. Note: V, A, and D are managed internally; they should not be set
-// in any flags parameter passed to the functions below.
+// in any flags parameter passed to the functions below. Kernel mappings are
+// created with A and D set. User mappings are created with A and D clear, and
+// A and D are then set by hardware or by memory_handle_ad_fault when the page is
+// accessed, so that memory_scan_user can tell which pages a process uses.
 
 #define PTE_V (1 << 0)
 #define PTE_R (1 << 1)  // x2
@@ -44,6 +47,23 @@
 // EXPORTED TYPE DEFINITIONS
 //
 
+// Result of one memory_scan_user pass over a memory space.
+
+struct memory_ws_sample {
+    uint32_t resident;  // user pages mapped
+    uint32_t accessed;  // user pages referenced since the previous scan
+    uint32_t dirty;     // user pages written since the previous scan
+};
+
+// Compaction statistics (see memory_alloc_contig).
+
+struct memory_compact_stats {
+    uint32_t attempts;          // compaction passes started
+    uint32_t successes;         // passes that produced a free contiguous run
+    uint64_t pages_migrated;    // user pages moved, including by failed passes
+    uint64_t ticks;             // time spent compacting, in timer ticks
+};
+
 // EXPORTED VARIABLE DECLARATIONS
 //
 
@@ -99,6 +119,49 @@ extern void * memory_alloc_page(void);
 
 extern void memory_free_page(void * pp);
 
+// void * memory_reserve_page(void)
+// Removes a page from the free page pool without zeroing or otherwise touching
+// it. If the free list is empty, takes a page back from the balloon as
+// memory_alloc_page does. Returns NULL if there are no free pages. Used by the
+// balloon driver to hand pages to the host; such pages are returned with
+// memory_free_page. Kernel object free lists are also filled from it, so that
+// running out of memory fails the request rather than panics.
+
+extern void * memory_reserve_page(void);
+
+// size_t memory_free_page_count(void)
+// Returns the number of pages currently on the free page list.
+
+extern size_t memory_free_page_count(void);
+
+// void * memory_alloc_contig(size_t cnt, size_t align)
+// Allocates /cnt/ physically contiguous pages, the first of which is aligned to
+// /align/ bytes (a power of two, at least PAGE_SIZE). If there is no such run of
+// free pages, tries to create one by compacting memory, i.e. migrating user
+// pages out of the way. Returns a pointer to the first page, zeroed, or NULL if
+// the request cannot be satisfied. Unlike memory_alloc_page, does not panic.
+
+extern void * memory_alloc_contig(size_t cnt, size_t align);
+
+// void memory_free_contig(void * pp, size_t cnt)
+// Returns /cnt/ pages allocated by memory_alloc_contig to the page allocator.
+
+extern void memory_free_contig(void * pp, size_t cnt);
+
+// void memory_compact_idle(void)
+// Called by the idle thread. Compacts at most one megapage-sized window so
+// that a free megapage run is available, and does nothing if memory has not
+// changed since the last attempt.
+
+extern void memory_compact_idle(void);
+
+// void memory_get_compact_stats(struct memory_compact_stats * stats)
+// void memory_compact_report(void)
+// Return or print the compaction statistics.
+
+extern void memory_get_compact_stats(struct memory_compact_stats * stats);
+extern void memory_compact_report(void);
+
 // void * memory_alloc_and_map_page (
 //        uintptr_t vma, uint_fast8_t rwxug_flags)
 // Allocates and maps a physical page.
@@ -106,7 +169,8 @@ extern void memory_free_page(void * pp);
 // argument gives the virtual address of the page to map. The /pp/ argument is a
 // pointer to the physical page to map. The /rwxug_flags/ argument is an OR of
 // the PTE flags, of which only a combination of R, W, X, U, and G should be
-// specified. (The D, A, and V flags are always added by memory_map_page.) The
+// specified. (The V flag is always added, and D and A are added unless the U
+// flag is specified.) The
 // function returns a pointer to the mapped virtual page, i.e., (void*)vma.
 // Does not fail; panics if the request cannot be satsified.
 
@@ -159,11 +223,39 @@ extern int memory_validate_vptr_len (
 extern int memory_validate_vstr (
     const char * vs, uint_fast8_t ug_flags);
 
+// void * memory_translate_user(const void * vp, uint_fast8_t rwxug_flags)
+// Returns the direct-mapped kernel address, which is also the physical
+// address, of the byte at user address /vp/ in the active memory space, or
+// NULL if the page containing it is not mapped with all of /rwxug_flags/.
+
+extern void * memory_translate_user(const void * vp, uint_fast8_t rwxug_flags);
+
 // Called from excp.c to handle a page fault at the specified address. Either
 // maps a page containing the faulting address, or calls process_exit().
 
 extern void memory_handle_page_fault(const void * vptr);
 
+// int memory_handle_ad_fault(const void * vptr, uint_fast8_t rwx_flags)
+// Called from excp.c on a page fault at a user address. If the page containing
+// /vptr/ is mapped in the active memory space by a user PTE that allows the
+// access given by /rwx_flags/ (one of PTE_R, PTE_W, or PTE_X), sets the A flag
+// (and the D flag for PTE_W) and returns 1 so that the faulting instruction can
+// be restarted. Otherwise returns 0 and the fault must be handled as usual.
+
+extern int memory_handle_ad_fault(const void * vptr, uint_fast8_t rwx_flags);
+
+// void memory_scan_user(uintptr_t mtag, struct memory_ws_sample * ws)
+// Walks the user part of the memory space /mtag/, which need not be active, and
+// counts the user pages that are mapped, accessed and dirty. The A and D flags
+// of every user page are cleared, so each scan reports the accesses made since
+// the previous one.
+
+extern void memory_scan_user(uintptr_t mtag, struct memory_ws_sample * ws);
+
+// uintptr_t memory_space_clone(uint_fast16_t asid)
+// Copies the user pages of the active memory space into a new memory space and
+// returns its tag. Returns 0 if free memory is too short for the copy.
+
 uintptr_t memory_space_clone(uint_fast16_t asid);
 
 extern struct pte* walk_pt(struct pte* root, uintptr_t vma, int create);
@@ -14,7 +14,7 @@
 
 AS=riscv64-unknown-elf-as
 OBJCOPY=riscv64-unknown-elf-objcopy
-echo .end | $AS -o empty.o
+echo .end | $AS -march=rv64ima_zicsr_zifencei -mabi=lp64 -o empty.o # float ABI must match the kernel
 if [ -z "$1" ]; then
 	mv empty.o companion.o
 else
@@ -7,6 +7,11 @@
 #include "elf.h"
 #include "halt.h"
 #include "heap.h"
+#include "timer.h"
+#include "string.h"
+#include "console.h"
+#include "spinlock.h"
+#include "error.h"
 
 #ifdef PROCESS_TRACE
 #define TRACE
@@ -20,15 +25,33 @@
 // COMPILE-TIME PARAMETERS
 //
 
-// NPROC is the maximum number of processes
+// WSSCAN_INTERVAL_MS is the period of the working set scanner
 
-#ifndef NPROC
-#define NPROC 16
+#ifndef WSSCAN_INTERVAL_MS
+#define WSSCAN_INTERVAL_MS 200
+#endif
+
+// WSSCAN_LINGER_MS is how long the scanner keeps going after the estimates were
+// last read. With no reader it sleeps until the next one, so that an idle
+// system is not woken up every scan interval.
+
+#ifndef WSSCAN_LINGER_MS
+#define WSSCAN_LINGER_MS 5000
 #endif
 
 // INTERNAL FUNCTION DECLARATIONS
 //
 
+static void wsscan_thread_func(void * aux);
+static void process_ws_update(struct process_ws * ws);
+
+// Return a process struct from the free list, carving a new page into structs
+// if it is empty, or give one back. alloc_process returns NULL if memory is
+// out of pages.
+
+static struct process * alloc_process(void);
+static void free_process(struct process * proc);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -40,8 +63,26 @@ static struct process main_proc;
 
 // A table of pointers to all user processes in the system
 
-struct process * proctab[NPROC] = {
-    [MAIN_PID] = &main_proc
+struct idtab proctab;
+
+// Protects slot allocation in proctab; processes fork on any hart.
+
+static struct spinlock proctab_lock = {
+    .name = "proctab"
+};
+
+// Free process structs, protected by proctab_lock. They are carved out of
+// whole pages and never returned, since the heap cannot take them back.
+
+static struct process * process_free_list;
+
+// The working set scanner runs until wsscan_until (in mtime), which each read
+// of the estimates pushes forward. Both are protected by the thread manager
+// lock.
+
+static uint64_t wsscan_until;
+static struct condition wsscan_wanted = {
+    .name = "wsscan_wanted"
 };
 
 // EXPORTED GLOBAL VARIABLES
@@ -61,7 +102,9 @@ void procmgr_init(void) {
         return;
     }
 
-    main_proc.id = MAIN_PID; // set the process id of the main process to MAIN_PID
+    idtab_init(&proctab, NPROC); // empty process table, grown on demand
+    main_proc.id = idtab_alloc(&proctab, &main_proc); // the first id is MAIN_PID
+    assert (main_proc.id == MAIN_PID);
     main_proc.tid = running_thread(); // set the thread id of the main process to the running thread
 
     thread_set_process(main_proc.tid, &main_proc); // set the process of the main thread to the main process
@@ -72,6 +115,9 @@ void procmgr_init(void) {
         main_proc.iotab[i] = NULL; // set the io object to NULL
     }
 
+    // Start the working set scanner
+    thread_spawn("wsscan", wsscan_thread_func, NULL);
+
     procmgr_initialized = 1; //  set procmgr_initialized to 1
 
 }
@@ -84,6 +130,9 @@ int process_exec(struct io_intf * exeio) {
     uintptr_t usp = USER_STACK_VMA; // user stack pointer
     // uintptr_t upc;
 
+    if (current_process()->thread_cnt > 1) // the other threads still use the memory space
+        return -EBUSY;
+
     memory_unmap_and_free_user(); // unmaps and frees all pages with the U bit set in the PTE flags
 
     // Load the ELF file into memory
@@ -102,7 +151,8 @@ void process_terminate(int pid) {
     //outputs: none
     //description: Terminate the process with the given id. This involves terminating the thread associated with the process, reclaiming the memory space, and freeing the process struct.
 
-    struct process * proc = proctab[pid]; // get the process struct associated with the process id
+    struct process * proc = idtab_get(&proctab, pid); // get the process struct associated with the process id
+    int saved_intr_state;
 
     if (proc == NULL) {
         return;
@@ -127,38 +177,77 @@ void process_terminate(int pid) {
         memory_space_reclaim(); // reclaim the memory space
     }
 
-    // Free the process struct
+    // Free the process struct. Our thread still points at it, but with
+    // preemption disabled and thread_exit next, it is not looked at again
+    // (see process_thread_exit).
 
-    proctab[pid] = NULL; // set the process struct to NULL
-    
+    saved_intr_state = spinlock_acquire(&proctab_lock);
+    idtab_free(&proctab, pid); // the pid may be reused right away
+    spinlock_release(&proctab_lock, saved_intr_state);
+    if (proc != &main_proc)
+        free_process(proc);
 }
 
 void process_exit(void) {
     //inputs: none
     //outputs: none
-    //description: Terminate the current process and exit the current thread.
+    //description: Terminate the current process and exit the current thread. Other threads of the process see
+    //the exiting flag on their way back to U mode (see thread_preempt_check) and follow. Threads blocked in a
+    //system call (a futex, a join, a sleep or a read) are woken first, so that they get back to U mode.
+
+    current_process()->exiting = 1;
+    thread_interrupt_process(current_process());
+    process_thread_exit();
+}
+
+void process_thread_exit(void) {
+    //inputs: none
+    //outputs: none
+    //description: Exit the current thread. The last thread of the process to exit terminates the process.
 
     int pid = current_pid(); // get the process id of the current process
-    process_terminate(pid); // terminate the process
+
+    // Once the memory space is reclaimed, satp no longer matches our process, so we must not be
+    // switched away from and back (thread_exit never returns, so the count goes with the thread)
+    thread_preempt_disable();
+
+    if (thread_leave_process() == 0) // no other thread uses the memory space or files
+        process_terminate(pid); // terminate the process
     thread_exit(); // exit the current thread
 }
 
 int process_fork(const struct trap_frame *tfr){
     //inputs: tfr - trap frame
-    //outputs: 0 on success, negative error code on error
+    //outputs: child process id on success, -EAGAIN if the process or thread table is full or memory is short
     //description: Fork the current process. This involves creating a new process struct, copying the I/O devices from the parent process, and cloning the memory space.
-    struct process* child = kmalloc(sizeof(struct process)); // allocate memory for the child process
-
-    int i;
-    for(i=0; i<NPROC; i++){ // iterate through the proctab array
-        if(proctab[i] == NULL){ // if the process struct is NULL
-            proctab[i] = child; //  set the process struct to the child process
-            child->id = i; //   set the process id to i
-            break;
-        }
+    struct process* child = alloc_process(); // get a process struct for the child process
+    uintptr_t old_mtag;
+    int saved_intr_state;
+    int result;
+
+    if(child == NULL)
+        return -EAGAIN;
+
+    // The scanner and memory compaction may find the child in proctab before
+    // it has a memory space and a thread; they skip processes with no thread.
+    child->tid = -1;
+    child->thread_head = NULL;
+    child->thread_cnt = 0;
+    child->exiting = 0;
+    memset(&child->ru_exited, 0, sizeof(struct thread_rusage));
+    child->mtag = 0;
+
+    saved_intr_state = spinlock_acquire(&proctab_lock);
+    child->id = idtab_alloc(&proctab, child); // take a free process id
+    spinlock_release(&proctab_lock, saved_intr_state);
+    if(child->id < 0){ // process table is full
+        free_process(child);
+        return -EAGAIN;
     }
-    if(i >= NPROC)
-        panic("Maximum number of processes surpassed!");
+
+    memset(&child->ws, 0, sizeof(struct process_ws)); // no samples yet
+    for(int i=0; i<PROCESS_IOMAX; i++) // parent's table below may be sparse
+        child->iotab[i] = NULL;
 
     struct process * parent = current_process(); // get the process struct of the current process
     for(int i=0; i<PROCESS_IOMAX; i++){ // iterate through the iotab array
@@ -168,5 +257,183 @@ int process_fork(const struct trap_frame *tfr){
         }
     }
     child->mtag = memory_space_clone(parent->mtag);     // clone the memory space of the parent process
-    return thread_fork_to_user(child, tfr); // fork the thread to the user space
-}
\ No newline at end of file
+    if(child->mtag != 0)
+        result = thread_fork_to_user(child, tfr); // fork the thread to the user space
+    else
+        result = -EAGAIN; // not enough memory for a copy
+
+    if(result < 0){ // undo the fork
+        if(child->mtag != 0){ // free the child's user pages
+            thread_preempt_disable(); // a switch back to us would restore the parent's satp
+            old_mtag = memory_space_switch(child->mtag);
+            memory_unmap_and_free_user();
+            memory_space_switch(old_mtag);
+            thread_preempt_enable();
+        }
+        for(int i=0; i<PROCESS_IOMAX; i++){
+            if(child->iotab[i] != NULL)
+                ioclose(child->iotab[i]); // drop the references taken above
+        }
+        saved_intr_state = spinlock_acquire(&proctab_lock);
+        idtab_free(&proctab, child->id);
+        spinlock_release(&proctab_lock, saved_intr_state);
+        free_process(child);
+    }
+    return result;
+}
+
+int process_get_rusage(int pid, struct rusage * ru){
+    //inputs: pid - lowest process id to report on, or negative for the calling thread; ru - buffer to fill in
+    //outputs: id of the process (or thread) reported on, or -ENOENT if no process has an id of pid or more
+    //description: Report the CPU and memory usage of a process, or the CPU usage of the calling thread.
+    struct process_ws ws = { 0 };
+    struct thread_rusage tru;
+    struct process * proc = NULL;
+    int saved_intr_state;
+
+    if (pid < 0) {
+        thread_get_rusage(&tru);
+        ru->id = running_thread();
+        ru->nthreads = 1;
+    } else {
+        saved_intr_state = thrmgr_lock_acquire(); // keeps thread lists still
+        for (; pid < idtab_size(&proctab); pid++) {
+            proc = idtab_get(&proctab, pid);
+            if (proc != NULL && proc->thread_cnt > 0)
+                break;
+            proc = NULL;
+        }
+        if (proc != NULL) {
+            thread_process_rusage(proc, &tru);
+            ru->id = pid;
+            ru->nthreads = proc->thread_cnt;
+            ws = proc->ws;
+        }
+
+        // Someone is reading the working set estimates, so keep them fresh
+
+        wsscan_until = get_mtime() + WSSCAN_LINGER_MS * (TIMER_FREQ / 1000);
+        condition_broadcast(&wsscan_wanted);
+        thrmgr_lock_release(saved_intr_state);
+
+        if (proc == NULL)
+            return -ENOENT;
+    }
+
+    ru->run_time = tru.run_time;
+    ru->ready_time = tru.ready_time;
+    ru->wait_time = tru.wait_time;
+    ru->cycles = tru.cycles;
+    ru->nvcsw = tru.nvcsw;
+    ru->nivcsw = tru.nivcsw;
+    ru->edf_jobs = tru.edf_jobs;
+    ru->edf_misses = tru.edf_misses;
+    ru->resident = ws.last.resident;
+    ru->wss = ws.wss;
+    ru->dirty_rate = ws.dirty_rate;
+    return ru->id;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void wsscan_thread_func(void * aux) {
+    //inputs: aux - unused
+    //outputs: none
+    //description: Sample the A and D flags of every process's pages every WSSCAN_INTERVAL_MS,
+    //while anyone reads the estimates.
+    struct process * proc;
+    int saved_intr_state;
+    struct alarm al;
+    int idled;
+
+    alarm_init(&al, "wsscan");
+
+    for (;;) {
+        saved_intr_state = thrmgr_lock_acquire();
+        idled = 0;
+        while (wsscan_until <= get_mtime()) {
+            condition_wait(&wsscan_wanted);
+            idled = 1;
+        }
+        thrmgr_lock_release(saved_intr_state);
+
+        if (idled)
+            alarm_reset(&al); // do not make up for the scans skipped while idle
+        alarm_sleep_ms(&al, WSSCAN_INTERVAL_MS);
+
+        // Processes running on another hart or preempted in the kernel may be
+        // changing their page tables or exiting, so we skip them this round.
+        // Holding the thread manager lock keeps the others from being
+        // scheduled while we scan.
+
+        for (int i = 0; i < idtab_size(&proctab); i++) { // iterate through the proctab
+            saved_intr_state = thrmgr_lock_acquire();
+            proc = idtab_get(&proctab, i);
+            if (proc != NULL && proc->thread_cnt > 0 &&
+                !thread_process_busy(proc))
+            {
+                memory_scan_user(proc->mtag, &proc->ws.last);
+                process_ws_update(&proc->ws);
+            }
+            thrmgr_lock_release(saved_intr_state);
+        }
+    }
+}
+
+struct process * alloc_process(void) {
+    //inputs: none
+    //outputs: a process struct, or NULL if memory is out of pages
+    //description: Take a process struct from the free list, or carve a new page into process structs.
+    struct process * proc;
+    struct process * page;
+    int saved_intr_state;
+
+    saved_intr_state = spinlock_acquire(&proctab_lock);
+    proc = process_free_list;
+    if (proc != NULL)
+        process_free_list = proc->free_next;
+    spinlock_release(&proctab_lock, saved_intr_state);
+
+    if (proc != NULL)
+        return proc;
+
+    page = memory_reserve_page();
+    if (page == NULL)
+        return NULL;
+
+    saved_intr_state = spinlock_acquire(&proctab_lock);
+    for (int i = 1; i < PAGE_SIZE / sizeof(struct process); i++) { // keep the first, free the rest
+        page[i].free_next = process_free_list;
+        process_free_list = &page[i];
+    }
+    spinlock_release(&proctab_lock, saved_intr_state);
+    return &page[0];
+}
+
+void free_process(struct process * proc) {
+    //inputs: proc - process struct no longer in proctab
+    //outputs: none
+    //description: Put a process struct back on the free list.
+    int saved_intr_state;
+
+    saved_intr_state = spinlock_acquire(&proctab_lock);
+    proc->free_next = process_free_list;
+    process_free_list = proc;
+    spinlock_release(&proctab_lock, saved_intr_state);
+}
+
+void process_ws_update(struct process_ws * ws) {
+    //inputs: ws - working set estimate with a new sample in ws->last
+    //outputs: none
+    //description: Fold the newest sample into the smoothed estimates.
+
+    if (ws->scan_cnt++ == 0) {
+        ws->wss = ws->last.accessed;
+        ws->dirty_rate = ws->last.dirty;
+        return;
+    }
+
+    ws->wss += ((int32_t)ws->last.accessed - (int32_t)ws->wss) / 4;
+    ws->dirty_rate += ((int32_t)ws->last.dirty - (int32_t)ws->dirty_rate) / 4;
+}
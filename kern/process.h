@@ -8,26 +8,76 @@
 #define PROCESS_IOMAX 16
 #endif
 
+// NPROC is the maximum number of processes. The process table grows a page
+// at a time up to this size; past it, fork fails with -EAGAIN.
+
+#ifndef NPROC
+#define NPROC 1024
+#endif
+
 #include "config.h"
 #include "io.h"
 #include "thread.h"
+#include "memory.h"
+#include "idtab.h"
 #include <stdint.h>
 
 // EXPORTED TYPE DEFINITIONS
 //
 
+// Working set estimate of a process, updated by the working set scanner thread
+// every WSSCAN_INTERVAL_MS while the estimates are being read through
+// process_get_rusage. All counts are in pages. The smoothed values are
+// moving averages giving the newest sample a weight of 1/4.
+
+struct process_ws {
+    struct memory_ws_sample last; // most recent sample
+    uint32_t wss; // smoothed working set size
+    uint32_t dirty_rate; // smoothed pages dirtied per scan interval
+    uint32_t scan_cnt; // number of samples taken
+};
+
+// CPU usage of a process, summed over its threads (see struct thread_rusage),
+// and its working set estimate. Filled in by process_get_rusage; must match
+// struct rusage in user/syscall.h.
+
+struct rusage {
+    int id; // process or thread id
+    int nthreads; // live threads
+    uint64_t run_time; // mtime ticks spent running
+    uint64_t ready_time; // mtime ticks spent waiting for a hart
+    uint64_t wait_time; // mtime ticks spent sleeping
+    uint64_t cycles; // cycles spent running
+    unsigned long nvcsw; // voluntary context switches
+    unsigned long nivcsw; // involuntary context switches
+    unsigned long edf_jobs; // EDF jobs released
+    unsigned long edf_misses; // EDF jobs that missed their deadline
+    unsigned long resident; // resident user pages at the last scan
+    unsigned long wss; // smoothed working set, in pages (see struct process_ws)
+    unsigned long dirty_rate; // smoothed pages dirtied per scan interval
+};
+
+// A process has one or more threads sharing its memory space and open files.
+// The thread list and count are protected by the thread manager lock.
+
 struct process {
     int id; // process id of this process
-    int tid; // thread id of associated thread
+    int tid; // thread id of the first thread, which the parent waits for
+    struct thread * thread_head; // threads of the process (see thread.c)
+    int thread_cnt; // number of threads on the list
+    volatile char exiting; // process_exit called; other threads exit too
+    struct thread_rusage ru_exited; // CPU usage of threads no longer listed
     uintptr_t mtag; // memory space identifier
     struct io_intf * iotab[PROCESS_IOMAX];
+    struct process_ws ws; // working set estimate
+    struct process * free_next; // link on the free list (see process.c)
 };
 
 // EXPORTED VARIABLES DECLARATIONS
 //
 
 extern char procmgr_initialized;
-extern struct process * proctab[];
+extern struct idtab proctab; // process id to struct process
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -36,10 +86,27 @@ extern void procmgr_init(void);
 extern int process_exec(struct io_intf * exeio);
 extern int process_fork(const struct trap_frame *tfr);
 
+// Exits the whole process: the calling thread exits at once, and every other
+// thread of the process exits the next time it returns to U mode. The last
+// thread to leave closes the open files and frees the process.
+
 extern void __attribute__ ((noreturn)) process_exit(void);
 
+// Exits the calling thread only. If it was the last thread of the process,
+// the process is torn down as in process_exit.
+
+extern void __attribute__ ((noreturn)) process_thread_exit(void);
+
 extern void process_terminate(int pid);
 
+// int process_get_rusage(int pid, struct rusage * ru)
+// Fills in /ru/ with the CPU and memory usage of the process with the lowest id that is
+// at least /pid/, and returns that id, or -ENOENT if there is no such process.
+// Callers list all processes by starting at 0 and passing one more than the
+// previous result. If /pid/ is negative, reports the calling thread instead.
+
+extern int process_get_rusage(int pid, struct rusage * ru);
+
 static inline struct process * current_process(void);
 static inline int current_pid(void);
 
@@ -17,9 +17,19 @@
 
 #define SYSCALL_EXEC    30
 #define SYSCALL_FORK    31
+#define SYSCALL_THRCREATE 32
+#define SYSCALL_THREXIT 33
+#define SYSCALL_THRJOIN 34
 
 #define SYSCALL_USLEEP  40
 #define SYSCALL_WAIT    41
+#define SYSCALL_YIELD   42
+#define SYSCALL_SETPRIO 43
+#define SYSCALL_LOCKSTAT 44
+#define SYSCALL_FUTEX   45
+#define SYSCALL_GETRUSAGE 46
+#define SYSCALL_SETDEADLINE 47
+#define SYSCALL_KREPORT 48
 
 
 #endif // _SCNUM_H_
@@ -0,0 +1,170 @@
+// smp.c - Symmetric multiprocessing
+//
+
+#ifdef SMP_TRACE
+#define TRACE
+#endif
+
+#ifdef SMP_DEBUG
+#define DEBUG
+#endif
+
+#include "smp.h"
+#include "thread.h"
+#include "memory.h"
+#include "timer.h"
+#include "intr.h"
+#include "csr.h"
+#include "console.h"
+#include "halt.h"
+
+#include <stdint.h>
+
+// INTERNAL CONSTANTS
+//
+
+// Each hart has a 32-bit machine software interrupt pending register in the
+// CLINT. Writing 1 raises a machine software interrupt on that hart, which the
+// M mode trap handler in trapasm.s turns into a supervisor software interrupt.
+
+#define CLINT_MSIP_ADDR 0x2000000UL
+
+// Time allowed for secondary harts to reach their parking loop in start.s.
+// They have far less to do than hart 0, so this is only a safety margin.
+
+#define PARK_WAIT_MS 10
+
+// EXPORTED GLOBAL VARIABLE DEFINITIONS
+//
+
+char smp_initialized = 0;
+
+struct cpu cpus[NCPU] = {
+    [0] = {
+        .hartid = 0,
+        .online = 1
+    }
+};
+
+int smp_ncpu = 1;
+
+// The following are shared with start.s. A secondary hart sets its bit in
+// smp_hart_mask when it parks, then waits for the go word of its entry in
+// smp_boot_params. Harts with an id of smp_max_cpu or more stay parked.
+
+volatile uint32_t smp_hart_mask;
+const int smp_max_cpu = NCPU;
+
+struct smp_boot_params {
+    volatile uint64_t go; // must be first (start.s)
+    uint64_t satp;
+    void * sp;
+    void * tp;
+} smp_boot_params[NCPU];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+// Entry point of a secondary hart, called from start.s running on the hart's
+// idle thread stack with paging enabled.
+
+extern void __attribute__ ((noreturn)) smp_secondary_main(int hartid);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void smp_init(void) {
+    struct thread_stack_anchor * anchor;
+    uint64_t t0;
+    int hartid;
+
+    trace("%s()", __func__);
+
+    t0 = csrr_time();
+    while (csrr_time() - t0 < PARK_WAIT_MS * (TIMER_FREQ / 1000))
+        continue;
+
+    for (hartid = 1; hartid < NCPU; hartid++) {
+        if ((smp_hart_mask & (UINT32_C(1) << hartid)) == 0)
+            continue;
+
+        cpus[hartid].hartid = hartid;
+        anchor = thread_create_idle(&cpus[hartid]);
+
+        smp_boot_params[hartid].satp = main_mtag;
+        smp_boot_params[hartid].sp = anchor;
+        smp_boot_params[hartid].tp = anchor->thread;
+        __sync_synchronize();
+        smp_boot_params[hartid].go = 1;
+
+        // Bring harts up one at a time so that each finds a consistent
+        // scheduler state when it first takes the thread manager lock.
+
+        while (!cpus[hartid].online)
+            continue;
+
+        smp_ncpu++;
+        debug("Hart %d online", hartid);
+    }
+
+    smp_initialized = 1;
+}
+
+void smp_send_ipi(int hartid) {
+    assert (0 <= hartid && hartid < NCPU);
+    __sync_synchronize(); // make our updates visible before the target wakes
+    *(volatile uint32_t*)(CLINT_MSIP_ADDR + 4 * hartid) = 1;
+}
+
+void smp_ipi_handler(void) {
+    // Clear the pending bit before looking for work, so that an IPI sent
+    // after this point is not lost. An IPI asks the hart to look at its ready
+    // lists: the idle loop does so after wfi, and any other thread on its way
+    // out of intr_handler if the sender set need_resched. With Sstc, it may also
+    // ask the hart to reprogram its timer.
+
+    csrc_sip(RISCV_SIP_SSIP);
+    this_cpu()->ipi_cnt++;
+    timer_resync();
+}
+
+void smp_report(void) {
+    const struct cpu * cpu;
+    int i;
+
+    kprintf("hart  ready  steals      ipis  switches  kpreempt  fp loads"
+        "  fp saves  edf util\n");
+
+    for (i = 0; i < NCPU; i++) {
+        cpu = &cpus[i];
+        if (!cpu->online)
+            continue;
+        kprintf("%4d  %5u  %6lu  %8lu  %8lu  %8lu  %8lu  %8lu  %6u.%u%%\n",
+            cpu->hartid, cpu->nready, cpu->steal_cnt, cpu->ipi_cnt,
+            cpu->ctxsw_cnt, cpu->kpreempt_cnt, cpu->fp_load_cnt,
+            cpu->fp_save_cnt, cpu->edf_util / 10, cpu->edf_util % 10);
+    }
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void smp_secondary_main(int hartid) {
+    struct cpu * const cpu = &cpus[hartid];
+
+    trace("%s(%d)", __func__, hartid);
+
+    // Per-hart S mode state. Hart 0 sets this up in memory_init, intr_init
+    // and timer_init. External interrupts are routed to hart 0 only (see
+    // plic.c), so we leave SEIE clear.
+
+    csrs_sstatus(RISCV_SSTATUS_SUM);
+    csrc_sstatus(RISCV_SSTATUS_FS); // lazy FP, see thread_fp_trap
+    csrw_sip(0);
+    csrw_sie(RISCV_SIE_SSIE);
+    timer_init_hart();
+
+    cpu->online = 1;
+
+    thread_idle_loop();
+}
@@ -0,0 +1,94 @@
+// smp.h - Symmetric multiprocessing
+//
+
+#ifndef _SMP_H_
+#define _SMP_H_
+
+#include <stdint.h>
+#include "thread.h" // for struct thread_list
+
+// COMPILE-TIME PARAMETERS
+//
+
+// NCPU is the maximum number of harts the kernel will run on. Harts with a
+// larger hart id stay parked in start.s.
+
+#ifndef NCPU
+#define NCPU 4
+#endif
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// Per-hart state. The ready lists and the counters next to them are protected
+// by the thread manager lock (see thrmgr_lock_acquire in thread.h). There is
+// one ready list per scheduling priority level; ready_list[0] is served first.
+// Ready EDF threads (see thread_set_deadline) are kept apart, ordered by
+// deadline, and are served before all levels. They stay on the hart that
+// admitted them and are never stolen.
+
+struct cpu {
+    int hartid;
+    volatile char online; // hart has entered the scheduler
+    volatile char idling; // idle thread is about to wfi; kick it with an IPI
+    char need_resched; // running thread should yield at the next chance
+    char tick_stopped; // periodic tick is off (see timer_set_tick)
+    char budget_armed; // budget timer set for an EDF job (see timer_set_budget)
+    struct thread * idle_thread;
+    struct thread * running; // thread currently running on the hart
+    struct thread_list ready_list[THREAD_PRIO_CNT];
+    unsigned int nready; // threads on all ready lists
+    struct thread * edf_head; // ready EDF threads, earliest deadline first
+    unsigned int edf_nready; // threads on the EDF list (included in nready)
+    unsigned int edf_util; // admitted EDF utilization in 1/1000 of the hart
+    unsigned long steal_cnt; // threads taken from other harts
+    unsigned long ipi_cnt; // IPIs received
+    unsigned long ctxsw_cnt; // context switches
+    unsigned long kpreempt_cnt; // switches away from a thread in S mode
+    struct thread * fp_owner; // thread whose FP registers the hart last loaded
+    unsigned long fp_load_cnt; // FP register loads (see thread_fp_trap)
+    unsigned long fp_save_cnt; // FP register saves on context switch
+};
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+extern char smp_initialized;
+extern struct cpu cpus[NCPU];
+extern int smp_ncpu; // number of harts online
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Releases the secondary harts parked in start.s. Each one switches to the
+// kernel memory space and starts running its own idle thread. Must be called
+// on hart 0 after thread_init, procmgr_init and timer_init.
+
+extern void smp_init(void);
+
+// Returns the struct cpu of the hart we are running on. Defined in thread.c,
+// since each thread records the hart it was last scheduled on.
+
+extern struct cpu * this_cpu(void);
+
+// Sends an inter-processor interrupt to a hart. The target takes a supervisor
+// software interrupt, which wakes it from wfi.
+
+extern void smp_send_ipi(int hartid);
+
+extern void smp_ipi_handler(void); // called from intr.c
+
+// Prints per-hart scheduling counters to the console.
+
+extern void smp_report(void);
+
+static inline int smp_hartid(void);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline int smp_hartid(void) {
+    return this_cpu()->hartid;
+}
+
+#endif // _SMP_H_
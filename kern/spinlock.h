@@ -0,0 +1,54 @@
+// spinlock.h - A spin lock for short critical sections shared between harts
+//
+
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+#include "intr.h"
+
+// A spinlock protects data that is touched by more than one hart, or by a
+// thread and an ISR. Interrupts are disabled on the holding hart for as long as
+// the lock is held, so an ISR on the same hart can never spin on a lock its own
+// hart holds. A spinlock must not be held across anything that may sleep, such
+// as condition_wait or lock_acquire. It is valid to initialize a struct
+// spinlock with all zeroes.
+
+struct spinlock {
+    volatile int locked;
+    const char * name;
+};
+
+static inline void spinlock_init(struct spinlock * lk, const char * name);
+static inline int spinlock_acquire(struct spinlock * lk);
+static inline void spinlock_release(struct spinlock * lk, int saved_intr_state);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline void spinlock_init(struct spinlock * lk, const char * name) {
+    lk->locked = 0;
+    lk->name = name;
+}
+
+// Disables interrupts, then spins until the lock is free. Returns the previous
+// interrupt enable state, which must be passed to spinlock_release.
+
+static inline int spinlock_acquire(struct spinlock * lk) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+
+    while (__atomic_exchange_n(&lk->locked, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (lk->locked)
+            continue;
+    }
+
+    return saved_intr_state;
+}
+
+static inline void spinlock_release(struct spinlock * lk, int saved_intr_state) {
+    __atomic_store_n(&lk->locked, 0, __ATOMIC_RELEASE);
+    intr_restore(saved_intr_state);
+}
+
+#endif // _SPINLOCK_H_
@@ -1,5 +1,15 @@
         .section	.text
-        
+
+        # All harts start here. Keep the hart id in s1, which survives the
+        # switch to S mode. Harts beyond MAX_HARTS have no M mode save area
+        # and are parked for good.
+
+        .equ    MAX_HARTS, 8
+
+        csrr    s1, mhartid
+        li      t0, MAX_HARTS
+        bgeu    s1, t0, park
+
         # Delegate to S mode all S mode interrupts and all exceptions except
         # ecall from S mode and M mode; ecalls from S mode are used to provide
         # access to the timer to S mode. Enable M mode interrupts.
@@ -28,6 +38,31 @@
         csrs    mcounteren, 7
         csrs    scounteren, 7
 
+        # Allow cache block operations in S mode (menvcfg is CSR 0x30a):
+        # CBZE (cbo.zero), CBCFE (cbo.clean, cbo.flush) and CBIE=01 (cbo.inval
+        # performs a flush). Harts without Zicboz or Zicbom ignore these bits;
+        # cache_init probes for the extensions.
+
+        li      t0, 0xd0
+        csrs    0x30a, t0
+
+        # Also set menvcfg.STCE (bit 63) so that S mode may program its own
+        # timer through stimecmp (Sstc). The bit stays clear on harts without
+        # Sstc, and timer_init then falls back to mtimecmp.
+
+        li      t0, 1
+        slli    t0, t0, 63
+        csrs    0x30a, t0
+
+        # Point mscratch at this hart's M mode save area (see trapasm.s) and
+        # enable M mode software interrupts, which carry IPIs.
+
+        la      t0, _mmode_save_area
+        slli    t1, s1, 4
+        add     t0, t0, t1
+        csrw    mscratch, t0
+        csrsi   mie, 8 # MSIE
+
         # Switch to S mode
 
         li      t0, 0x1080 # bits to clear in mstatus (MPP=01,MPIE=0)
@@ -38,11 +73,13 @@
         csrw    mepc, t0
         mret
 1:      
+        bnez    s1, secondary_start
 
         # Set stack pointer. The main thread uses a statically-allocated stack
         # in the .data section.
 
         la	sp, _main_stack_anchor
+        la      tp, main_thread
         mv      fp, zero
 
         # If main returns 0, jump to halt_success, otherwise to halt_failure
@@ -51,6 +88,48 @@
         bnez    a0, halt_failure
         j       halt_success
 
+        # Secondary harts announce themselves in smp_hart_mask and wait for
+        # smp_init (smp.c) to fill in their struct smp_boot_params. Then they
+        # turn on paging and enter smp_secondary_main on their idle thread.
+
+secondary_start:
+        la      t0, smp_max_cpu
+        lw      t0, 0(t0)
+        bgeu    s1, t0, park
+
+        li      t0, 1
+        sll     t0, t0, s1
+        la      t1, smp_hart_mask
+        amoor.w zero, t0, (t1)
+
+        la      t0, smp_boot_params
+        slli    t1, s1, 5 # sizeof(struct smp_boot_params) is 32
+        add     t0, t0, t1
+2:      ld      t1, 0(t0) # go
+        beqz    t1, 2b
+        fence
+
+        ld      t1, 8(t0) # satp
+        csrw    satp, t1
+        sfence.vma
+        ld      sp, 16(t0)
+        ld      tp, 24(t0)
+        mv      fp, zero
+        mv      a0, s1
+        call    smp_secondary_main
+
+park:
+        wfi
+        j       park
+
+        .section        .bss
+        .balign         16
+
+        # Two dwords per hart for the M mode trap handler (trapasm.s)
+
+_mmode_save_area:
+        .fill   MAX_HARTS*2, 8, 0
+
         .section        .data.stack, "wa", @progbits
         .balign		16
         
@@ -11,7 +11,17 @@
 #include "error.h"
 #include "fs.h"
 #include "timer.h"
+#include "lock.h"
+#include "futex.h"
+#include "intr.h"
+#include "workq.h"
+#include "ktask.h"
+#include "smp.h"
+#include "string.h"
 
+// Number of locks listed when a program asks for the lock report
+
+#define LOCK_REPORT_CNT 10
 
 void sys_exit(void) {
     //inputs: none
@@ -161,7 +171,8 @@ int sys_exec(int fd) {
 int sys_wait(int tid){
     //inputs: tid - thread id
     //outputs: thread ID of child that exited
-    //description: wait for a child thread to exit by calling thread_join
+    //description: wait for a child process's thread to exit by calling thread_join; threads started with
+    //_thread_create are joined with _thread_join instead
 
     if(tid == 0)
         return thread_join_any();
@@ -182,6 +193,102 @@ void sys_usleep(unsigned long us){
     alarm_reset(&al);       //call alarm_reset
 }
 
+void sys_yield(void){
+    //inputs: none
+    //outputs: none
+    //description: give up the hart to another ready thread of the same or
+    //higher priority by calling thread_yield
+
+    thread_yield();
+}
+
+int sys_setpriority(int prio){
+    //inputs: prio - new base priority, 0 (highest) to THREAD_PRIO_LOW
+    //outputs: previous base priority, or -EINVAL if prio is out of range
+    //description: set the scheduling priority of the calling thread
+
+    return thread_set_priority(prio);
+}
+
+int sys_lockstat(struct lockstat * st){
+    //inputs: st - user buffer for the statistics
+    //outputs: 0 on success, negative error code on error
+    //description: copy the sleep lock and context switch counters to the user
+
+    int validate_result = memory_validate_vptr_len(st, sizeof(*st), PTE_W | PTE_U);
+    if (validate_result != 0) return validate_result;
+    lock_get_stats(st);
+    return 0;
+}
+
+int sys_kreport(int what){
+    //inputs: what - KREPORT_ selectors of the reports to print
+    //outputs: 0 on success, -EINVAL if what selects nothing known
+    //description: print the selected kernel statistics to the console
+
+    if (what == 0 || (what & ~KREPORT_ALL) != 0)
+        return -EINVAL;
+
+    if (what & KREPORT_LOCKS)
+        lock_report(LOCK_REPORT_CNT);
+    if (what & KREPORT_SMP)
+        smp_report();
+    if (what & KREPORT_INTR)
+        intr_report();
+    if (what & KREPORT_WORKQ)
+        workq_report();
+    if (what & KREPORT_KTASK)
+        ktask_report();
+    if (what & KREPORT_EDF)
+        thread_edf_report();
+    return 0;
+}
+
+int sys_futex(uint32_t * uaddr, int op, uint32_t val){
+    //inputs: uaddr - user address of the futex word, op - FUTEX_WAIT or FUTEX_WAKE, val - value expected in the
+    //word for FUTEX_WAIT, or the most threads to wake for FUTEX_WAKE
+    //outputs: 0 or the number of threads woken on success, negative error code on error
+    //description: sleep on a futex while it holds val, or wake threads sleeping on it
+
+    switch (op) {
+    case FUTEX_WAIT:
+        return futex_wait(uaddr, val);
+    case FUTEX_WAKE:
+        return futex_wake(uaddr, (int)val);
+    default:
+        return -EINVAL;
+    }
+}
+
+int sys_getrusage(int pid, struct rusage * ru){
+    //inputs: pid - lowest process id to report on, or negative for the calling thread; ru - user buffer
+    //outputs: id of the process or thread reported on, or negative error code on error
+    //description: copy the CPU usage of a process or of the calling thread to the user
+    struct rusage kru;
+    int result;
+
+    int validate_result = memory_validate_vptr_len(ru, sizeof(*ru), PTE_W | PTE_U);
+    if (validate_result != 0) return validate_result;
+    result = process_get_rusage(pid, &kru);
+    if (result >= 0)
+        memcpy(ru, &kru, sizeof(kru));
+    return result;
+}
+
+int sys_setdeadline(unsigned long period_us, unsigned long budget_us, unsigned long deadline_us){
+    //inputs: period_us - time between job releases, 0 to leave the EDF class; budget_us - CPU time per job;
+    //deadline_us - time from a release by which the job must finish, all in microseconds
+    //outputs: 0 on success, -EINVAL for bad parameters, -EBUSY if the hart has no room for the task
+    //description: make the calling thread a periodic task scheduled by earliest deadline first
+    const unsigned long max_us = UINT64_MAX / (TIMER_FREQ / 1000000);
+
+    if (max_us < period_us || max_us < budget_us || max_us < deadline_us)
+        return -EINVAL;
+
+    return thread_set_deadline(period_us * (TIMER_FREQ / 1000000),
+        budget_us * (TIMER_FREQ / 1000000), deadline_us * (TIMER_FREQ / 1000000));
+}
+
 static int sys_fork(const struct trap_frame *tfr){
     // inputs: tfr - trap frame
     // outputs: 0 on success, negative error code on error
@@ -190,6 +297,37 @@ static int sys_fork(const struct trap_frame *tfr){
     return ret;
 }
 
+static int sys_thread_create(const struct trap_frame *tfr){
+    // inputs: tfr - trap frame; a0 is the start function, a1 its argument, a2 the top of the new thread's stack and
+    // a3 the entry point, a trampoline in the user library that calls a0 with a1 and exits the thread
+    // outputs: thread ID of the new thread, or negative error code on error
+    // description: Start a new thread in the current process by calling thread_create_user
+    struct trap_frame child_tfr;
+    const uintptr_t usp = tfr->x[TFR_A2];
+    const uintptr_t upc = tfr->x[TFR_A3];
+
+    if(usp <= USER_START_VMA || USER_END_VMA < usp || usp % 16 != 0) // stack must be in user memory
+        return -EINVAL;
+    if(upc < USER_START_VMA || USER_END_VMA <= upc)
+        return -EINVAL;
+
+    memcpy(&child_tfr, tfr, sizeof(struct trap_frame)); // gp and tp as in the caller
+    child_tfr.sepc = upc;
+    child_tfr.x[TFR_SP] = usp;
+    child_tfr.x[TFR_RA] = 0; // the trampoline does not return
+    return thread_create_user(&child_tfr); // a0 and a1 pass through to the trampoline
+}
+
+static int sys_thread_join(int tid){
+    // inputs: tid - thread id of a thread created by the caller
+    // outputs: tid on success, -EINVAL if tid is not a child of the caller
+    // description: wait for a thread to exit by calling thread_join_user
+
+    if(tid <= 0 || thread_join_user(tid) < 0)
+        return -EINVAL;
+    return tid;
+}
+
 void syscall_handler(struct trap_frame *tfr) {
     //inputs: trap frame
     //outputs: none
@@ -242,6 +380,18 @@ void syscall_handler(struct trap_frame *tfr) {
             //process fork system call
             tfr->x[TFR_A0] = sys_fork(tfr);
             break;
+        case SYSCALL_THRCREATE:
+            //thread create system call
+            tfr->x[TFR_A0] = sys_thread_create(tfr);
+            break;
+        case SYSCALL_THREXIT:
+            //thread exit system call
+            process_thread_exit();
+            break;
+        case SYSCALL_THRJOIN:
+            //thread join system call
+            tfr->x[TFR_A0] = sys_thread_join((int)a[TFR_A0]);
+            break;
         case SYSCALL_WAIT:
             //process wait system call
             tfr->x[TFR_A0] = sys_wait((int)a[TFR_A0]);
@@ -250,6 +400,35 @@ void syscall_handler(struct trap_frame *tfr) {
             //process usleep system call
             sys_usleep((unsigned long)a[TFR_A0]);
             break;
+        case SYSCALL_YIELD:
+            //process yield system call
+            sys_yield();
+            tfr->x[TFR_A0] = 0;
+            break;
+        case SYSCALL_SETPRIO:
+            //process setprio system call
+            tfr->x[TFR_A0] = sys_setpriority((int)a[TFR_A0]);
+            break;
+        case SYSCALL_LOCKSTAT:
+            //process lockstat system call
+            tfr->x[TFR_A0] = sys_lockstat((struct lockstat *)a[TFR_A0]);
+            break;
+        case SYSCALL_FUTEX:
+            //futex wait or wake system call
+            tfr->x[TFR_A0] = sys_futex((uint32_t *)a[TFR_A0], (int)a[TFR_A1], (uint32_t)a[TFR_A2]);
+            break;
+        case SYSCALL_GETRUSAGE:
+            //process getrusage system call
+            tfr->x[TFR_A0] = sys_getrusage((int)a[TFR_A0], (struct rusage *)a[TFR_A1]);
+            break;
+        case SYSCALL_SETDEADLINE:
+            //process setdeadline system call
+            tfr->x[TFR_A0] = sys_setdeadline((unsigned long)a[TFR_A0], (unsigned long)a[TFR_A1], (unsigned long)a[TFR_A2]);
+            break;
+        case SYSCALL_KREPORT:
+            //process kreport system call
+            tfr->x[TFR_A0] = sys_kreport((int)a[TFR_A0]);
+            break;
         default:
             tfr->x[TFR_A0] = -ENOTSUP; // Return error for unknown system call
             break;
@@ -13,3 +13,20 @@ extern int sys_exec(int pid);
 void syscall_handler(struct trap_frame *tfr);
 extern int sys_wait(int tid);
 extern void sys_usleep(unsigned long us);
+extern void sys_yield(void);
+extern int sys_setpriority(int prio);
+struct lockstat; // lock.h
+extern int sys_lockstat(struct lockstat * st);
+
+// Selectors for sys_kreport, which may be or-ed together. Must match
+// user/syscall.h.
+
+#define KREPORT_LOCKS   0x01 // most contended sleep locks
+#define KREPORT_SMP     0x02 // per-hart scheduler counters
+#define KREPORT_INTR    0x04 // ISR run times
+#define KREPORT_WORKQ   0x08 // work queue latencies
+#define KREPORT_KTASK   0x10 // kernel task statistics
+#define KREPORT_EDF     0x20 // EDF threads
+#define KREPORT_ALL     0x3f
+
+extern int sys_kreport(int what);
@@ -23,7 +23,8 @@ _thread_swtch:
         # The currently running thread is suspended and resuming_thread is
         # restored to execution. swtch returns when execution is switched back
         # to the calling thread. The return value is the previously executing
-        # thread. Interrupts are enabled when swtch returns.
+        # thread. The caller holds the thread manager lock, which stays held
+        # across the switch and is released by the thread being resumed.
         #
         # tp = pointer to struct thread of current thread (to be suspended)
         # a0 = pointer to struct thread of thread to be resumed
@@ -45,7 +46,8 @@ _thread_swtch:
         sd      ra, 12*8(tp)
         sd      sp, 13*8(tp)
 
-        # move the resumed thread into tp
+        # Remember the suspended thread and move the resumed thread into tp
+        mv      t0, tp
         mv      tp, a0
 
         # Restore the new thread's context
@@ -63,7 +65,8 @@ _thread_swtch:
         ld      s2, 2*8(tp)
         ld      s1, 1*8(tp)
         ld      s0, 0*8(tp)
-                
+
+        mv      a0, t0          # return the suspended thread
         ret
 
         .global _thread_setup
@@ -94,8 +97,11 @@ _thread_setup:
 
         jal     t0, 1f
 
-        # The glue code below is executed when we first switch into the new thread
+        # The glue code below is executed when we first switch into the new
+        # thread. a0 holds the thread we switched away from, and the thread
+        # manager lock is still held; thread_startup (thread.c) releases it.
 
+        call    thread_startup
         la      ra, thread_exit # child will return to thread_exit
         mv      a0, s0          # get arg argument to child from s0
         mv      a1, s1          # get arg argument to child from s0
@@ -161,51 +167,112 @@ _idle_stack_anchor:
         .fill   8
     
         .text
-        .global _thread_finish_fork
-        .type   _thread_finish_fork, @function
-
-_thread_finish_fork:
-# input: a0 = pointer to child thread
-# output: a0 = 0
-# purpose: set up child thread to return 0 from fork
+        .global _thread_fork_entry
+        .type   _thread_fork_entry, @function
 
-        # Save the current thread's context
-        sd      s0, 0*8(tp)
-        sd      s1, 1*8(tp)
-        sd      s2, 2*8(tp)
-        sd      s3, 3*8(tp)
-        sd      s4, 4*8(tp)
-        sd      s5, 5*8(tp)
-        sd      s6, 6*8(tp)
-        sd      s7, 7*8(tp)
-        sd      s8, 8*8(tp)
-        sd      s9, 9*8(tp)
-        sd      s10, 10*8(tp)
-        sd      s11, 11*8(tp)
-        sd      ra, 12*8(tp)
-        sd      sp, 13*8(tp) 
+_thread_fork_entry:
+# input: sp = pointer to the child's copy of the parent trap frame
+# output: none
+# purpose: first code run by a forked child thread; returns to user mode
+        # We are started by the thread entry glue of _thread_setup, which has
+        # released the thread manager lock. _entry_from_fork disables
+        # interrupts and restores the user context from the trap frame.
 
-        # move the resumed thread into tp
-        mv      tp, a0
+        j       _entry_from_fork
 
-        # ld      s0, 0*8(tp)     # load s0 from trap frame (this is the child tid)
-        # sd      s0, 10*8(a1)    # changes the a0 value of the parent tfr to be the child tid
+        # The kernel is assembled without F and D (see Makefile), so we
+        # enable D just for the FP save and restore functions.
 
-        ld      sp, 13*8(tp)    # load child's kernel stack pointer from the thread context
+        .option push
+        .option arch, +d
 
-        # mv      t6, sp          # t6 = child's kernel stack pointer
+        .global _thread_fp_save
+        .type   _thread_fp_save, @function
 
-        addi    sp, sp, -34*8   # Allocate space for trap frame
+# void _thread_fp_save(struct thread_fpstate * fp)
+# void _thread_fp_restore(const struct thread_fpstate * fp)
+#
+# Save the FP registers and fcsr to /fp/, or load them from it. sstatus.FS must
+# not be Off. Loading leaves FS Dirty; the caller marks it Clean. See the lazy
+# FP functions in thread.c.
+
+_thread_fp_save:
+        fsd     f0, 0*8(a0)
+        fsd     f1, 1*8(a0)
+        fsd     f2, 2*8(a0)
+        fsd     f3, 3*8(a0)
+        fsd     f4, 4*8(a0)
+        fsd     f5, 5*8(a0)
+        fsd     f6, 6*8(a0)
+        fsd     f7, 7*8(a0)
+        fsd     f8, 8*8(a0)
+        fsd     f9, 9*8(a0)
+        fsd     f10, 10*8(a0)
+        fsd     f11, 11*8(a0)
+        fsd     f12, 12*8(a0)
+        fsd     f13, 13*8(a0)
+        fsd     f14, 14*8(a0)
+        fsd     f15, 15*8(a0)
+        fsd     f16, 16*8(a0)
+        fsd     f17, 17*8(a0)
+        fsd     f18, 18*8(a0)
+        fsd     f19, 19*8(a0)
+        fsd     f20, 20*8(a0)
+        fsd     f21, 21*8(a0)
+        fsd     f22, 22*8(a0)
+        fsd     f23, 23*8(a0)
+        fsd     f24, 24*8(a0)
+        fsd     f25, 25*8(a0)
+        fsd     f26, 26*8(a0)
+        fsd     f27, 27*8(a0)
+        fsd     f28, 28*8(a0)
+        fsd     f29, 29*8(a0)
+        fsd     f30, 30*8(a0)
+        fsd     f31, 31*8(a0)
+        frcsr   t0
+        sd      t0, 32*8(a0)
+        ret
 
-        # sd      t6, 2*8(sp)     # Save child's kernel stack pointer in trap frame
+        .global _thread_fp_restore
+        .type   _thread_fp_restore, @function
+
+_thread_fp_restore:
+        ld      t0, 32*8(a0)
+        fscsr   t0
+        fld     f0, 0*8(a0)
+        fld     f1, 1*8(a0)
+        fld     f2, 2*8(a0)
+        fld     f3, 3*8(a0)
+        fld     f4, 4*8(a0)
+        fld     f5, 5*8(a0)
+        fld     f6, 6*8(a0)
+        fld     f7, 7*8(a0)
+        fld     f8, 8*8(a0)
+        fld     f9, 9*8(a0)
+        fld     f10, 10*8(a0)
+        fld     f11, 11*8(a0)
+        fld     f12, 12*8(a0)
+        fld     f13, 13*8(a0)
+        fld     f14, 14*8(a0)
+        fld     f15, 15*8(a0)
+        fld     f16, 16*8(a0)
+        fld     f17, 17*8(a0)
+        fld     f18, 18*8(a0)
+        fld     f19, 19*8(a0)
+        fld     f20, 20*8(a0)
+        fld     f21, 21*8(a0)
+        fld     f22, 22*8(a0)
+        fld     f23, 23*8(a0)
+        fld     f24, 24*8(a0)
+        fld     f25, 25*8(a0)
+        fld     f26, 26*8(a0)
+        fld     f27, 27*8(a0)
+        fld     f28, 28*8(a0)
+        fld     f29, 29*8(a0)
+        fld     f30, 30*8(a0)
+        fld     f31, 31*8(a0)
+        ret
 
-        # sd      tp, 4*8(t6)     # Save child's thread pointer in trap frame
+        .option pop
 
-        sd      zero, 10*8(sp)  # set child's return value to 0
-        
-        # load corresponding value in trap frame (sp) for a0 with 0
-        # loac the sp in trap frame with stack anchor
-        
-        j _entry_from_fork  # jump to _entry_from_fork
-        
         .end
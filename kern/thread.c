@@ -14,16 +14,53 @@
 #include "intr.h"
 #include "process.h"
 #include "memory.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "error.h"
+#include "timer.h"
+#include "idtab.h"
+#include "ktask.h"
 
 // COMPILE-TIME PARAMETERS
 //
 
-// NTHR is the maximum number of threads
+// NTHR is the maximum number of threads. The thread table grows a page at a
+// time up to this size; past it, thread creation fails with -EAGAIN.
 
 #ifndef NTHR
-#define NTHR 32
+#define NTHR 1024
 #endif
 
+// PRIO_BOOST_MS is the time between priority boosts in milliseconds. Every so
+// often all threads are returned to their base priority, so that a thread that
+// was demoted while busy is not starved by a stream of interactive threads,
+// and so that a thread that turns interactive gets its priority back.
+
+#ifndef PRIO_BOOST_MS
+#define PRIO_BOOST_MS 1000
+#endif
+
+// THREAD_CACHE_CNT is the number of free kernel stack pages kept on hand for
+// new threads. thread_init fills the cache, and an exited thread returns its
+// stack to it instead of to the page allocator, so spawn and fork need not
+// take a page in the common case. Free thread descriptors are all kept (see
+// alloc_thread).
+
+#ifndef THREAD_CACHE_CNT
+#define THREAD_CACHE_CNT 8
+#endif
+
+// EDF_UTIL_MAX is the share of a hart, in 1/1000, that thread_set_deadline
+// hands out to EDF threads. The rest is left to the normal class, so that
+// admitted periodic tasks cannot starve everything else even when they all
+// run up to their budgets.
+
+#ifndef EDF_UTIL_MAX
+#define EDF_UTIL_MAX 900
+#endif
+
+#define MS_TO_MTIME(ms) ((ms) * (TIMER_FREQ / 1000))
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -47,6 +84,35 @@ struct thread_context {
     void * sp;
 };
 
+// FP registers of a user thread (see thread_fp_trap). Layout is shared with
+// _thread_fp_save and _thread_fp_restore in thrasm.s.
+
+struct thread_fpstate {
+    union {
+        uint64_t f[32];
+        struct thread_fpstate * free_next; // link on fpstate_free_list
+    };
+    uint64_t fcsr;
+};
+
+// Deadline class parameters and state of a thread (see thread_set_deadline).
+// A thread is in the EDF class while /period/ is non-zero, and is scheduled by
+// deadline while it is also not throttled.
+
+struct thread_edf {
+    uint64_t period; // mtime ticks between releases, 0 if not EDF
+    uint64_t budget; // CPU time allowed per job
+    uint64_t rel_deadline; // deadline relative to the release
+    uint64_t release; // release time of the next job (see thread_edf_alarm)
+    uint64_t deadline; // absolute deadline of the current job
+    uint64_t budget_left; // CPU time left in the current job
+    struct cpu * cpu; // hart the thread was admitted on
+    unsigned int util; // share of the hart reserved, in 1/1000
+    char throttled; // budget used up; runs at normal priority
+    char release_pending; // next job starts when the thread wakes
+    unsigned long overrun_cnt; // jobs throttled for using up their budget
+};
+
 struct thread {
     struct thread_context context; // must be first member (thrasm.s)
     const char * name;
@@ -56,21 +122,56 @@ struct thread {
     int id;
     struct process * proc;
     struct thread * parent;
+    struct cpu * cpu; // hart the thread last ran on
+    int prio; // current scheduling priority level
+    int base_prio; // highest level the thread may be raised to
+    uint64_t slice_left; // mtime ticks left in the current time slice
+    uint64_t run_start; // mtime when slice_left was last charged
     struct thread * list_next;
     struct condition * wait_cond;
     struct condition child_exit;
+    struct thread * child_head; // first child not yet recycled
+    struct thread * uthread_head; // first user thread created, not recycled
+    struct thread * sibling_next; // links in the parent's child list
+    struct thread * sibling_prev;
+    struct thread_list zombies; // exited children, oldest first
+    struct thread_list uthread_zombies; // exited user threads created
+    char uthread; // created by thread_create_user (see add_child)
+    struct thread * join_target; // child awaited by thread_join or NULL
+    struct thread * proc_next; // links in the process's thread list
+    struct thread * proc_prev;
+    struct thread_rusage ru; // CPU usage up to the last switch
+    uint64_t state_since; // mtime of the last change of running, ready or waiting
+    uint64_t cycle_start; // cycle counter when last switched in
+    struct thread_fpstate * fp; // saved FP registers, NULL until first FP use
+    struct cpu * fp_cpu; // hart whose FP registers last held ours
+    struct thread_edf edf; // deadline class state
+    int preempt_count; // kernel preemption disabled while non-zero
+    char kpreempted; // switched away in the middle of kernel code
+    char intr_wait; // waiting in condition_wait_intr
+    char interrupted; // woken by thread_interrupt_process
 };
 
 // INTERNAL GLOBAL VARIABLES
 //
 
+// Length of the time slice at each priority level, in mtime ticks. Threads at
+// lower levels run less often, but for longer once they do.
+
+static const uint64_t prio_quantum[THREAD_PRIO_CNT] = {
+    MS_TO_MTIME(20), MS_TO_MTIME(40), MS_TO_MTIME(80), MS_TO_MTIME(160)
+};
+
 #define MAIN_TID 0
-#define IDLE_TID (NTHR-1)
+#define IDLE_TID 1 // idle thread of hart 0
 
 struct thread main_thread = {
     .name = "main",
     .id = MAIN_TID,
     .state = THREAD_RUNNING,
+    .cpu = &cpus[0],
+    .prio = THREAD_PRIO_HIGH,
+    .base_prio = THREAD_PRIO_HIGH,
     .child_exit = {
         .name = "main.child_exit"
     }
@@ -80,15 +181,33 @@ struct thread idle_thread = {
     .name = "idle",
     .id = IDLE_TID,
     .state = THREAD_READY,
-    .parent = &main_thread
+    .parent = &main_thread,
+    .cpu = &cpus[0],
+    .prio = THREAD_PRIO_LOW,
+    .base_prio = THREAD_PRIO_LOW
 };
 
-static struct thread * thrtab[NTHR] = {
-    [MAIN_TID] = &main_thread,
-    [IDLE_TID] = &idle_thread
+// Maps thread ids to threads. Protected by the thread manager lock, except
+// that lookups with idtab_get need no lock.
+
+static struct idtab thrtab;
+
+static struct spinlock thrmgr_lock = {
+    .name = "thrmgr"
 };
 
-static struct thread_list ready_list;
+static volatile int thrmgr_lock_hart = -1; // hart holding thrmgr_lock
+
+// Free thread descriptors, linked through list_next, free FP register save
+// areas, and a cache of free kernel stack pages, all protected by the thread
+// manager lock. Descriptors and FP save areas are carved out of whole pages
+// and never returned, since the heap cannot take them back. Free descriptors are already reset (see reset_thread); cached
+// stack pages are not zeroed, since a kernel stack needs no clearing.
+
+static struct thread * thread_free_list;
+static struct thread_fpstate * fpstate_free_list;
+static void * stack_cache[THREAD_CACHE_CNT];
+static int stack_cache_cnt;
 
 // INTERNAL MACRO DEFINITIONS
 // 
@@ -129,30 +248,226 @@ static const char * thread_state_name(enum thread_state state)
     __attribute__ ((unused));
 
 // void suspend_self(void)
-// Suspends the currently running thread and resumes the next thread on the
-// ready-to-run list using _thread_swtch (in threasm.s). Must be called with
-// interrupts enabled. Returns when the current thread is next scheduled for
-// execution. If the current thread is RUNNING, it is marked READY and placed
-// on the ready-to-run list. Note that suspend_self will only return if the
-// current thread becomes READY.
+// Suspends the currently running thread and resumes the highest-priority thread
+// on this hart's ready-to-run lists using _thread_swtch (in threasm.s). Must be
+// called with the thread manager lock held; returns with it held. A RUNNING
+// thread keeps the hart if only threads of lower priority are ready. If the
+// ready lists are empty and the current thread cannot continue, a thread is
+// taken from another hart, and failing that the hart's idle thread runs.
+// Returns when the current thread is next scheduled for execution. If the
+// current thread is RUNNING, it is marked READY and placed at the back of the
+// ready-to-run list for its priority. Note that suspend_self will only return
+// if the current thread becomes READY.
 
 static void suspend_self(void);
 
+// Called on the resuming side of every context switch with the thread manager
+// lock held. Frees the stack of /prev/ if it has exited, and recycles /prev/
+// if it was a detached user thread.
+
+static void finish_switch(struct thread * prev);
+
+// Marks a thread READY and puts it on the ready list of the hart it last ran
+// on. If that hart, or failing that some other hart, is idle, sends it an IPI
+// so that it picks the thread up. Must be called with the thread manager lock
+// held.
+
+static void make_ready(struct thread * thr);
+
+// Makes a thread just removed from the wait list of /cond/ ready to run. Must
+// be called with the thread manager lock held.
+
+static void wake_waiter(struct condition * cond, struct thread * thr);
+
+// Puts a READY thread at the back of the ready list of /cpu/ for its current
+// priority. An EDF thread that is not throttled goes on the EDF list of the
+// hart it was admitted on instead, after the threads with an earlier or equal
+// deadline.
+
+static void rq_insert(struct cpu * cpu, struct thread * thr);
+
+// Removes and returns the first thread of the highest-priority non-empty ready
+// list of /cpu/, considering only levels up to and including /prio/. Returns
+// NULL if there is no such thread.
+
+static struct thread * rq_remove(struct cpu * cpu, int prio);
+
+// Removes and returns the first thread of the EDF list of /cpu/ if its
+// deadline is before /before/. Returns NULL otherwise.
+
+static struct thread * edf_remove(struct cpu * cpu, uint64_t before);
+
+// Returns 1 if /thr/ is scheduled by deadline: it is in the EDF class and has
+// budget left in its current job.
+
+static inline int edf_active(const struct thread * thr);
+
+// Starts a new job of an EDF thread, released at thr->edf.release or at /now/
+// if that is later, with a full budget.
+
+static void edf_release(struct thread * thr, uint64_t now);
+
+// Charges the time since /thr/ was last charged against its time slice, or its
+// budget if it is an active EDF thread. Returns 1 if the slice expired or the
+// budget ran out, in which case the thread is throttled until its next job.
+
+static int charge_thread(struct thread * thr, uint64_t now);
+
+// Returns every thread to its base priority with a fresh time slice and
+// re-sorts the ready lists accordingly.
+
+static void boost_all(void);
+
+// Charges the time since /thr/ was last charged against its time slice. If the
+// slice is used up, the thread drops one priority level and gets a new slice.
+// Returns 1 if the slice expired, 0 otherwise.
+
+static int charge_slice(struct thread * thr, uint64_t now);
+
+// Charges /prev/ for its time on the hart and /next/ for its time on a ready
+// list, as the hart switches from /prev/ to /next/. The state of /prev/ says
+// whether the switch was voluntary.
+
+static void account_switch (
+    struct thread * prev, struct thread * next, uint64_t now);
+
+// Adds the usage of /thr/ to /sum/, including the time it has been in its
+// current state.
+
+static void add_rusage (
+    struct thread_rusage * sum, const struct thread * thr, uint64_t now);
+
+static inline uint64_t ticks_since(uint64_t then, uint64_t now);
+
+// Returns 1 if the running thread may be switched away from at an arbitrary
+// point in the kernel: it has not disabled preemption, is not the idle thread
+// and a reschedule is pending on its hart. Interrupts must be disabled.
+
+static int preempt_wanted(void);
+
+// Switches away from the running thread at a kernel preemption point. The
+// thread is marked as preempted in the kernel until it runs again, since it
+// may hold pointers to physical pages of its process (see
+// thread_process_busy). Must be called with the thread manager lock held.
+
+static void preempt_self(void);
+
+// Turn the periodic tick of a hart off and on. The tick is only needed while
+// the hart has threads waiting on its ready lists: it is stopped when a tick
+// finds them empty or the hart goes idle, and restarted by rq_insert.
+
+static void stop_tick(struct cpu * cpu);
+static void start_tick(struct cpu * cpu);
+
+// Arms the budget timer of /cpu/ for the end of the budget of /thr/, which is
+// about to run or go on running there, or disarms it if /thr/ is not an active
+// EDF thread. The periodic tick is too coarse to enforce budgets of a few
+// milliseconds. Must be called with the thread manager lock held, after
+// thr->run_start is set.
+
+static void set_budget_timer(struct cpu * cpu, struct thread * thr);
+
+// Removes the highest-priority thread of the hart with the most ready threads
+// and returns it, or returns NULL if no other hart has runnable threads. EDF
+// threads are not taken.
+
+static struct thread * steal_thread(struct cpu * cpu);
+
+// Returns 1 if this hart has threads waiting to run, or another hart has
+// threads this one could take.
+
+static int work_available(void);
+
+// Return a reset thread descriptor or a kernel stack page, from the free list
+// or cache if possible, otherwise from a new page. Must be called without the
+// thread manager lock held. Both return NULL if memory is out of pages.
+
+static struct thread * alloc_thread(void);
+static void * alloc_stack(void);
+
+// Give a thread descriptor back to the free list, or a stack page back to its
+// cache or to the page allocator if the cache is full. May be called with the
+// thread manager lock held.
+
+static void free_thread(struct thread * thr);
+static void free_stack(void * stack_page);
+
+// Return a zeroed FP register save area, or NULL if memory is out of pages, or
+// give one back. Same rules for the thread manager lock as for alloc_thread
+// and free_thread.
+
+static struct thread_fpstate * alloc_fpstate(void);
+static void free_fpstate(struct thread_fpstate * fp);
+
+// Zeroes a thread descriptor and initializes its child_exit condition.
+
+static void reset_thread(struct thread * thr);
+
+// Creates a thread in process /proc/ that enters U mode through a copy of the
+// trap frame /tfr/. The thread is a child of the running thread. If /copy_fp/
+// is set, it also gets a copy of the running thread's FP registers. Returns the
+// thread id or -EAGAIN.
+
+static int spawn_user_thread (
+    struct process * proc, const struct trap_frame * tfr,
+    const char * name, int copy_fp);
+
+// Add /thr/ to, or remove it from, the thread list of /proc/. Must be called
+// with the thread manager lock held.
+
+static void proc_add_thread(struct process * proc, struct thread * thr);
+static void proc_remove_thread(struct process * proc, struct thread * thr);
+
+// Add /child/ to, or remove it from, the child list of its parent. Each
+// thread keeps a doubly-linked list of its children that have not been
+// recycled yet, so that reparenting only visits actual children. User threads
+// started with thread_create_user are kept apart from the other children
+// (kernel threads and the first threads of forked processes): they are joined
+// with thread_join_user and never reaped by thread_join_any or thread_join.
+// Must be called with the thread manager lock held.
+
+static void add_child(struct thread * parent, struct thread * child);
+static void remove_child(struct thread * child);
+
+// Hands the children of /thr/, which is being recycled, to /parent/. User
+// threads do not change process: those that have exited are recycled, and the
+// others are detached and recycle themselves when they exit (see
+// finish_switch). Must be called with the thread manager lock held.
+
+static void reparent_children(struct thread * thr, struct thread * parent);
+
+// Returns the child list, or the zombie queue, of /parent/ that /child/
+// belongs on.
+
+static struct thread ** child_list (
+    struct thread * parent, const struct thread * child);
+static struct thread_list * zombie_list (
+    struct thread * parent, const struct thread * child);
+
+// Common part of thread_join and thread_join_user
+
+static int join_child(int tid, int uthread);
+
 // The following functions manipulate a thread list (struct thread_list). Note
 // that threads form a linked list via the list_next member of each thread
-// structure. Thread lists are used for the ready-to-run list (ready_list) and
-// for the list of waiting threads of each condition variable. These functions
-// are not interrupt-safe! The caller must disable interrupts before calling any
-// thread list function that may modify a list that is used in an ISR.
+// structure. Thread lists are used for the per-hart ready-to-run lists and for
+// the list of waiting threads of each condition variable. These functions are
+// not thread-safe! The caller must hold the thread manager lock.
 
 static void tlclear(struct thread_list * list);
 static int tlempty(const struct thread_list * list);
 static void tlinsert(struct thread_list * list, struct thread * thr);
 static struct thread * tlremove(struct thread_list * list);
+static void tlremove_thread(struct thread_list * list, struct thread * thr);
 static void tlappend(struct thread_list * l0, struct thread_list * l1);
 
 static void idle_thread_func(void * arg);
 
+// Called in suspend_self before switching away from /thr/. Saves the FP
+// registers if the thread wrote them and turns FP off for the next thread.
+
+static void fp_switch_out(struct thread * thr, struct cpu * cpu);
+
 // IMPORTED FUNCTION DECLARATIONS
 // defined in thrasm.s
 //
@@ -166,9 +481,15 @@ extern void __attribute__ ((noreturn)) _thread_finish_jump (
     const struct thread_stack_anchor * stack_anchor,
     uintptr_t usp, uintptr_t upc, ...);
 
-extern void _thread_finish_fork(
-    struct thread * child, const struct trap_frame * parent_tfr);
+extern void _thread_fork_entry(void);
 
+extern void _thread_fp_save(struct thread_fpstate * fp);
+extern void _thread_fp_restore(const struct thread_fpstate * fp);
+
+// Called from the new thread entry glue in thrasm.s with the thread manager
+// lock held. Finishes the switch away from /prev/ and releases the lock.
+
+extern void thread_startup(struct thread * prev);
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -178,12 +499,58 @@ int running_thread(void) {
 }
 
 void thread_init(void) {
+    int tid;
+
+    // The ids of a fresh table are handed out in order, which gives the main
+    // thread and the boot hart's idle thread their fixed ids.
+
+    idtab_init(&thrtab, NTHR);
+    tid = idtab_alloc(&thrtab, &main_thread);
+    assert (tid == MAIN_TID);
+    tid = idtab_alloc(&thrtab, &idle_thread);
+    assert (tid == IDLE_TID);
+
+    while (stack_cache_cnt < THREAD_CACHE_CNT)
+        stack_cache[stack_cache_cnt++] = memory_alloc_page();
+
+    csrc_sstatus(RISCV_SSTATUS_FS); // until a user thread needs FP
+
     init_main_thread();
     init_idle_thread();
     set_running_thread(&main_thread);
+    cpus[0].running = &main_thread;
     thrmgr_initialized = 1;
 }
 
+int thrmgr_lock_acquire(void) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+
+    if (thrmgr_lock_hart == CURTHR->cpu->hartid)
+        return THRMGR_LOCK_NESTED;
+
+    spinlock_acquire(&thrmgr_lock); // interrupts are already disabled
+    thrmgr_lock_hart = CURTHR->cpu->hartid;
+    return saved_intr_state;
+}
+
+void thrmgr_lock_release(int saved) {
+    if (saved == THRMGR_LOCK_NESTED)
+        return;
+
+    assert (thrmgr_lock_hart == CURTHR->cpu->hartid);
+
+    // We may have just woken a thread that outranks us on this hart (see
+    // make_ready). If we are about to enable interrupts, let it run now
+    // rather than at the next return to user mode.
+
+    if ((saved & RISCV_SSTATUS_SIE) && preempt_wanted())
+        preempt_self();
+    thrmgr_lock_hart = -1;
+    spinlock_release(&thrmgr_lock, saved);
+}
+
 int thread_spawn(const char * name, void (*start)(void *), void * arg) {
     struct thread_stack_anchor * stack_anchor;
     void * stack_page;
@@ -193,42 +560,49 @@ int thread_spawn(const char * name, void (*start)(void *), void * arg) {
 
     trace("%s(name=\"%s\") in %s", __func__, name, CURTHR->name);
 
-    // Find a free thread slot.
-
-    tid = 0;
-    while (++tid < NTHR)
-        if (thrtab[tid] == NULL)
-            break;
-    
-    if (tid == NTHR)
-        panic("ERROR: Too many threads");
-    
     // Allocate a struct thread and a stack
 
-    child = kmalloc(sizeof(struct thread));
+    child = alloc_thread();
+    if (child == NULL)
+        return -EAGAIN;
+
+    stack_page = alloc_stack();
+    if (stack_page == NULL) {
+        free_thread(child);
+        return -EAGAIN;
+    }
 
-    stack_page = memory_alloc_page();
     stack_anchor = stack_page + PAGE_SIZE;
     stack_anchor -= 1;
     stack_anchor->thread = child;
     stack_anchor->reserved = 0;
 
+    saved_intr_state = thrmgr_lock_acquire();
 
-    thrtab[tid] = child;
+    tid = idtab_alloc(&thrtab, child);
+    if (tid < 0) {
+        thrmgr_lock_release(saved_intr_state);
+        free_stack(stack_page);
+        free_thread(child);
+        return tid;
+    }
 
     child->id = tid;
     child->name = name;
     child->parent = CURTHR;
+    add_child(CURTHR, child);
     child->proc = CURTHR->proc;
+    child->cpu = CURTHR->cpu;
+    child->base_prio = CURTHR->base_prio;
+    child->prio = child->base_prio;
+    child->slice_left = prio_quantum[child->prio];
     child->stack_base = stack_anchor;
     child->stack_size = child->stack_base - stack_page;
-    set_thread_state(child, THREAD_READY);
-
-    saved_intr_state = intr_disable();
-    tlinsert(&ready_list, child);
-    intr_restore(saved_intr_state);
 
     _thread_setup(child, child->stack_base, (void (*)(void))start, arg);
+    make_ready(child);
+
+    thrmgr_lock_release(saved_intr_state);
     
     return tid;
 }
@@ -237,12 +611,29 @@ void thread_exit(void) {
     if (CURTHR == &main_thread)
         halt_success();
     
+    // The lock is released by the thread we switch to.
+
+    thrmgr_lock_acquire();
+
     set_thread_state(CURTHR, THREAD_EXITED);
 
-    // Signal parent in case it is waiting for us to exit
+    if (CURTHR->edf.period != 0)
+        CURTHR->edf.cpu->edf_util -= CURTHR->edf.util;
+
+    // Queue up for our parent to reap us, and wake it if it is waiting for
+    // any child or for us in particular. The ready and wait lists are done
+    // with us, so list_next is free for the zombie queue. A user thread is
+    // only awaited by thread_join_user, and one whose creator is gone has no
+    // parent and is recycled in finish_switch.
 
-    assert(CURTHR->parent != NULL);
-    condition_broadcast(&CURTHR->parent->child_exit);
+    if (CURTHR->parent != NULL) {
+        tlinsert(zombie_list(CURTHR->parent, CURTHR), CURTHR);
+
+        if (CURTHR->parent->join_target == CURTHR ||
+            (CURTHR->parent->join_target == NULL && !CURTHR->uthread))
+            condition_broadcast(&CURTHR->parent->child_exit);
+    } else
+        assert (CURTHR->uthread);
 
     suspend_self(); // should not return
     panic("thread_exit() failed");
@@ -253,276 +644,1569 @@ void thread_jump_to_user(uintptr_t usp, uintptr_t upc) {
     // Outputs: none
     // Purpose: Jump to user space with the specified user stack pointer and
     intr_disable(); // disable interrupts
+
+    // The new program starts with zeroed FP registers, loaded on first use
+
+    csrc_sstatus(RISCV_SSTATUS_FS);
+    if (CURTHR->fp != NULL)
+        memset(CURTHR->fp, 0, sizeof(struct thread_fpstate));
+    if (CURTHR->cpu->fp_owner == CURTHR)
+        CURTHR->cpu->fp_owner = NULL;
+    CURTHR->fp_cpu = NULL;
+
     csrc_sstatus(RISCV_SSTATUS_SPP); // clear SPP bit
     csrs_sstatus(RISCV_SSTATUS_SPIE); // enable interrupts
     _thread_finish_jump(CURTHR->stack_base, usp, upc); // finish jump
 }
 
 void thread_yield(void) {
+    int saved_intr_state;
+
     trace("%s() in %s", __func__, CURTHR->name);
 
-    // assert (intr_enabled());
     assert (CURTHR->state == THREAD_RUNNING);
 
+    saved_intr_state = thrmgr_lock_acquire();
     suspend_self();
+    thrmgr_lock_release(saved_intr_state);
 }
 
-int thread_join_any(void) {
-    int childcnt = 0;
-    int tid;
+int thread_set_priority(int prio) {
+    int saved_intr_state;
+    int old_prio;
 
-    trace("%s() in %s", __func__, CURTHR->name);
+    trace("%s(prio=%d) in %s", __func__, prio, CURTHR->name);
 
-    // See if there are any children of the current thread, and if they have
-    // already exited. If so, call thread_wait_one() to finish up.
+    if (prio < THREAD_PRIO_HIGH || THREAD_PRIO_LOW < prio)
+        return -EINVAL;
 
-    for (tid = 1; tid < NTHR; tid++) {
-        if (thrtab[tid] != NULL && thrtab[tid]->parent == CURTHR) {
-            if (thrtab[tid]->state == THREAD_EXITED)
-                return thread_join(tid);
-            childcnt++;
-        }
-    }
+    saved_intr_state = thrmgr_lock_acquire();
 
-    // If the current thread has no children, this is a bug. We could also
-    // return -EINVAL if we want to allow the calling thread to recover.
+    old_prio = CURTHR->base_prio;
+    CURTHR->base_prio = prio;
+    CURTHR->prio = prio;
+    CURTHR->slice_left = prio_quantum[prio];
+    CURTHR->run_start = get_mtime();
 
-    if (childcnt == 0)
-        panic("thread_wait called by childless thread");
-    
+    thrmgr_lock_release(saved_intr_state);
 
-    // Wait for some child to exit. An exiting thread signals its parent's
-    // child_exit condition.
+    return old_prio;
+}
 
-    condition_wait(&CURTHR->child_exit);
+int thread_set_deadline(uint64_t period, uint64_t budget, uint64_t deadline) {
+    struct thread * const thr = CURTHR;
+    struct cpu * cpu;
+    int saved_intr_state;
+    unsigned int util, held;
 
-    for (tid = 1; tid < NTHR; tid++) {
-        if (thrtab[tid] != NULL &&
-            thrtab[tid]->parent == CURTHR &&
-            thrtab[tid]->state == THREAD_EXITED)
-        {
-            recycle_thread(tid);
-            return tid;
-        }
-    }
+    trace("%s(period=%lu, budget=%lu, deadline=%lu) in %s", __func__,
+        period, budget, deadline, thr->name);
 
-    panic("spurious child_exit signal");
-}
+    if (period != 0 && (budget == 0 || deadline < budget || period < deadline))
+        return -EINVAL;
 
-// Wait for specific child thread to exit. Returns the thread id of the child.
+    // Admission test: EDF meets all deadlines on a hart as long as the summed
+    // density (budget over relative deadline) of its tasks is at most 1. We
+    // keep the sum within EDF_UTIL_MAX, rounding each density up.
 
-int thread_join(int tid) {
-    struct thread * const child = thrtab[tid];
+    util = (period != 0) ? (budget * 1000 + deadline - 1) / deadline : 0;
 
-    trace("%s(tid=%d)", __func__, tid);
+    saved_intr_state = thrmgr_lock_acquire();
 
-    if (tid <= 0 || NTHR <= tid)
-        return -1;
+    // The thread is admitted on the hart it is running on. Its current share
+    // only counts towards that hart if it was admitted there; a thread stolen
+    // while throttled holds its share on the hart that admitted it. Nothing
+    // changes unless the new parameters pass the test.
 
-    trace("%s(tid=%d) in %s", __func__, tid, CURTHR->name);
+    cpu = thr->cpu;
+    held = (thr->edf.period != 0 && thr->edf.cpu == cpu) ? thr->edf.util : 0;
 
-    // Can only wait for child if we're the parent
+    if (cpu->edf_util - held + util > EDF_UTIL_MAX) {
+        thrmgr_lock_release(saved_intr_state);
+        return -EBUSY;
+    }
 
-    if (child == NULL || child->parent != CURTHR)
-        return -1;
-    
-    // Wait for child to exit. Whenever a child exits, it signals its parent's
-    // child_exit condition.
+    if (thr->edf.period != 0)
+        thr->edf.cpu->edf_util -= thr->edf.util;
 
-    while (child->state != THREAD_EXITED)
-        condition_wait(&CURTHR->child_exit);
-    
-    recycle_thread(tid);
+    cpu->edf_util += util;
+    thr->edf.util = util;
+    thr->edf.cpu = cpu;
+    thr->edf.period = period;
+    thr->edf.budget = budget;
+    thr->edf.rel_deadline = deadline;
+    thr->edf.release_pending = 0;
 
-    return tid;
-}
+    // Whatever the thread does until its first alarm counts as its first job
 
-struct process * thread_process(int tid) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    return thrtab[tid]->proc;
-}
+    if (period != 0) {
+        thr->edf.release = get_mtime();
+        edf_release(thr, thr->edf.release);
+    }
 
-void thread_set_process(int tid, struct process * proc) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    thrtab[tid]->proc = proc;
-}
+    thr->run_start = get_mtime();
+    set_budget_timer(cpu, thr);
 
-const char * thread_name(int tid) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    return thrtab[tid]->name;
+    thrmgr_lock_release(saved_intr_state);
+
+    return 0;
 }
 
-void condition_init(struct condition * cond, const char * name) {
-    cond->name = name;
-    tlclear(&cond->wait_list);
+void thread_edf_alarm(uint64_t twake) {
+    struct thread * const thr = CURTHR;
+    int saved_intr_state;
+    uint64_t now;
+
+    if (thr->edf.period == 0)
+        return;
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    now = get_mtime();
+
+    if (thr->edf.deadline < now)
+        thr->ru.edf_misses++;
+
+    thr->edf.release = twake;
+
+    // An alarm already due does not put us to sleep, so the next job starts
+    // right away. Otherwise make_ready starts it when the alarm wakes us.
+
+    if (twake <= now) {
+        charge_thread(thr, now);
+        edf_release(thr, now);
+        set_budget_timer(thr->cpu, thr);
+        if (thr->cpu->edf_head != NULL &&
+            thr->cpu->edf_head->edf.deadline < thr->edf.deadline)
+            thr->cpu->need_resched = 1;
+    } else
+        thr->edf.release_pending = 1;
+
+    thrmgr_lock_release(saved_intr_state);
 }
 
-void condition_wait(struct condition * cond) {
+void thread_edf_report(void) {
+    const struct thread * thr;
     int saved_intr_state;
+    int tid;
 
-    trace("%s(cond=<%s>) in %s", __func__, cond->name, CURTHR->name);
+    kprintf("  tid  hart  period us  budget us  deadline us   jobs  misses  overruns\n");
 
-    assert(CURTHR->state == THREAD_RUNNING);
+    saved_intr_state = thrmgr_lock_acquire();
 
-    // Insert current thread into condition wait list
-    
-    set_thread_state(CURTHR, THREAD_WAITING);
-    CURTHR->wait_cond = cond;
-    CURTHR->list_next = NULL;
+    for (tid = 0; tid < idtab_size(&thrtab); tid++) {
+        thr = idtab_get(&thrtab, tid);
+        if (thr == NULL || thr->edf.period == 0)
+            continue;
 
-    saved_intr_state = intr_disable();
-    tlinsert(&cond->wait_list, CURTHR);
-    intr_restore(saved_intr_state);
+        kprintf("%5d  %4d  %9lu  %9lu  %11lu  %5lu  %6lu  %8lu\n", tid,
+            thr->edf.cpu->hartid, ticks_to_us(thr->edf.period),
+            ticks_to_us(thr->edf.budget), ticks_to_us(thr->edf.rel_deadline),
+            thr->ru.edf_jobs, thr->ru.edf_misses, thr->edf.overrun_cnt);
+    }
 
-    suspend_self();
+    thrmgr_lock_release(saved_intr_state);
 }
 
-void condition_broadcast(struct condition * cond) {
+void thread_tick(void) {
+    static uint64_t next_boost;
+    struct thread * const thr = CURTHR;
     int saved_intr_state;
-    struct thread * thr;
+    uint64_t now;
 
-    // Fast path: if there are no threads waiting, return.
+    saved_intr_state = thrmgr_lock_acquire();
 
-    if (tlempty(&cond->wait_list))
-        return;
+    now = get_mtime();
 
-    // Mark all waiting threads runnable. This is *not* a constant-time
-    // operation, however, keeping having an enum thread_state member of struct
-    // thread for keeping track of thread state is useful for debugging.
+    // A thread that runs through its whole slice is treated as CPU-bound and
+    // drops a level, and an EDF thread that overruns its budget is throttled.
+    // It keeps running until the interrupt returns, unless it has disabled
+    // preemption.
 
-    saved_intr_state = intr_disable();
+    if (thr != thr->cpu->idle_thread && charge_thread(thr, now))
+        thr->cpu->need_resched = 1;
+
+    // Any hart may do the periodic boost. Only harts with threads waiting to
+    // run take ticks, and those are the ones where starvation can occur.
 
-    for (thr = cond->wait_list.head; thr != NULL; thr = thr->list_next) {
-        assert (thr->state == THREAD_WAITING);
-        assert (thr->wait_cond == cond);
-        set_thread_state(thr, THREAD_READY);
-        thr->wait_cond = NULL;
+    if (next_boost <= now) {
+        next_boost = now + MS_TO_MTIME(PRIO_BOOST_MS);
+        boost_all();
     }
 
-    // Append condition variable wait list to run list
+    // With nothing else to run here, the next tick would only charge the
+    // running thread for time that no other thread wants.
 
-    tlappend(&ready_list, &cond->wait_list);
-    tlclear(&cond->wait_list);
+    if (thr->cpu->nready == 0)
+        stop_tick(thr->cpu);
 
-    intr_restore(saved_intr_state);
+    thrmgr_lock_release(saved_intr_state);
 }
 
-// INTERNAL FUNCTION DEFINITIONS
-//
+void thread_preempt_check(void) {
+    int saved_intr_state;
 
-void init_main_thread(void) {
-    extern char _main_stack_anchor[]; // from thrasm.s
-    extern char _main_stack_lowest[]; // from thrasm.s
+    // Another thread of our process called process_exit; leave with it
 
-    main_thread.stack_base = _main_stack_anchor;
-    main_thread.stack_size = _main_stack_anchor - _main_stack_lowest;
+    if (CURTHR->proc != NULL && CURTHR->proc->exiting)
+        process_thread_exit();
+
+    // need_resched is only set for this hart with the thread manager lock
+    // held, but reading it without the lock is fine: a flag set just after we
+    // look comes with an IPI or is seen at the next interrupt.
+
+    if (!CURTHR->cpu->need_resched)
+        return;
+
+    saved_intr_state = thrmgr_lock_acquire();
+    if (CURTHR->state == THREAD_RUNNING && CURTHR->cpu->need_resched)
+        suspend_self();
+    thrmgr_lock_release(saved_intr_state);
 }
 
-void init_idle_thread(void) {
-    extern char _idle_stack_anchor[]; // from thrasm.s
-    extern char _idle_stack_lowest[]; // from thrasm.s
+void thread_preempt_kernel(void) {
+    int saved_intr_state;
 
-    extern void _thread_setup (
-        struct thread * thr, void * sp, void (*start)(void), ...);
+    // Interrupts were enabled where we were interrupted, so that code held no
+    // spinlock, and in particular not the thread manager lock.
 
-    idle_thread.stack_base = _idle_stack_anchor;
-    idle_thread.stack_size = _idle_stack_anchor - _idle_stack_lowest;
-    _thread_setup(&idle_thread, _idle_stack_anchor,(void (*)(void)) idle_thread_func);
-    tlinsert(&ready_list, &idle_thread); // interrupts still disabled
+    if (!CURTHR->cpu->need_resched)
+        return;
 
+    saved_intr_state = thrmgr_lock_acquire();
+    if (preempt_wanted())
+        preempt_self();
+    thrmgr_lock_release(saved_intr_state);
 }
 
-static void set_running_thread(struct thread * thr) {
-    asm inline ("mv tp, %0" :: "r"(thr) : "tp");
+void thread_preempt_disable(void) {
+    CURTHR->preempt_count++;
 }
 
-const char * thread_state_name(enum thread_state state) {
-    static const char * const names[] = {
-        [THREAD_UNINITIALIZED] = "UNINITIALIZED",
-        [THREAD_STOPPED] = "STOPPED",
-        [THREAD_WAITING] = "WAITING",
-        [THREAD_RUNNING] = "RUNNING",
-        [THREAD_READY] = "READY",
-        [THREAD_EXITED] = "EXITED"
-    };
-
-    if (0 <= (int)state && (int)state < sizeof(names)/sizeof(names[0]))
-        return names[state];
-    else
-        return "UNDEFINED";
-};
-
-void recycle_thread(int tid) {
-    struct thread * const thr = thrtab[tid];
-    int ctid;
+void thread_preempt_enable(void) {
+    int saved_intr_state;
 
-    assert (0 < tid && tid < NTHR && thr != NULL);
-    assert (thr->state == THREAD_EXITED);
+    assert (CURTHR->preempt_count > 0);
 
-    // Make our parent the parent of our children
+    if (--CURTHR->preempt_count != 0 || !CURTHR->cpu->need_resched)
+        return;
 
-    for (ctid = 1; ctid < NTHR; ctid++) {
-        if (thrtab[ctid] != NULL && thrtab[ctid]->parent == thr)
-            thrtab[ctid]->parent = thr->parent;
-    }
+    // thrmgr_lock_release yields if interrupts were enabled
 
-    thrtab[tid] = NULL;
-    kfree(thr);
+    saved_intr_state = thrmgr_lock_acquire();
+    thrmgr_lock_release(saved_intr_state);
 }
 
-void suspend_self(void) {
-    struct thread * susp_thread; // suspending thread
-    struct thread * next_thread; // resuming thread
-    struct thread * prev_thread; // previously thread
+int thread_join_any(void) {
     int saved_intr_state;
+    int tid;
 
     trace("%s() in %s", __func__, CURTHR->name);
 
-    // The idle thread is always runnable, and the idle thread only calls
-    // suspend_self() if the ready_list is not empty.
+    saved_intr_state = thrmgr_lock_acquire();
 
-    assert (!tlempty(&ready_list));
+    // If the current thread has no children, this is a bug. We could also
+    // return -EINVAL if we want to allow the calling thread to recover.
 
-    susp_thread = CURTHR;
+    if (CURTHR->child_head == NULL)
+        panic("thread_wait called by childless thread");
 
-    // Get a READY thread from the ready list and mark it running
+    // Wait for some child to exit. An exiting thread puts itself on its
+    // parent's zombie queue and signals the parent's child_exit condition.
 
-    saved_intr_state = intr_disable();
+    CURTHR->join_target = NULL;
 
-    next_thread = tlremove(&ready_list);
-    assert(next_thread->state == THREAD_READY);
-    set_thread_state(next_thread, THREAD_RUNNING);
-    
-    // If the current thread is still running, mark it ready-to-run and put it
-    // in the back of the ready-to-run list.
+    while (tlempty(&CURTHR->zombies)) {
+        if (condition_wait_intr(&CURTHR->child_exit) < 0) {
+            thrmgr_lock_release(saved_intr_state);
+            return -EINTR;
+        }
+    }
 
-    if (susp_thread->state == THREAD_RUNNING) {
+    tid = CURTHR->zombies.head->id;
+    recycle_thread(tid);
+
+    thrmgr_lock_release(saved_intr_state);
+    return tid;
+}
+
+// Wait for specific child thread to exit. Returns the thread id of the child.
+
+int thread_join(int tid) {
+    return join_child(tid, 0);
+}
+
+int thread_join_user(int tid) {
+    return join_child(tid, 1);
+}
+
+struct process * thread_process(int tid) {
+    struct thread * const thr = idtab_get(&thrtab, tid);
+    assert (thr != NULL);
+    return thr->proc;
+}
+
+void thread_set_process(int tid, struct process * proc) {
+    struct thread * const thr = idtab_get(&thrtab, tid);
+    int saved_intr_state;
+
+    assert (thr != NULL);
+
+    saved_intr_state = thrmgr_lock_acquire();
+    if (thr->proc != NULL)
+        proc_remove_thread(thr->proc, thr);
+    thr->proc = proc;
+    if (proc != NULL)
+        proc_add_thread(proc, thr);
+    thrmgr_lock_release(saved_intr_state);
+}
+
+const char * thread_name(int tid) {
+    const struct thread * const thr = idtab_get(&thrtab, tid);
+    assert (thr != NULL);
+    return thr->name;
+}
+
+int thread_process_busy(const struct process * proc) {
+    const struct thread * thr;
+
+    for (thr = proc->thread_head; thr != NULL; thr = thr->proc_next) {
+        if (thr->state == THREAD_RUNNING && thr->cpu != CURTHR->cpu)
+            return 1;
+        if (thr->kpreempted)
+            return 1;
+    }
+
+    return 0;
+}
+
+void thread_get_rusage(struct thread_rusage * ru) {
+    int saved_intr_state;
+
+    memset(ru, 0, sizeof(struct thread_rusage));
+
+    saved_intr_state = thrmgr_lock_acquire();
+    add_rusage(ru, CURTHR, get_mtime());
+    ru->cycles += csrr_cycle() - CURTHR->cycle_start;
+    thrmgr_lock_release(saved_intr_state);
+}
+
+void thread_process_rusage (
+    const struct process * proc, struct thread_rusage * ru)
+{
+    const uint64_t now = get_mtime();
+    const struct thread * thr;
+
+    *ru = proc->ru_exited;
+
+    for (thr = proc->thread_head; thr != NULL; thr = thr->proc_next)
+        add_rusage(ru, thr, now);
+}
+
+unsigned long thread_ctxsw_count(void) {
+    unsigned long cnt = 0;
+    int i;
+
+    for (i = 0; i < NCPU; i++)
+        cnt += cpus[i].ctxsw_cnt;
+    
+    return cnt;
+}
+
+struct cpu * this_cpu(void) {
+    return CURTHR->cpu;
+}
+
+struct thread_stack_anchor * thread_create_idle(struct cpu * cpu) {
+    struct thread_stack_anchor * stack_anchor;
+    void * stack_page;
+    struct thread * idle;
+    int saved_intr_state;
+    int tid;
+
+    trace("%s(hart=%d)", __func__, cpu->hartid);
+
+    idle = alloc_thread();
+    stack_page = alloc_stack();
+    if (idle == NULL || stack_page == NULL)
+        panic("Out of memory for idle thread");
+
+    stack_anchor = (struct thread_stack_anchor *)(stack_page + PAGE_SIZE) - 1;
+    stack_anchor->thread = idle;
+    stack_anchor->reserved = 0;
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    tid = idtab_alloc(&thrtab, idle);
+    if (tid < 0)
+        panic("no thread id for idle thread");
+
+    idle->id = tid;
+    idle->name = "idle";
+    idle->parent = &main_thread;
+    idle->cpu = cpu;
+    idle->prio = THREAD_PRIO_LOW;
+    idle->base_prio = THREAD_PRIO_LOW;
+    idle->stack_base = stack_anchor;
+    idle->stack_size = idle->stack_base - stack_page;
+    set_thread_state(idle, THREAD_RUNNING);
+    cpu->idle_thread = idle;
+    cpu->running = idle;
+
+    thrmgr_lock_release(saved_intr_state);
+
+    return stack_anchor;
+}
+
+void thread_idle_loop(void) {
+    struct cpu * const cpu = CURTHR->cpu; // idle threads never migrate
+    int saved_intr_state;
+
+    for (;;) {
+        // If there are runnable threads here or on another hart, yield to
+        // them. suspend_self takes work from other harts for the idle thread.
+
+        saved_intr_state = thrmgr_lock_acquire();
+        while (work_available())
+            suspend_self();
+        stop_tick(cpu);
+        thrmgr_lock_release(saved_intr_state);
+        
+        // Use the idle time to defragment physical memory. This returns quickly
+        // unless pages were freed since the last attempt.
+
+        memory_compact_idle();
+
+        // No runnable threads. Sleep using the wfi instruction. We set the
+        // idling flag before checking the ready lists one more time, so that a
+        // hart that makes a thread ready after our check sees the flag and
+        // sends us an IPI. A pending interrupt makes wfi return even with
+        // interrupts disabled, which closes the race with ISRs on this hart.
+
+        intr_disable();
+        cpu->idling = 1;
+        __sync_synchronize();
+        if (!work_available())
+            asm ("wfi");
+        cpu->idling = 0;
+        intr_enable();
+    }
+}
+
+void condition_init(struct condition * cond, const char * name) {
+    cond->name = name;
+    tlclear(&cond->wait_list);
+    cond->task_head = NULL;
+    cond->task_tail = NULL;
+}
+
+void condition_wait(struct condition * cond) {
+    int saved_intr_state;
+
+    trace("%s(cond=<%s>) in %s", __func__, cond->name, CURTHR->name);
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    assert(CURTHR->state == THREAD_RUNNING);
+
+    // Insert current thread into condition wait list
+    
+    set_thread_state(CURTHR, THREAD_WAITING);
+    CURTHR->wait_cond = cond;
+    CURTHR->list_next = NULL;
+    tlinsert(&cond->wait_list, CURTHR);
+
+    suspend_self();
+
+    thrmgr_lock_release(saved_intr_state);
+}
+
+int condition_wait_intr(struct condition * cond) {
+    struct thread * const thr = CURTHR;
+    int saved_intr_state;
+    int result;
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    // process_exit sets exiting before it interrupts waiters, so checking
+    // here with the lock held closes the race with a wait about to start.
+
+    if (thr->proc != NULL && thr->proc->exiting) {
+        thrmgr_lock_release(saved_intr_state);
+        return -EINTR;
+    }
+
+    thr->intr_wait = 1;
+    thr->interrupted = 0;
+    condition_wait(cond);
+    thr->intr_wait = 0;
+    result = thr->interrupted ? -EINTR : 0;
+
+    thrmgr_lock_release(saved_intr_state);
+    return result;
+}
+
+void thread_interrupt_process(struct process * proc) {
+    struct thread * thr;
+    int saved_intr_state;
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    for (thr = proc->thread_head; thr != NULL; thr = thr->proc_next) {
+        if (thr != CURTHR && thr->state == THREAD_WAITING && thr->intr_wait) {
+            tlremove_thread(&thr->wait_cond->wait_list, thr);
+            thr->interrupted = 1;
+            wake_waiter(thr->wait_cond, thr);
+        }
+    }
+
+    thrmgr_lock_release(saved_intr_state);
+}
+
+void condition_broadcast(struct condition * cond) {
+    int saved_intr_state;
+    struct thread * thr;
+
+    // There is no fast path that checks for an empty wait list without the
+    // lock: a thread on another hart may have checked its condition and be
+    // about to insert itself.
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    // Move waiting threads to the ready lists in the order they were added.
+
+    while ((thr = tlremove(&cond->wait_list)) != NULL)
+        wake_waiter(cond, thr);
+
+    if (cond->task_head != NULL)
+        ktask_wake_all(cond);
+
+    thrmgr_lock_release(saved_intr_state);
+}
+
+int condition_signal(struct condition * cond) {
+    int saved_intr_state;
+    struct thread * thr;
+    int tid = -1;
+
+    // No fast path, for the same reason as in condition_broadcast.
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    thr = tlremove(&cond->wait_list);
+
+    if (thr != NULL) {
+        wake_waiter(cond, thr);
+        tid = thr->id;
+    } else if (cond->task_head != NULL)
+        ktask_wake_one(cond);
+
+    thrmgr_lock_release(saved_intr_state);
+
+    return tid;
+}
+
+// This function allocates new memory for the child process and sets up another thread struct. It also initializes
+// a stack anchor to reclaim the thread pointer when coming back from a U mode interrupt. The child starts with a
+// copy of the parent's trap frame and is made ready to run on the current hart; the parent keeps running.
+extern int thread_fork_to_user(
+struct process * child_proc, const struct trap_frame * parent_tfr){
+    // Inputs: child_proc - child process, parent_tfr - parent trap frame
+    // Outputs: process ID of the child process
+    // Purpose: Fork the current thread to the child process. This involves creating a new thread struct, copying the
+    // parent trap frame to the child's kernel stack and making the child ready to run.
+    struct trap_frame child_tfr;
+    int tid;
+
+    memcpy(&child_tfr, parent_tfr, sizeof(struct trap_frame)); // the child resumes where the parent called fork
+    child_tfr.x[TFR_A0] = 0; // child's return value
+
+    tid = spawn_user_thread(child_proc, &child_tfr, "Franklin F. Fork", 1); // the child keeps our FP registers
+    if (tid < 0)
+        return tid;
+
+    return child_proc->id;
+}
+
+int thread_create_user(const struct trap_frame * tfr) {
+    // Inputs: tfr - user registers of the new thread
+    // Outputs: thread ID of the new thread, or -EAGAIN if out of threads or memory or the process is exiting
+    // Purpose: Start another thread in the current process. It shares the process's memory space and open files,
+    // and enters U mode with the registers in tfr, which should give it its own stack.
+
+    return spawn_user_thread(CURTHR->proc, tfr, "uthread", 0); // new threads start with zeroed FP registers
+}
+
+int thread_leave_process(void) {
+    struct process * const proc = CURTHR->proc;
+    int saved_intr_state;
+    int cnt;
+
+    assert (proc != NULL);
+
+    saved_intr_state = thrmgr_lock_acquire();
+    proc_remove_thread(proc, CURTHR);
+    cnt = proc->thread_cnt;
+    thrmgr_lock_release(saved_intr_state);
+
+    return cnt;
+}
+
+int thread_fp_trap(void) {
+    struct thread * const thr = CURTHR;
+    struct cpu * cpu;
+    int saved_intr_state;
+
+    if ((csrr_sstatus() & RISCV_SSTATUS_FS) != RISCV_SSTATUS_FS_OFF)
+        return 0;
+
+    // Without memory for the FP registers, the thread cannot go on. We take
+    // its process down rather than the kernel.
+
+    if (thr->fp == NULL) {
+        thr->fp = alloc_fpstate();
+        if (thr->fp == NULL)
+            process_exit();
+    }
+
+    // With interrupts disabled, we cannot be switched away from between
+    // loading the registers and recording that this hart holds them.
+
+    saved_intr_state = intr_disable();
+    cpu = thr->cpu;
+
+    // If we were the last thread to use FP on this hart and have not used it
+    // on another hart since, the registers still hold our values.
+
+    if (cpu->fp_owner != thr || thr->fp_cpu != cpu) {
+        csrs_sstatus(RISCV_SSTATUS_FS_INITIAL);
+        _thread_fp_restore(thr->fp);
+        csrc_sstatus(RISCV_SSTATUS_FS);
+        cpu->fp_owner = thr;
+        thr->fp_cpu = cpu;
+        cpu->fp_load_cnt++;
+    }
+
+    csrs_sstatus(RISCV_SSTATUS_FS_CLEAN);
+    intr_restore(saved_intr_state);
+    return 1;
+}
+
+void thread_startup(struct thread * prev) {
+    finish_switch(prev);
+    thrmgr_lock_release(RISCV_SSTATUS_SIE); // new threads run with interrupts enabled
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void init_main_thread(void) {
+    extern char _main_stack_anchor[]; // from thrasm.s
+    extern char _main_stack_lowest[]; // from thrasm.s
+
+    main_thread.stack_base = _main_stack_anchor;
+    main_thread.stack_size = _main_stack_anchor - _main_stack_lowest;
+    main_thread.slice_left = prio_quantum[main_thread.prio];
+}
+
+void init_idle_thread(void) {
+    extern char _idle_stack_anchor[]; // from thrasm.s
+    extern char _idle_stack_lowest[]; // from thrasm.s
+
+    extern void _thread_setup (
+        struct thread * thr, void * sp, void (*start)(void), ...);
+
+    idle_thread.stack_base = _idle_stack_anchor;
+    idle_thread.stack_size = _idle_stack_anchor - _idle_stack_lowest;
+    _thread_setup(&idle_thread, _idle_stack_anchor,(void (*)(void)) idle_thread_func);
+    cpus[0].idle_thread = &idle_thread; // never on a ready list
+}
+
+static void set_running_thread(struct thread * thr) {
+    asm inline ("mv tp, %0" :: "r"(thr) : "tp");
+}
+
+const char * thread_state_name(enum thread_state state) {
+    static const char * const names[] = {
+        [THREAD_UNINITIALIZED] = "UNINITIALIZED",
+        [THREAD_STOPPED] = "STOPPED",
+        [THREAD_WAITING] = "WAITING",
+        [THREAD_RUNNING] = "RUNNING",
+        [THREAD_READY] = "READY",
+        [THREAD_EXITED] = "EXITED"
+    };
+
+    if (0 <= (int)state && (int)state < sizeof(names)/sizeof(names[0]))
+        return names[state];
+    else
+        return "UNDEFINED";
+};
+
+void recycle_thread(int tid) {
+    struct thread * const thr = idtab_get(&thrtab, tid);
+    struct thread * parent;
+    int saved_intr_state;
+
+    assert (0 < tid && thr != NULL);
+    assert (thr->state == THREAD_EXITED);
+    parent = thr->parent;
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    // Take the thread off its parent's lists. Threads reaped by
+    // thread_join_any are at the head of the zombie queue.
+
+    tlremove_thread(zombie_list(parent, thr), thr);
+    remove_child(thr);
+    reparent_children(thr, parent);
+
+    idtab_free(&thrtab, tid);
+    free_thread(thr);
+
+    thrmgr_lock_release(saved_intr_state);
+}
+
+void suspend_self(void) {
+    struct thread * susp_thread; // suspending thread
+    struct thread * next_thread; // resuming thread
+    struct thread * prev_thread; // previously running thread
+    struct cpu * cpu;
+    uint64_t now;
+
+    trace("%s() in %s", __func__, CURTHR->name);
+
+    assert (thrmgr_lock_hart == CURTHR->cpu->hartid);
+
+    susp_thread = CURTHR;
+    cpu = susp_thread->cpu;
+    cpu->need_resched = 0;
+
+    // Charge the suspending thread for its time on the hart first, since
+    // that may lower its priority.
+
+    now = get_mtime();
+
+    if (susp_thread != cpu->idle_thread)
+        charge_thread(susp_thread, now);
+
+    // Get the highest-priority READY thread from our ready lists, with EDF
+    // threads ahead of all priority levels. A running thread that yields
+    // keeps the hart unless a thread of the same or higher priority is waiting
+    // here; an active EDF thread keeps it unless an EDF thread with an earlier
+    // deadline is. If the current thread cannot go on running and our lists
+    // are empty, look for work on the other harts before falling back to the
+    // idle thread.
+
+    if (susp_thread->state == THREAD_RUNNING &&
+        susp_thread != cpu->idle_thread)
+    {
+        if (edf_active(susp_thread))
+            next_thread = edf_remove(cpu, susp_thread->edf.deadline);
+        else {
+            next_thread = edf_remove(cpu, UINT64_MAX);
+            if (next_thread == NULL)
+                next_thread = rq_remove(cpu, susp_thread->prio);
+        }
+    } else {
+        next_thread = edf_remove(cpu, UINT64_MAX);
+        if (next_thread == NULL)
+            next_thread = rq_remove(cpu, THREAD_PRIO_LOW);
+        if (next_thread == NULL)
+            next_thread = steal_thread(cpu);
+    }
+
+    if (next_thread == NULL) {
+        if (susp_thread->state == THREAD_RUNNING) {
+            set_budget_timer(cpu, susp_thread);
+            return;
+        }
+        next_thread = cpu->idle_thread;
+    }
+
+    // If the current thread is still running, mark it ready-to-run and put it
+    // in the back of the ready-to-run list for its priority. No other hart can
+    // pick it up until we release the lock after _thread_swtch has saved its
+    // context.
+
+    if (susp_thread->state == THREAD_RUNNING) {
         set_thread_state(susp_thread, THREAD_READY);
-        tlinsert(&ready_list, susp_thread);
+        if (susp_thread != cpu->idle_thread)
+            rq_insert(cpu, susp_thread);
+    }
+
+    assert(next_thread->state == THREAD_READY);
+    set_thread_state(next_thread, THREAD_RUNNING);
+    next_thread->cpu = cpu;
+    next_thread->run_start = now;
+    set_budget_timer(cpu, next_thread);
+    cpu->running = next_thread;
+    cpu->ctxsw_cnt++;
+    account_switch(susp_thread, next_thread, now);
+
+    if (next_thread->proc != NULL)
+        memory_space_switch(next_thread->proc->mtag);
+
+    fp_switch_out(susp_thread, cpu);
+
+    trace("Thread <%s> calling _thread_swtch(<%s>)",
+        CURTHR->name, next_thread->name);
+    
+    prev_thread = _thread_swtch(next_thread);
+
+    trace("_thread_swtch() returned in %s", CURTHR->name);
+
+    finish_switch(prev_thread);
+}
+
+static void finish_switch(struct thread * prev) {
+    if (prev->state == THREAD_EXITED && prev->stack_base != NULL) {
+        free_stack(prev->stack_base - prev->stack_size);
+        prev->stack_base = NULL;
+        prev->stack_size = 0;
+    }
+
+    // Nobody will join a detached user thread. Its process children go to
+    // the main thread, which runs init.
+
+    if (prev->state == THREAD_EXITED && prev->parent == NULL &&
+        prev != &main_thread)
+    {
+        reparent_children(prev, &main_thread);
+        idtab_free(&thrtab, prev->id);
+        free_thread(prev);
+    }
+}
+
+static void fp_switch_out(struct thread * thr, struct cpu * cpu) {
+    // An exited thread's descriptor may be reused by the time a thread runs
+    // on this hart again; make sure its registers are not mistaken as live.
+
+    if (thr->state == THREAD_EXITED) {
+        if (cpu->fp_owner == thr)
+            cpu->fp_owner = NULL;
+    } else if ((csrr_sstatus() & RISCV_SSTATUS_FS) ==
+        RISCV_SSTATUS_FS_DIRTY)
+    {
+        _thread_fp_save(thr->fp);
+        cpu->fp_save_cnt++;
+    }
+
+    csrc_sstatus(RISCV_SSTATUS_FS);
+}
+
+static void make_ready(struct thread * thr) {
+    struct cpu * const self = CURTHR->cpu;
+    struct cpu * cpu = thr->cpu;
+    const uint64_t now = get_mtime();
+    int i;
+
+    if (thr->state == THREAD_WAITING)
+        thr->ru.wait_time += ticks_since(thr->state_since, now);
+    thr->state_since = now;
+
+    // An EDF thread woken by its alarm starts its next job
+
+    if (thr->edf.release_pending) {
+        thr->edf.release_pending = 0;
+        edf_release(thr, now);
+    }
+
+    set_thread_state(thr, THREAD_READY);
+    rq_insert(cpu, thr);
+
+    // An active EDF thread can only run on its own hart. Preempt the thread
+    // running there unless it has an earlier deadline.
+
+    if (edf_active(thr)) {
+        cpu = thr->edf.cpu;
+        __sync_synchronize();
+
+        if (cpu->idling || !edf_active(cpu->running) ||
+            thr->edf.deadline < cpu->running->edf.deadline)
+        {
+            if (!cpu->idling)
+                cpu->need_resched = 1;
+            if (cpu != self)
+                smp_send_ipi(cpu->hartid);
+        }
+        return;
+    }
+
+    // Order the list update before reading the idling flags; see
+    // thread_idle_loop. Prefer the hart the thread last ran on, and otherwise
+    // wake any idle hart so that it takes the thread from a busy one.
+
+    __sync_synchronize();
+
+    if (cpu->idling) {
+        if (cpu != self)
+            smp_send_ipi(cpu->hartid);
+        return;
+    }
+
+    for (i = 0; i < NCPU; i++) {
+        if (&cpus[i] != self && cpus[i].idling) {
+            smp_send_ipi(cpus[i].hartid);
+            return;
+        }
+    }
+
+    // No hart is idle. If the thread outranks the one running on its hart,
+    // have that hart reschedule at its next preemption point.
+
+    if (thr->prio < cpu->running->prio && !edf_active(cpu->running)) {
+        cpu->need_resched = 1;
+        if (cpu != self)
+            smp_send_ipi(cpu->hartid);
+    }
+}
+
+static struct thread * steal_thread(struct cpu * cpu) {
+    struct cpu * victim = NULL;
+    struct thread * thr;
+    int i;
+
+    for (i = 0; i < NCPU; i++) {
+        if (&cpus[i] != cpu && cpus[i].nready != cpus[i].edf_nready &&
+            (victim == NULL || victim->nready - victim->edf_nready <
+                cpus[i].nready - cpus[i].edf_nready))
+            victim = &cpus[i];
+    }
+
+    if (victim == NULL)
+        return NULL;
+
+    thr = rq_remove(victim, THREAD_PRIO_LOW);
+    cpu->steal_cnt++;
+
+    debug("Hart %d took thread <%s> from hart %d",
+        cpu->hartid, thr->name, victim->hartid);
+
+    return thr;
+}
+
+static void wake_waiter(struct condition * cond, struct thread * thr) {
+    assert (thr->state == THREAD_WAITING);
+    assert (thr->wait_cond == cond);
+    thr->wait_cond = NULL;
+
+    // A thread that waited gave up the hart before its slice ran out, so it
+    // is raised one level (but not above its base priority) and given a
+    // fresh slice.
+
+    if (thr->prio > thr->base_prio)
+        thr->prio--;
+    thr->slice_left = prio_quantum[thr->prio];
+
+    make_ready(thr);
+}
+
+static void rq_insert(struct cpu * cpu, struct thread * thr) {
+    struct thread ** link;
+
+    if (edf_active(thr)) {
+        cpu = thr->edf.cpu;
+        link = &cpu->edf_head;
+        while (*link != NULL && (*link)->edf.deadline <= thr->edf.deadline)
+            link = &(*link)->list_next;
+        thr->list_next = *link;
+        *link = thr;
+        cpu->edf_nready++;
+    } else {
+        assert (THREAD_PRIO_HIGH <= thr->prio && thr->prio <= THREAD_PRIO_LOW);
+        tlinsert(&cpu->ready_list[thr->prio], thr);
+    }
+
+    cpu->nready++;
+
+    if (cpu->tick_stopped)
+        start_tick(cpu);
+}
+
+static struct thread * rq_remove(struct cpu * cpu, int prio) {
+    struct thread * thr;
+    int level;
+
+    if (cpu->nready == 0)
+        return NULL;
+
+    for (level = THREAD_PRIO_HIGH; level <= prio; level++) {
+        thr = tlremove(&cpu->ready_list[level]);
+        if (thr != NULL) {
+            cpu->nready--;
+            return thr;
+        }
+    }
+
+    return NULL;
+}
+
+static struct thread * edf_remove(struct cpu * cpu, uint64_t before) {
+    struct thread * thr = cpu->edf_head;
+
+    if (thr == NULL || before <= thr->edf.deadline)
+        return NULL;
+
+    cpu->edf_head = thr->list_next;
+    thr->list_next = NULL;
+    cpu->edf_nready--;
+    cpu->nready--;
+    return thr;
+}
+
+static inline int edf_active(const struct thread * thr) {
+    return thr->edf.period != 0 && !thr->edf.throttled;
+}
+
+static void edf_release(struct thread * thr, uint64_t now) {
+    if (thr->edf.release < now)
+        thr->edf.release = now;
+
+    thr->edf.deadline = thr->edf.release + thr->edf.rel_deadline;
+    thr->edf.budget_left = thr->edf.budget;
+    thr->edf.throttled = 0;
+    thr->ru.edf_jobs++;
+}
+
+static void boost_all(void) {
+    struct thread_list ready;
+    struct thread * thr;
+    int level;
+    int tid;
+    int i;
+
+    for (tid = 0; tid < idtab_size(&thrtab); tid++) {
+        thr = idtab_get(&thrtab, tid);
+        if (thr != NULL) {
+            thr->prio = thr->base_prio;
+            thr->slice_left = prio_quantum[thr->prio];
+        }
     }
 
-    intr_enable();
+    // Gather each hart's ready threads in priority order, then put them back
+    // on the lists for their new priority. Threads of the same level keep
+    // their relative order.
 
-    if (next_thread->proc != NULL)
-        memory_space_switch(next_thread->proc->mtag);
+    for (i = 0; i < NCPU; i++) {
+        if (cpus[i].nready == 0)
+            continue;
 
-    trace("Thread <%s> calling _thread_swtch(<%s>)",
-        CURTHR->name, next_thread->name);
+        tlclear(&ready);
+        for (level = THREAD_PRIO_HIGH; level <= THREAD_PRIO_LOW; level++)
+            tlappend(&ready, &cpus[i].ready_list[level]);
+
+        while ((thr = tlremove(&ready)) != NULL)
+            tlinsert(&cpus[i].ready_list[thr->prio], thr);
+    }
+}
+
+static int charge_slice(struct thread * thr, uint64_t now) {
+    uint64_t used;
+
+    used = ticks_since(thr->run_start, now);
+    thr->run_start = now;
+
+    if (used < thr->slice_left) {
+        thr->slice_left -= used;
+        return 0;
+    }
+
+    if (thr->prio < THREAD_PRIO_LOW) {
+        thr->prio++;
+        debug("Thread <%s> demoted to priority %d", thr->name, thr->prio);
+    }
+
+    thr->slice_left = prio_quantum[thr->prio];
+    return 1;
+}
+
+static int charge_thread(struct thread * thr, uint64_t now) {
+    uint64_t used;
+
+    if (!edf_active(thr))
+        return charge_slice(thr, now);
+
+    used = ticks_since(thr->run_start, now);
+    thr->run_start = now;
+
+    if (used < thr->edf.budget_left) {
+        thr->edf.budget_left -= used;
+        return 0;
+    }
+
+    // Out of budget. The job goes on at the thread's normal priority, with
+    // whatever is left of its slice, until the next release.
+
+    debug("Thread <%s> overran its budget", thr->name);
+    thr->edf.budget_left = 0;
+    thr->edf.throttled = 1;
+    thr->edf.overrun_cnt++;
+    return 1;
+}
+
+static void account_switch (
+    struct thread * prev, struct thread * next, uint64_t now)
+{
+    const uint64_t cycles = csrr_cycle();
+
+    prev->ru.run_time += ticks_since(prev->state_since, now);
+    prev->ru.cycles += cycles - prev->cycle_start;
+    prev->state_since = now;
+
+    if (prev->state == THREAD_READY)
+        prev->ru.nivcsw++;
+    else if (prev->state == THREAD_WAITING)
+        prev->ru.nvcsw++;
+
+    next->ru.ready_time += ticks_since(next->state_since, now);
+    next->state_since = now;
+    next->cycle_start = cycles;
+}
+
+static void add_rusage (
+    struct thread_rusage * sum, const struct thread * thr, uint64_t now)
+{
+    const uint64_t cur = ticks_since(thr->state_since, now);
+
+    sum->run_time += thr->ru.run_time;
+    sum->ready_time += thr->ru.ready_time;
+    sum->wait_time += thr->ru.wait_time;
+    sum->cycles += thr->ru.cycles;
+    sum->nvcsw += thr->ru.nvcsw;
+    sum->nivcsw += thr->ru.nivcsw;
+    sum->edf_jobs += thr->ru.edf_jobs;
+    sum->edf_misses += thr->ru.edf_misses;
+
+    switch (thr->state) {
+    case THREAD_RUNNING:
+        sum->run_time += cur;
+        break;
+    case THREAD_READY:
+        sum->ready_time += cur;
+        break;
+    case THREAD_WAITING:
+        sum->wait_time += cur;
+        break;
+    default:
+        break;
+    }
+}
+
+// mtime is reset in timer_init, after the main thread started running, so
+// times taken before then may lie in the future.
+
+static inline uint64_t ticks_since(uint64_t then, uint64_t now) {
+    return (then < now) ? now - then : 0;
+}
+
+static int preempt_wanted(void) {
+    struct thread * const thr = CURTHR;
+
+    return thrmgr_initialized && thr->cpu->need_resched &&
+        thr->preempt_count == 0 && thr->state == THREAD_RUNNING &&
+        thr != thr->cpu->idle_thread;
+}
+
+static void preempt_self(void) {
+    CURTHR->cpu->kpreempt_cnt++;
+    CURTHR->kpreempted = 1;
+    suspend_self();
+    CURTHR->kpreempted = 0;
+}
+
+static void stop_tick(struct cpu * cpu) {
+    if (!cpu->tick_stopped) {
+        cpu->tick_stopped = 1;
+        timer_set_tick(cpu->hartid, 0);
+    }
+}
+
+static void start_tick(struct cpu * cpu) {
+    if (cpu->tick_stopped) {
+        cpu->tick_stopped = 0;
+        timer_set_tick(cpu->hartid, 1);
+    }
+}
+
+static void set_budget_timer(struct cpu * cpu, struct thread * thr) {
+    if (edf_active(thr)) {
+        cpu->budget_armed = 1;
+        timer_set_budget(cpu->hartid,
+            thr->run_start + thr->edf.budget_left);
+    } else if (cpu->budget_armed) {
+        cpu->budget_armed = 0;
+        timer_set_budget(cpu->hartid, UINT64_MAX);
+    }
+}
+
+static int work_available(void) {
+    struct cpu * const self = CURTHR->cpu;
+    int i;
+
+    if (self->nready != 0)
+        return 1;
+
+    for (i = 0; i < NCPU; i++) {
+        if (cpus[i].nready != cpus[i].edf_nready)
+            return 1;
+    }
+
+    return 0;
+}
+
+static struct thread * alloc_thread(void) {
+    struct thread * thr;
+    struct thread * page;
+    int saved_intr_state;
+    int i;
+
+    saved_intr_state = thrmgr_lock_acquire();
+    thr = thread_free_list;
+    if (thr != NULL) {
+        thread_free_list = thr->list_next;
+        thr->list_next = NULL;
+    }
+    thrmgr_lock_release(saved_intr_state);
+
+    if (thr != NULL)
+        return thr;
+
+    // Carve a new page into descriptors. We keep the first and put the rest
+    // on the free list.
+
+    page = memory_reserve_page();
+    if (page == NULL)
+        return NULL;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(struct thread); i++)
+        reset_thread(&page[i]);
+
+    saved_intr_state = thrmgr_lock_acquire();
+    for (i = 1; i < PAGE_SIZE / sizeof(struct thread); i++) {
+        page[i].list_next = thread_free_list;
+        thread_free_list = &page[i];
+    }
+    thrmgr_lock_release(saved_intr_state);
+
+    return &page[0];
+}
+
+static void * alloc_stack(void) {
+    void * stack_page = NULL;
+    int saved_intr_state;
+
+    saved_intr_state = thrmgr_lock_acquire();
+    if (stack_cache_cnt > 0)
+        stack_page = stack_cache[--stack_cache_cnt];
+    thrmgr_lock_release(saved_intr_state);
+
+    if (stack_page == NULL)
+        stack_page = memory_reserve_page();
+
+    return stack_page;
+}
+
+static void free_thread(struct thread * thr) {
+    int saved_intr_state;
+
+    // Reset the descriptor now rather than when it is next used, to keep
+    // thread creation short.
+
+    if (thr->fp != NULL)
+        free_fpstate(thr->fp);
+    reset_thread(thr);
+
+    saved_intr_state = thrmgr_lock_acquire();
+    thr->list_next = thread_free_list;
+    thread_free_list = thr;
+    thrmgr_lock_release(saved_intr_state);
+}
+
+static void free_stack(void * stack_page) {
+    int saved_intr_state;
+
+    saved_intr_state = thrmgr_lock_acquire();
+    if (stack_cache_cnt < THREAD_CACHE_CNT) {
+        stack_cache[stack_cache_cnt++] = stack_page;
+        stack_page = NULL;
+    }
+    thrmgr_lock_release(saved_intr_state);
+
+    if (stack_page != NULL)
+        memory_free_page(stack_page);
+}
+
+static struct thread_fpstate * alloc_fpstate(void) {
+    struct thread_fpstate * fp;
+    struct thread_fpstate * page;
+    int saved_intr_state;
+    int i;
+
+    saved_intr_state = thrmgr_lock_acquire();
+    fp = fpstate_free_list;
+    if (fp != NULL)
+        fpstate_free_list = fp->free_next;
+    thrmgr_lock_release(saved_intr_state);
+
+    if (fp == NULL) {
+        // As in alloc_thread, keep the first and free the rest
+
+        page = memory_reserve_page();
+        if (page == NULL)
+            return NULL;
+
+        saved_intr_state = thrmgr_lock_acquire();
+        for (i = 1; i < PAGE_SIZE / sizeof(struct thread_fpstate); i++) {
+            page[i].free_next = fpstate_free_list;
+            fpstate_free_list = &page[i];
+        }
+        thrmgr_lock_release(saved_intr_state);
+        fp = &page[0];
+    }
+
+    memset(fp, 0, sizeof(struct thread_fpstate));
+    return fp;
+}
+
+static void free_fpstate(struct thread_fpstate * fp) {
+    int saved_intr_state;
+
+    saved_intr_state = thrmgr_lock_acquire();
+    fp->free_next = fpstate_free_list;
+    fpstate_free_list = fp;
+    thrmgr_lock_release(saved_intr_state);
+}
+
+static void reset_thread(struct thread * thr) {
+    memset(thr, 0, sizeof(struct thread));
+    condition_init(&thr->child_exit, "child_exit");
+}
+
+static int spawn_user_thread (
+    struct process * proc, const struct trap_frame * tfr,
+    const char * name, int copy_fp)
+{
+    struct thread_stack_anchor * stack_anchor;
+    struct trap_frame * child_tfr;
+    void * stack_page;
+    struct thread * child;
+    int saved_intr_state;
+    int tid;
+
+    // Allocate a struct thread and a stack
+
+    child = alloc_thread(); //  get a thread descriptor for the child thread
+    if (child == NULL)
+        return -EAGAIN;
+ 
+    stack_page = alloc_stack(); // get a kernel stack page, not necessarily zeroed
+    if (stack_page == NULL) {
+        free_thread(child);
+        return -EAGAIN;
+    }
+    stack_anchor = (struct thread_stack_anchor *)(stack_page + PAGE_SIZE) - 1; // the anchor is at the top of the stack page
+    stack_anchor->thread = child; // set the thread to the child thread
+    stack_anchor->reserved = 0; // set the reserved value to 0
+
+    // The child returns to user mode through the trap frame placed just
+    // below the anchor.
+
+    child_tfr = (struct trap_frame *)stack_anchor - 1;
+    memcpy(child_tfr, tfr, sizeof(struct trap_frame));
+
+    // A forked child gets a copy of our FP registers. Ours may be live and
+    // dirty, since we have been running since the system call was made.
+
+    if (copy_fp && CURTHR->fp != NULL) {
+        if ((csrr_sstatus() & RISCV_SSTATUS_FS) == RISCV_SSTATUS_FS_DIRTY) {
+            _thread_fp_save(CURTHR->fp);
+            csrc_sstatus(RISCV_SSTATUS_FS);
+            csrs_sstatus(RISCV_SSTATUS_FS_CLEAN);
+        }
+        child->fp = alloc_fpstate();
+        if (child->fp == NULL) {
+            free_stack(stack_page);
+            free_thread(child);
+            return -EAGAIN;
+        }
+        memcpy(child->fp, CURTHR->fp, sizeof(struct thread_fpstate));
+    }
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    // Threads are not added to a process that is on its way out
+
+    if (proc->exiting)
+        tid = -EAGAIN;
+    else
+        tid = idtab_alloc(&thrtab, child); // find a free thread slot
+
+    if (tid < 0) { // thread table is full
+        thrmgr_lock_release(saved_intr_state);
+        free_stack(stack_page);
+        free_thread(child);
+        return tid;
+    }
+
+    child->id = tid; // set the thread ID to the thread ID
+    child->name = name;
+    child->parent = CURTHR; // set the parent of the thread to the current thread
+    child->uthread = (proc == CURTHR->proc); // a new thread in our process, not a forked child
+    add_child(CURTHR, child); // and put it on the current thread's child list
+    child->proc = proc;
+    proc_add_thread(proc, child);
+    child->cpu = CURTHR->cpu; // start on this hart; an idle hart may take it
+    child->base_prio = CURTHR->base_prio; // inherit the parent's base priority
+    child->prio = child->base_prio;
+    child->slice_left = prio_quantum[child->prio];
+    child->stack_base = stack_anchor; // set the stack base to the stack anchor
+    child->stack_size = child->stack_base - stack_page; // set the stack size to the stack base minus the stack page
+
+    _thread_setup(child, child_tfr, _thread_fork_entry); // child starts in _thread_fork_entry (thrasm.s)
+    make_ready(child);
+
+    thrmgr_lock_release(saved_intr_state);
+
+    return tid;
+}
+
+static void proc_add_thread(struct process * proc, struct thread * thr) {
+    // The first thread of a process is the one its parent waits for
+
+    if (proc->thread_cnt++ == 0)
+        proc->tid = thr->id;
+
+    thr->proc_prev = NULL;
+    thr->proc_next = proc->thread_head;
+    if (proc->thread_head != NULL)
+        proc->thread_head->proc_prev = thr;
+    proc->thread_head = thr;
+}
+
+static void proc_remove_thread(struct process * proc, struct thread * thr) {
+    // The process keeps the usage of its departed threads. A thread leaving
+    // to exit is still running; the rest of its last run goes uncounted.
+
+    add_rusage(&proc->ru_exited, thr, get_mtime());
+
+    if (thr->proc_prev != NULL)
+        thr->proc_prev->proc_next = thr->proc_next;
+    else
+        proc->thread_head = thr->proc_next;
+    if (thr->proc_next != NULL)
+        thr->proc_next->proc_prev = thr->proc_prev;
+
+    thr->proc_next = NULL;
+    thr->proc_prev = NULL;
+    proc->thread_cnt--;
+}
+
+void add_child(struct thread * parent, struct thread * child) {
+    struct thread ** const head = child_list(parent, child);
+
+    child->sibling_prev = NULL;
+    child->sibling_next = *head;
+    if (*head != NULL)
+        (*head)->sibling_prev = child;
+    *head = child;
+}
+
+void remove_child(struct thread * child) {
+    if (child->sibling_prev != NULL)
+        child->sibling_prev->sibling_next = child->sibling_next;
+    else
+        *child_list(child->parent, child) = child->sibling_next;
+
+    if (child->sibling_next != NULL)
+        child->sibling_next->sibling_prev = child->sibling_prev;
+
+    child->sibling_next = NULL;
+    child->sibling_prev = NULL;
+}
+
+void reparent_children(struct thread * thr, struct thread * parent) {
+    struct thread * child;
+
+    // Make /parent/ the parent of our other children. Children that have
+    // already exited join its zombie queue; wake it if it is waiting for any
+    // child.
+
+    while ((child = thr->child_head) != NULL) {
+        remove_child(child);
+        child->parent = parent;
+        add_child(parent, child);
+    }
+
+    if (!tlempty(&thr->zombies)) {
+        tlappend(&parent->zombies, &thr->zombies);
+        if (parent->join_target == NULL)
+            condition_broadcast(&parent->child_exit);
+    }
+
+    // Only we could have joined our user threads
+
+    while (!tlempty(&thr->uthread_zombies))
+        recycle_thread(thr->uthread_zombies.head->id);
+
+    while ((child = thr->uthread_head) != NULL) {
+        remove_child(child);
+        child->parent = NULL;
+    }
+}
+
+struct thread ** child_list (
+    struct thread * parent, const struct thread * child)
+{
+    return child->uthread ? &parent->uthread_head : &parent->child_head;
+}
+
+struct thread_list * zombie_list (
+    struct thread * parent, const struct thread * child)
+{
+    return child->uthread ? &parent->uthread_zombies : &parent->zombies;
+}
+
+int join_child(int tid, int uthread) {
+    struct thread * child;
+    int saved_intr_state;
+
+    trace("%s(tid=%d)", __func__, tid);
+
+    if (tid <= 0)
+        return -1;
+
+    trace("%s(tid=%d) in %s", __func__, tid, CURTHR->name);
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    // Can only wait for child if we're the parent
+
+    child = idtab_get(&thrtab, tid);
+
+    if (child == NULL || child->parent != CURTHR || child->uthread != uthread) {
+        thrmgr_lock_release(saved_intr_state);
+        return -1;
+    }
     
-    prev_thread = _thread_swtch(next_thread);
+    // Wait for child to exit. Other children that exit in the meantime queue
+    // up without waking us.
 
-    trace("_thread_swtch() returned in %s", CURTHR->name);
+    CURTHR->join_target = child;
 
-    if (prev_thread->state == THREAD_EXITED) {
-        memory_free_page(prev_thread->stack_base - PAGE_SIZE);
-        prev_thread->stack_base = NULL;
-        prev_thread->stack_size = 0;
+    while (child->state != THREAD_EXITED) {
+        if (condition_wait_intr(&CURTHR->child_exit) < 0) {
+            CURTHR->join_target = NULL;
+            thrmgr_lock_release(saved_intr_state);
+            return -EINTR;
+        }
     }
+    
+    CURTHR->join_target = NULL;
+    recycle_thread(tid);
 
-    intr_restore(saved_intr_state);
+    thrmgr_lock_release(saved_intr_state);
+
+    return tid;
 }
 
 void tlclear(struct thread_list * list) {
@@ -570,6 +2254,31 @@ struct thread * tlremove(struct thread_list * list) {
     return thr;
 }
 
+// Removes /thr/ from /list/. Takes time proportional to the position of the
+// thread in the list; used for zombie queues, which are short and usually
+// searched from the head.
+
+void tlremove_thread(struct thread_list * list, struct thread * thr) {
+    struct thread * prev = NULL;
+    struct thread * cur;
+
+    for (cur = list->head; cur != NULL && cur != thr; cur = cur->list_next)
+        prev = cur;
+
+    if (cur == NULL)
+        return;
+    
+    if (prev != NULL)
+        prev->list_next = thr->list_next;
+    else
+        list->head = thr->list_next;
+
+    if (list->tail == thr)
+        list->tail = prev;
+
+    thr->list_next = NULL;
+}
+
 // Appends elements of l1 to the end of l0 and clears l1.
 
 void tlappend(struct thread_list * l0, struct thread_list * l1) {
@@ -592,82 +2301,5 @@ void tlappend(struct thread_list * l0, struct thread_list * l1) {
 }
 
 void idle_thread_func(void * arg __attribute__ ((unused))) {
-    // The idle thread sleeps using wfi if the ready list is empty. Note that we
-    // need to disable interrupts before checking if the thread list is empty to
-    // avoid a race condition where an ISR marks a thread ready to run between
-    // the call to tlempty() and the wfi instruction.
-
-    for (;;) {
-        // If there are runnable threads, yield to them.
-
-        while (!tlempty(&ready_list))
-            thread_yield();
-        
-        // No runnable threads. Sleep using the wfi instruction. Note that we
-        // need to disable interrupts and check the runnable thread list one
-        // more time (make sure it is empty) to avoid a race condition where an
-        // ISR marks a thread ready before we call the wfi instruction.
-
-        intr_disable();
-        if (tlempty(&ready_list))
-            asm ("wfi");
-        intr_enable();
-    }
+    thread_idle_loop();
 }
-// This function allocates new memory for the child process and sets up another thread struct. It also initializes
-// a stack anchor to reclaim the thread pointer when coming back from a U mode interrupt. The child’s memory
-// space is switched into and the thread is set to be run.
-extern int thread_fork_to_user(
-struct process * child_proc, const struct trap_frame * parent_tfr){
-    // Inputs: child_proc - child process, parent_tfr - parent trap frame
-    // Outputs: thread ID of the child process
-    // Purpose: Fork the current thread to the child process. This involves creating a new thread struct, copying the
-    struct thread_stack_anchor * stack_anchor;
-    void * stack_page;
-    struct thread * child;
-    int tid;
-
-    // Find a free thread slot.
-
-    tid = 0;  
-    while (++tid < NTHR)    // iterate through the thrtab array
-        if (thrtab[tid] == NULL) // if the thread struct is NULL
-            break;
-    
-    if (tid == NTHR)
-        panic("ERROR: Too many threads");
-    
-    // Allocate a struct thread and a stack
-
-    child = kmalloc(sizeof(struct thread)); //  allocate memory for the child thread
- 
-    stack_page = memory_alloc_page(); // allocate a page of memory
-    stack_anchor = stack_page + PAGE_SIZE - 1; // set the stack anchor to the stack page
-    stack_anchor->thread = child; // set the thread to the child thread
-    stack_anchor->reserved = 0; // set the reserved value to 0
-
-    thrtab[tid] = child; // set the thread ID to the child thread
-
-    child->id = tid; // set the thread ID to the thread ID
-    child->name = "Franklin F. Fork"; // set the name of the thread
-    child->parent = CURTHR; // set the parent of the thread to the current thread
-    child->proc = child_proc; // set the process of the thread to the child process
-    child_proc->tid = tid; // set the process thread ID to the thread ID
-    child->stack_base = stack_anchor; // set the stack base to the stack anchor
-    child->stack_size = child->stack_base - stack_page; // set the stack size to the stack base minus the stack page
-
-    memcpy(child->stack_base - sizeof(struct trap_frame), parent_tfr, sizeof(struct trap_frame)); // copy the parent trap frame to the stack base
-    child->context.sp = child->stack_base; // set the context stack pointer to the stack base
-    child->context.s[0] = tid; // set the context s[0] to the thread ID
- 
-    int r = intr_disable(); // disable interrupts
-    tlinsert(&ready_list, CURTHR); // insert the current thread into the ready list
-    intr_restore(r); // restore interrupts 
-    set_thread_state(CURTHR, THREAD_READY); // set the thread state to ready
-    set_thread_state(child, THREAD_RUNNING); // set the child thread state to running
-    
-    memory_space_switch(child_proc->mtag); // switch the memory space to the child process memory space
-    _thread_finish_fork(child, parent_tfr); // finish the fork
-    
-    return child->proc->id;
-    }
@@ -8,6 +8,8 @@
 #include <stddef.h>
 
 struct thread; // forward decl.
+struct process; // process.h
+struct ktask; // ktask.h
 
 struct thread_stack_anchor {
     struct thread * thread;
@@ -23,6 +25,32 @@ struct thread_list {
 struct condition {
     const char * name;
 	struct thread_list wait_list;
+    struct ktask * task_head; // waiting stackless tasks (see ktask.h)
+    struct ktask * task_tail;
+};
+
+// Scheduling priority levels. Level 0 is the highest. Each thread has a base
+// priority, set with thread_set_priority, and a current priority that the
+// scheduler lowers when the thread uses up its time slice and raises again
+// when it wakes up from condition_wait. The current priority never rises above
+// the base priority.
+
+#define THREAD_PRIO_CNT 4
+#define THREAD_PRIO_HIGH 0
+#define THREAD_PRIO_LOW (THREAD_PRIO_CNT-1)
+
+// CPU usage of a thread, kept by the scheduler. Times are in mtime ticks and
+// cover the thread's history up to its last context switch.
+
+struct thread_rusage {
+    uint64_t run_time; // time spent running
+    uint64_t ready_time; // time spent on a ready list
+    uint64_t wait_time; // time spent waiting on a condition
+    uint64_t cycles; // cycles spent running (rdcycle)
+    unsigned long nvcsw; // switches away because the thread had to wait
+    unsigned long nivcsw; // switches away while it could have run on
+    unsigned long edf_jobs; // EDF jobs released (see thread_set_deadline)
+    unsigned long edf_misses; // EDF jobs that finished after their deadline
 };
 
 // EXPORTED GLOBAL VARIABLES
@@ -35,6 +63,24 @@ extern char thrmgr_initialized;
 
 extern void thread_init(void);
 
+// int thrmgr_lock_acquire(void)
+// void thrmgr_lock_release(int saved)
+// The thread manager lock protects thread states, the per-hart ready lists and
+// the wait lists of all condition variables. It is a spinlock that disables
+// interrupts on the holding hart. It may be acquired again by the hart already
+// holding it, in which case thrmgr_lock_acquire returns THRMGR_LOCK_NESTED and
+// the matching release does nothing. To wait for a condition signalled by
+// another hart or by an ISR, check the condition and call condition_wait while
+// holding this lock; the lock is given up while the thread is suspended.
+// Releasing the lock with interrupts enabled is a preemption point: if a
+// thread that outranks the caller was made ready on its hart meanwhile, the
+// caller yields to it before thrmgr_lock_release returns.
+
+#define THRMGR_LOCK_NESTED (-1)
+
+extern int thrmgr_lock_acquire(void);
+extern void thrmgr_lock_release(int saved);
+
 // int running_thread(void)
 // Returns the thread id of the currently running thread.
 
@@ -56,28 +102,121 @@ extern int thread_spawn(const char * name, void (*start)(void *), void * arg);
 
 extern void thread_yield(void);
 
+// int thread_set_priority(int prio)
+// Sets the base priority of the current thread to /prio/, which must be
+// between THREAD_PRIO_HIGH and THREAD_PRIO_LOW, and resets its current
+// priority and time slice to match. Returns the previous base priority, or
+// -EINVAL if /prio/ is out of range. New threads inherit the base priority of
+// the thread that created them.
+
+extern int thread_set_priority(int prio);
+
+// int thread_set_deadline(uint64_t period, uint64_t budget, uint64_t deadline)
+// Moves the current thread into the deadline (EDF) class, which runs ahead of
+// all priority levels. The thread runs as a periodic task: a job is released
+// each time it wakes from alarm_sleep, must finish (sleep on its alarm again)
+// within /deadline/ of its release and may use up to /budget/ of CPU time;
+// all three are in mtime ticks. Among ready EDF threads on a hart, the one
+// with the earliest deadline runs. A thread that exhausts its budget is
+// throttled to its normal priority until its next release. The thread is
+// admitted on the hart it is running on if the sum of budget/deadline over
+// the EDF threads there stays within EDF_UTIL_MAX. A /period/ of 0 returns the
+// thread to the normal class. Returns 0, -EINVAL if the parameters do not
+// satisfy 0 < budget <= deadline <= period, or -EBUSY if the hart has no room.
+
+extern int thread_set_deadline (
+    uint64_t period, uint64_t budget, uint64_t deadline);
+
+// void thread_edf_alarm(uint64_t twake)
+// Called by alarm_sleep before the running thread sleeps until /twake/. For an
+// EDF thread this completes the current job, counting a miss if its deadline
+// has passed, and releases the next job at /twake/. Does nothing for other
+// threads.
+
+extern void thread_edf_alarm(uint64_t twake);
+
+// Prints the parameters and job counts of all EDF threads to the console.
+
+extern void thread_edf_report(void);
+
+// void thread_tick(void)
+// Charges the time since it was last accounted to the thread running on this
+// hart. A thread that has used up its time slice drops one priority level and
+// is marked for rescheduling, as is an EDF thread that has used up its budget.
+// Called from the timer interrupt handler on every hart.
+
+extern void thread_tick(void);
+
+// void thread_preempt_check(void)
+// Yields the hart if the running thread's time slice has expired or a thread
+// of higher priority has become ready on this hart. Called on the way back to
+// user mode from interrupts and exceptions.
+
+extern void thread_preempt_check(void);
+
+// void thread_preempt_kernel(void)
+// Like thread_preempt_check, but called on the way back from an interrupt
+// taken in S mode. The kernel is preemptible: a thread in the middle of a
+// system call or a kernel thread may be switched away from wherever it has
+// interrupts enabled, unless it has disabled preemption.
+
+extern void thread_preempt_kernel(void);
+
+// void thread_preempt_disable(void)
+// void thread_preempt_enable(void)
+// Disable and re-enable kernel preemption of the running thread. Calls nest;
+// the thread is preemptible again when every disable has been matched by an
+// enable, at which point a pending reschedule takes effect. A thread may still
+// block with preemption disabled. Needed around code that leaves hart state
+// out of step with the thread, such as a satp other than that of its process;
+// holding a spinlock or having interrupts disabled also prevents preemption.
+
+extern void thread_preempt_disable(void);
+extern void thread_preempt_enable(void);
+
 // int thread_join_any(void) int thread_join(int tid) Waits for a child thread
 // of the current thread to exit. The thread_join_any function waits for any of
 // the current thread's children to exit, while thread_join waits for a specific
-// thread, given by /tid/, to exit.
+// thread, given by /tid/, to exit. User threads started with
+// thread_create_user are not reaped by either; see thread_join_user. All three
+// return -EINTR if the caller's process exits while they wait.
 
 extern int thread_join_any(void);
 extern int thread_join(int tid);
 
+// int thread_join_user(int tid)
+// Waits for the user thread /tid/, started by the current thread with
+// thread_create_user, to exit. Returns /tid/, or -1 if it is not such a
+// thread.
+
+extern int thread_join_user(int tid);
+
 // void thread_exit(void)
 // Terminates the currently running thread and does not return.
 
 extern void thread_exit(void) __attribute__ ((noreturn));
 
 // void recycle_thread(int tid)
-// Reclaims a thread's slot in thrtab and makes its parent the parent of its
-// children. Frees the struct thread of the thread.
+// Reclaims a thread's slot in thrtab, takes it off its parent's child list and
+// zombie queue, and makes its parent the parent of its children. Frees the
+// struct thread of the thread.
 
 extern void recycle_thread(int tid);
 
 extern void __attribute__ ((noreturn)) thread_jump_to_user (
     uintptr_t usp, uintptr_t upc);
 
+// int thread_fp_trap(void)
+// Handles an illegal instruction exception from U mode. FP registers are
+// switched lazily: a thread runs with FP disabled (sstatus.FS Off) until its
+// first FP instruction, which traps here. If FP was disabled, loads the
+// running thread's FP registers unless they are still live on this hart,
+// enables FP and returns 1 so that the instruction is retried. Returns 0 if FP
+// was already enabled, meaning the instruction really is illegal. If there is
+// no memory to save the thread's FP registers in, its process exits.
+
+extern int thread_fp_trap(void);
+
 
 // Returns a pointer to the process struct of a thread's process, or NULL if the
 // specified thread does not have an associated process (e.g. idle).
@@ -93,6 +232,44 @@ extern void thread_set_process(int tid, struct process * proc);
 
 extern const char * thread_name(int tid);
 
+// void thread_get_rusage(struct thread_rusage * ru)
+// void thread_process_rusage(const struct process * proc,
+//     struct thread_rusage * ru)
+// Fill in /ru/ with the CPU usage of the running thread, or with the summed
+// usage of all threads of process /proc/, including those that have exited.
+// The time since the last switch of each thread is included as well.
+// thread_process_rusage must be called with the thread manager lock held.
+
+extern void thread_get_rusage(struct thread_rusage * ru);
+extern void thread_process_rusage (
+    const struct process * proc, struct thread_rusage * ru);
+
+// Returns the total number of context switches on all harts since boot.
+
+extern unsigned long thread_ctxsw_count(void);
+
+// Returns 1 if a thread of process /proc/ is running on a hart other than the
+// caller's or was preempted in the middle of kernel code, 0 otherwise. Such a
+// thread may be changing the process's page tables or using the physical pages
+// they map, for instance while cloning them in a fork, so the caller must not
+// scan or migrate them. Must be called with the thread manager lock held; the
+// answer only stays valid while the caller holds it.
+
+extern int thread_process_busy(const struct process * proc);
+
+// Creates the idle thread of a secondary hart (see smp.c). The hart starts
+// running on the returned stack anchor, which holds the thread pointer, and
+// enters thread_idle_loop. The thread is RUNNING from the start.
+
+struct cpu; // smp.h
+
+extern struct thread_stack_anchor * thread_create_idle(struct cpu * cpu);
+
+// The body of every idle thread. Runs threads from this hart's ready list,
+// takes work from other harts when it is empty, and sleeps otherwise.
+
+extern void __attribute__ ((noreturn)) thread_idle_loop(void);
+
 // void condition_init(struct condition * cond, const char * name)
 // Initializes a condition variable. Argument /cond/ is a pointer to a struct
 // condition to initialize. Argument /name/ is the name of the thread, which may
@@ -103,25 +280,69 @@ extern void condition_init(struct condition * cond, const char * name);
 // void condition_wait(struct condition * cond)
 // Suspends the current thread until a condition is signalled by another thread
 // or interrupt service routine. The condition_wait function may be called with
-// interrupts disabled. It will enable interrupts while the thread is suspended
-// and will restore interrupt enable/disable state to its value when called.
-// Note that in cases where a thread needs to wait for a condition to be
-// signalled by an ISR, condition_wait() should be called with interrupts
-// disabled to avoid a race condition.
+// the thread manager lock held (and interrupts disabled). Other threads may run
+// while the thread is suspended, and the lock and interrupt enable/disable
+// state are restored to their value when called. Note that in cases where a
+// thread needs to wait for a condition signalled by another hart or an ISR,
+// the condition should be checked and condition_wait() called while holding
+// the thread manager lock to avoid a race condition.
 
 extern void condition_wait(struct condition * cond);
 
+// int condition_wait_intr(struct condition * cond)
+// Like condition_wait, but the wait is cut short if the thread's process exits
+// (see thread_interrupt_process). Returns -EINTR if it was, or if the process
+// was already exiting, and 0 otherwise. System calls use it for waits that may
+// last indefinitely, such as for input or for another thread, and return
+// -EINTR; the thread then leaves with its process on the way back to U mode.
+
+extern int condition_wait_intr(struct condition * cond);
+
+// void thread_interrupt_process(struct process * proc)
+// Wakes the threads of /proc/, other than the caller, that are waiting in
+// condition_wait_intr. Called by process_exit after setting proc->exiting, so
+// that threads blocked in a system call leave with the process.
+
+extern void thread_interrupt_process(struct process * proc);
+
 // void condition_broadcast(struct condition * cond)
 
 // Wakes up all threads waiting on a condition. This function may be called from
 // an ISR. Calling condition_broadcast() does not cause a context switch from
 // the currently running thread.
 // Waiting threads are added to the ready-to-run list in the order they were
-// added to the wait queue.
+// added to the wait queue. Kernel tasks waiting on the condition are made ready
+// as well.
 
 extern void condition_broadcast(struct condition * cond);
 
+// int condition_signal(struct condition * cond)
+// Wakes up the thread that has been waiting longest on a condition. Returns
+// the thread id of the woken thread, or -1 if no thread was waiting, in which
+// case the kernel task that has waited longest, if any, is made ready. Like
+// condition_broadcast, it may be called from an ISR and does not cause a
+// context switch. When called with the thread manager lock held, the caller
+// may hand a resource to the returned thread before it can run.
+
+extern int condition_signal(struct condition * cond);
+
 extern int thread_fork_to_user(
     struct process * child_proc, const struct trap_frame * parent_tfr);
 
+// int thread_create_user(const struct trap_frame * tfr)
+// Starts a new thread in the current process, running in U mode with the
+// registers in /tfr/. The thread is a child of the caller, which reaps it with
+// thread_join_user. If the caller is recycled first, the thread is detached and
+// recycled as soon as it exits. Returns the thread id of the new thread, or -EAGAIN if the
+// thread table or memory is exhausted or the process is exiting.
+
+extern int thread_create_user(const struct trap_frame * tfr);
+
+// int thread_leave_process(void)
+// Takes the running thread off its process's thread list in preparation for
+// thread_exit. Returns the number of threads left in the process; the thread
+// that sees 0 tears the process down.
+
+extern int thread_leave_process(void);
+
 #endif // _THREAD_H_
@@ -6,6 +6,10 @@
 #include "csr.h"
 #include "intr.h"
 #include "halt.h" // for assert
+#include "smp.h"
+#include "spinlock.h"
+#include "error.h"
+#include "console.h"
 
 #include "config.h"
 #include <limits.h>
@@ -19,51 +23,196 @@
 
 #define TICK_PERIOD (TIMER_FREQ/TICK_FREQ)
 
+// Alarms are kept on a hierarchical timing wheel. Level 0 has WHEEL_SIZE slots
+// of 2^WHEEL_RES_SHIFT mtime ticks each (about 0.8 ms); every level above it
+// has slots WHEEL_SIZE times as wide. With four levels the wheel reaches about
+// four hours ahead. Alarms further out are parked in the last slot in reach
+// and re-filed when it cascades.
 
+#define WHEEL_RES_SHIFT 13
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+// Value of alarm.level for an alarm that has been taken off the wheel but not
+// broadcast yet (see fire_alarm)
+
+#define ALARM_FIRING -2
 
 // EXPORTED GLOBAL VARIABLE DEFINITIONS
-// 
+//
 
 char timer_initialized = 0;
+char timer_sstc_enabled = 0;
 
 // INTERNVAL GLOBAL VARIABLE DEFINITIONS
 //
 
-static struct alarm * sleep_list;
-static uint64_t next_tick;
+// The timing wheel is serviced by hart 0. wheel_clk is the level 0 slot
+// number (mtime >> WHEEL_RES_SHIFT) the wheel has advanced to, and
+// wheel_busy has a bit set for each non-empty slot. Each hart also takes
+// periodic ticks, which drive time slice accounting, but only while the
+// scheduler has asked for them (see timer_set_tick). A stopped tick has a
+// next_tick of UINT64_MAX. next_budget is the one-shot event set with
+// timer_set_budget, UINT64_MAX if none. All of these are protected by
+// timer_lock.
+
+static struct alarm * wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t wheel_busy[WHEEL_LEVELS];
+static uint64_t wheel_clk;
+static uint64_t next_tick[NCPU];
+static uint64_t next_budget[NCPU];
+
+static struct spinlock timer_lock = {
+    .name = "timer"
+};
+
+// With Sstc a hart can only program its own stimecmp. A hart that changes the
+// next event of another hart sets its flag here and sends it an IPI, and the
+// target reprograms itself in timer_resync.
+
+static volatile char resync_pending[NCPU];
 
 // INTERNAL FUNCTION DECLARATIONS
 //
 
 static void enable_mmode_timer_intr(void);
 
-static inline uint64_t get_mtime(void);
+// Sets the mtimecmp register of a hart to the earliest of its next tick, its
+// budget event and, on hart 0, the next event on the timing wheel. Must be
+// called with timer_lock held.
+
+static void program_timer(int hartid);
+
+// Sets the timer compare register of a hart: stimecmp if the harts support
+// Sstc, otherwise the CLINT mtimecmp register.
+
+static void set_timecmp(int hartid, uint64_t val);
+
+// The following functions manipulate the timing wheel and must be called with
+// timer_lock held. wheel_insert files an alarm in the slot for its wake-up
+// time and wheel_remove takes it out again, both in constant time.
+// wheel_advance moves the wheel up to /now/ and returns a list of the expired
+// alarms, linked through their next member. wheel_next_event returns the mtime
+// at which the wheel next needs attention, or UINT64_MAX if it is empty.
+
+static void wheel_insert(struct alarm * al);
+static void wheel_remove(struct alarm * al);
+static struct alarm * wheel_advance(uint64_t now);
+static uint64_t wheel_next_event(void);
+
+// Moves the alarms of one slot of an upper level down the wheel.
+
+static void wheel_cascade(int level, int slot);
+
+// Adds all alarms of a level 0 slot with a wake-up time no later than /now/ to
+// the list /expired/.
+
+static void wheel_expire(int slot, uint64_t now, struct alarm ** expired);
+
+// Broadcasts an alarm taken off the wheel and marks it as no longer in use, in
+// one hold of the thread manager lock. A sleeper cut short by its process
+// exiting that finds its alarm ALARM_FIRING waits for this broadcast before it
+// lets the alarm go. Must be called without timer_lock held.
+
+static void fire_alarm(struct alarm * al);
+
 static inline void set_mtime(uint64_t val);
-static inline uint64_t get_mtcmp(void);
-static inline void set_mtcmp(uint64_t val);
+static inline uint64_t get_mtcmp(int hartid);
+static inline void set_mtcmp(int hartid, uint64_t val);
 
 // EXPORTED FUNCTION DEFINITIONS
 //
 
 void timer_init(void) {
+    int i;
+
+    // Reading stimecmp traps unless the hart implements Sstc and M mode set
+    // menvcfg.STCE (see start.s). With Sstc, timer interrupts go straight to
+    // S mode, and we never need the ecall to M mode to re-arm the timer.
+
+    trap_probe_begin();
+    csrr_stimecmp();
+    timer_sstc_enabled = (trap_probe_end() == 0);
+
     set_mtime(0);
-    set_mtcmp(TICK_PERIOD);
+    wheel_clk = 0;
+    for (i = 0; i < NCPU; i++)
+        next_budget[i] = UINT64_MAX;
+    next_tick[0] = TICK_PERIOD;
+    set_timecmp(0, next_tick[0]);
     csrs_sie(RISCV_SIE_STIE);
-    enable_mmode_timer_intr();
+    if (!timer_sstc_enabled)
+        enable_mmode_timer_intr();
+
+    kprintf("         Timer: Sstc %s\n", timer_sstc_enabled ? "yes" : "no");
 
     timer_initialized = 1;
 }
 
+void timer_init_hart(void) {
+    const int hartid = smp_hartid();
+    int saved_lock_state;
+
+    saved_lock_state = spinlock_acquire(&timer_lock);
+    next_tick[hartid] = get_mtime() + TICK_PERIOD;
+    program_timer(hartid);
+    spinlock_release(&timer_lock, saved_lock_state);
+
+    csrs_sie(RISCV_SIE_STIE);
+    if (!timer_sstc_enabled)
+        enable_mmode_timer_intr();
+}
+
+void timer_set_tick(int hartid, int enable) {
+    int saved_lock_state;
+
+    assert (0 <= hartid && hartid < NCPU);
+
+    saved_lock_state = spinlock_acquire(&timer_lock);
+
+    if (!enable)
+        next_tick[hartid] = UINT64_MAX;
+    else if (next_tick[hartid] == UINT64_MAX)
+        next_tick[hartid] = get_mtime() + TICK_PERIOD;
+
+    // Writing another hart's mtimecmp is fine: its MTIE is only clear while
+    // its timer interrupt handler runs, and the handler reprograms the timer
+    // under timer_lock before setting MTIE again. With Sstc, set_timecmp asks
+    // the hart to do it itself.
+
+    program_timer(hartid);
+
+    spinlock_release(&timer_lock, saved_lock_state);
+}
+
+void timer_set_budget(int hartid, uint64_t tend) {
+    int saved_lock_state;
+
+    assert (0 <= hartid && hartid < NCPU);
+
+    saved_lock_state = spinlock_acquire(&timer_lock);
+    next_budget[hartid] = tend;
+    program_timer(hartid);
+    spinlock_release(&timer_lock, saved_lock_state);
+}
+
 void alarm_init(struct alarm * al, const char * name) {
     condition_init(&al->cond, name ? name : "alarm");
     al->twake = get_mtime();
     al->next = NULL;
+    al->prev = NULL;
+    al->level = -1;
+    al->cancelled = 0;
 }
 
-void alarm_sleep(struct alarm * al, uint64_t tcnt) {
-    struct alarm * prev;
+int alarm_sleep(struct alarm * al, uint64_t tcnt) {
     int saved_intr_state;
+    int saved_lock_state;
+    int firing;
     uint64_t now;
+    int result;
 
     now = get_mtime();
 
@@ -73,62 +222,108 @@ void alarm_sleep(struct alarm * al, uint64_t tcnt) {
         al->twake = UINT64_MAX;
     else
         al->twake += tcnt;
-    
+
+    // A periodic EDF thread ends its current job here; its next one is
+    // released at the wake-up time.
+
+    thread_edf_alarm(al->twake);
+
     // If the wake-up time has already passed, return
 
     if (al->twake < now)
-        return;
-    
-    saved_intr_state = intr_disable();
-
-    if (sleep_list == NULL || al->twake <= sleep_list->twake) {
-        debug("[%lu] Inserting alarm %s at head of list", now, al->cond.name);
-        // Insert alarm at head of sleep list
-        al->next = sleep_list;
-        sleep_list = al;
-        // If current alarm occurs before next tick, update mtcmp
-
-        if (al->twake < next_tick) {
-            set_mtcmp(al->twake);
-            csrs_sie(RISCV_SIE_STIE);
-            enable_mmode_timer_intr();
-        }
+        return 0;
 
+    // We hold the thread manager lock from before the alarm is on the wheel
+    // until we are waiting, so that hart 0 cannot broadcast the alarm in
+    // between. The timer lock protects the wheel itself.
 
-    } else {
-        // Insert current alarm in list in order of wake-up time. Ideally, we
-        // should not keep interrupts disabled while we iterate through the
-        // list. The right way would be to restore interrupt state, find the
-        // place on the list where we want to insert, the disable interrupts and
-        // re-check the insert point.
-
-        for (prev = sleep_list; prev->next != NULL; prev = prev->next) {
-            if (al->twake <= prev->next->twake) {
-                debug("[%lu] Inserting alarm %s after %s",
-                    now, al->cond.name, prev->cond.name);
-                al->next = prev->next;
-                prev->next = al;
-                break;
-            }
-        }
+    saved_intr_state = thrmgr_lock_acquire();
+    saved_lock_state = spinlock_acquire(&timer_lock);
 
-        // End of list, insert at tail
-        if (prev->next == NULL) {
-            debug("%[lu] Inserting alarm %s at tail", al->cond.name);
-            al->next = NULL;
-            prev->next = al;
-        }
-    }
+    assert (al->level < 0);
+    al->cancelled = 0;
+    wheel_insert(al);
+
+    // Programming hart 0's timer from another hart is fine; see
+    // timer_set_tick.
+
+    program_timer(0);
 
-    debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
+    debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp(0));
 
-    // Note: condition_wait must be *inside* intr_disable/intr_restore block to
+    spinlock_release(&timer_lock, saved_lock_state);
+
+    // Note: condition_wait must be called with the thread manager lock held to
     // prevent a race condition where an alarm is signalled before we call
     // condition_wait.
 
-    condition_wait(&al->cond);
+    result = condition_wait_intr(&al->cond);
+
+    // If our process is exiting, take the alarm off the wheel, unless it has
+    // already been taken off to be broadcast. In that case, wait for the
+    // broadcast, so that nothing touches the alarm after we return.
+
+    if (result < 0) {
+        saved_lock_state = spinlock_acquire(&timer_lock);
+        if (al->level >= 0)
+            wheel_remove(al);
+        firing = (al->level == ALARM_FIRING);
+        spinlock_release(&timer_lock, saved_lock_state);
+
+        if (firing)
+            condition_wait(&al->cond);
+    } else if (al->cancelled)
+        result = -EINTR;
+
+    al->cancelled = 0;
 
-    intr_restore(saved_intr_state);
+    thrmgr_lock_release(saved_intr_state);
+
+    return result;
+}
+
+int alarm_cancel(struct alarm * al) {
+    int saved_lock_state;
+    int pending;
+
+    trace("%s(<%s>)", __func__, al->cond.name);
+
+    saved_lock_state = spinlock_acquire(&timer_lock);
+
+    // An alarm that has already been taken off the wheel by hart 0 is about
+    // to be broadcast and can no longer be cancelled.
+
+    pending = (al->level >= 0);
+
+    if (pending) {
+        wheel_remove(al);
+        al->level = ALARM_FIRING;
+        al->cancelled = 1;
+    }
+
+    spinlock_release(&timer_lock, saved_lock_state);
+
+    // As in timer_intr_handler, broadcast without the timer lock held. The
+    // sleeper holds the thread manager lock until it waits, so it cannot miss
+    // the broadcast.
+
+    if (pending)
+        fire_alarm(al);
+
+    return pending;
+}
+
+void timer_resync(void) {
+    const int hartid = smp_hartid();
+    int saved_lock_state;
+
+    if (!resync_pending[hartid])
+        return;
+
+    saved_lock_state = spinlock_acquire(&timer_lock);
+    resync_pending[hartid] = 0;
+    program_timer(hartid);
+    spinlock_release(&timer_lock, saved_lock_state);
 }
 
 // Resets the alarm so that the next sleep increment is relative to the time
@@ -141,37 +336,283 @@ void alarm_reset(struct alarm * al) {
 // timer_handle_interrupt() is dispatched from intr_handler in intr.c
 
 void timer_intr_handler(struct trap_frame * tfr) {
-    struct alarm * head = sleep_list;
+    const int hartid = smp_hartid();
+    struct alarm * expired;
     struct alarm * next;
+    int saved_lock_state;
+    int ticked = 0;
     uint64_t now;
 
     now = get_mtime();
 
     trace("[%lu] %s()", now, __func__);
-    debug("[%lu] mtcmp = %lu", now, get_mtcmp());
-
-    while (head != NULL && head->twake <= now) {
-        debug("[%lu] Broadcasting alarm for %s", now, head->cond.name);
-        condition_broadcast(&head->cond);
-        next = head->next;
-        head->next = NULL;
-        head = next;
+    debug("[%lu] mtcmp = %lu", now, get_mtcmp(hartid));
+
+    saved_lock_state = spinlock_acquire(&timer_lock);
+
+    // A stopped tick never comes due. After a long stretch with interrupts
+    // off, skip the missed ticks rather than taking them back to back.
+
+    if (next_tick[hartid] <= now) {
+        next_tick[hartid] += TICK_PERIOD;
+        if (next_tick[hartid] <= now)
+            next_tick[hartid] = now + TICK_PERIOD;
+        ticked = 1;
+    }
+
+    if (next_budget[hartid] <= now) {
+        next_budget[hartid] = UINT64_MAX;
+        ticked = 1;
     }
 
-    if (next_tick < now)
-        next_tick += TICK_PERIOD;
+    // Take the expired alarms off the wheel, then broadcast them after
+    // dropping the timer lock: alarm_sleep acquires the thread manager lock
+    // before the timer lock, so we must not hold them in the opposite order.
+    // Only hart 0 services the wheel.
+
+    expired = (hartid == 0) ? wheel_advance(now) : NULL;
 
-    sleep_list = head;
+    program_timer(hartid);
 
-    if (head != NULL && head->twake < next_tick)
-        set_mtcmp(head->twake);
+    spinlock_release(&timer_lock, saved_lock_state);
+
+    // The owner of an alarm may reuse it as soon as it is woken, so read the
+    // link first.
+
+    while (expired != NULL) {
+        next = expired->next;
+        expired->next = NULL;
+        debug("[%lu] Broadcasting alarm for %s", now, expired->cond.name);
+        fire_alarm(expired);
+        expired = next;
+    }
+
+    debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp(hartid));
+
+    // With Sstc, writing stimecmp in program_timer has already cleared STIP.
+
+    if (!timer_sstc_enabled)
+        enable_mmode_timer_intr();
+
+    // Interrupts for alarms between ticks are not charged to the thread; the
+    // end of an EDF budget is.
+
+    if (ticked)
+        thread_tick();
+}
+
+void program_timer(int hartid) {
+    uint64_t tnext;
+    uint64_t twheel;
+
+    tnext = next_tick[hartid];
+
+    if (next_budget[hartid] < tnext)
+        tnext = next_budget[hartid];
+
+    if (hartid == 0) {
+        twheel = wheel_next_event();
+        if (twheel < tnext)
+            tnext = twheel;
+    }
+
+    set_timecmp(hartid, tnext); // UINT64_MAX turns the timer off
+}
+
+void set_timecmp(int hartid, uint64_t val) {
+    if (!timer_sstc_enabled)
+        set_mtcmp(hartid, val);
+    else if (hartid == smp_hartid())
+        csrw_stimecmp(val);
+    else {
+        resync_pending[hartid] = 1;
+        smp_send_ipi(hartid);
+    }
+}
+
+void wheel_insert(struct alarm * al) {
+    uint64_t expires;
+    uint64_t delta;
+    int level;
+    int slot;
+
+    // Alarms due in the current slot or earlier go in the current slot, so
+    // that the next call to wheel_advance expires them.
+
+    expires = al->twake >> WHEEL_RES_SHIFT;
+
+    if (expires < wheel_clk)
+        expires = wheel_clk;
+
+    delta = expires - wheel_clk;
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta < (UINT64_C(1) << (WHEEL_BITS * (level+1))))
+            break;
+    }
+
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS) != 0)
+        expires = wheel_clk + (UINT64_C(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    al->level = level;
+    al->slot = slot;
+    al->prev = NULL;
+    al->next = wheel[level][slot];
+    if (al->next != NULL)
+        al->next->prev = al;
+    wheel[level][slot] = al;
+    wheel_busy[level] |= UINT64_C(1) << slot;
+}
+
+void wheel_remove(struct alarm * al) {
+    const int level = al->level;
+    const int slot = al->slot;
+
+    assert (0 <= level && level < WHEEL_LEVELS);
+
+    if (al->prev != NULL)
+        al->prev->next = al->next;
     else
-        set_mtcmp(next_tick);
+        wheel[level][slot] = al->next;
+
+    if (al->next != NULL)
+        al->next->prev = al->prev;
+
+    if (wheel[level][slot] == NULL)
+        wheel_busy[level] &= ~(UINT64_C(1) << slot);
+
+    al->next = NULL;
+    al->prev = NULL;
+    al->level = -1;
+}
+
+struct alarm * wheel_advance(uint64_t now) {
+    const uint64_t target = now >> WHEEL_RES_SHIFT;
+    struct alarm * expired = NULL;
+    uint64_t rest;
+    int slot;
 
+    // Every alarm in a slot before the current one is due. When the rest of
+    // level 0 is empty, skip straight to the next cascade, so that catching
+    // up after a long idle stretch costs one step per level 1 slot at most.
 
-    debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
-    enable_mmode_timer_intr();
+    while (wheel_clk < target) {
+        slot = wheel_clk & WHEEL_MASK;
+        wheel_expire(slot, now, &expired);
 
+        rest = wheel_busy[0] >> slot;
+
+        if (rest == 0 && (wheel_clk | WHEEL_MASK) < target)
+            wheel_clk |= WHEEL_MASK;
+
+        wheel_clk++;
+
+        if ((wheel_clk & WHEEL_MASK) == 0)
+            wheel_cascade(1, (wheel_clk >> WHEEL_BITS) & WHEEL_MASK);
+    }
+
+    // Alarms in the current slot may be due or a fraction of a slot away.
+
+    wheel_expire(wheel_clk & WHEEL_MASK, now, &expired);
+
+    return expired;
+}
+
+void wheel_cascade(int level, int slot) {
+    struct alarm * al;
+    struct alarm * next;
+
+    // A slot of this level holds the alarms of the next WHEEL_SIZE slots of
+    // the level below. If this level has also come round, cascade the level
+    // above it first, since its slot may refill this one.
+
+    if (slot == 0 && level < WHEEL_LEVELS - 1)
+        wheel_cascade(level + 1,
+            (wheel_clk >> (WHEEL_BITS * (level + 1))) & WHEEL_MASK);
+
+    al = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    wheel_busy[level] &= ~(UINT64_C(1) << slot);
+
+    while (al != NULL) {
+        next = al->next;
+        wheel_insert(al);
+        al = next;
+    }
+}
+
+void wheel_expire(int slot, uint64_t now, struct alarm ** expired) {
+    struct alarm * al;
+    struct alarm * next;
+
+    for (al = wheel[0][slot]; al != NULL; al = next) {
+        next = al->next;
+        if (al->twake <= now) {
+            wheel_remove(al);
+            al->level = ALARM_FIRING;
+            al->next = *expired;
+            *expired = al;
+        }
+    }
+}
+
+void fire_alarm(struct alarm * al) {
+    int saved_intr_state;
+
+    saved_intr_state = thrmgr_lock_acquire();
+    al->level = -1;
+    condition_broadcast(&al->cond);
+    thrmgr_lock_release(saved_intr_state);
+}
+
+uint64_t wheel_next_event(void) {
+    const struct alarm * al;
+    uint64_t tnext = UINT64_MAX;
+    uint64_t event;
+    uint64_t rot;
+    int level;
+    int cur;
+    int shift;
+    int dist;
+
+    // Level 0: the earliest alarm in the first busy slot, starting with the
+    // current one.
+
+    if (wheel_busy[0] != 0) {
+        cur = wheel_clk & WHEEL_MASK;
+        rot = wheel_busy[0] >> cur;
+        rot |= wheel_busy[0] << ((WHEEL_SIZE - cur) & WHEEL_MASK);
+        dist = __builtin_ctzll(rot);
+
+        for (al = wheel[0][(cur + dist) & WHEEL_MASK]; al != NULL; al = al->next) {
+            if (al->twake < tnext)
+                tnext = al->twake;
+        }
+    }
+
+    // Upper levels: the cascade of the first busy slot after the current one,
+    // which happens when the level below wraps to it. The current slot itself
+    // cascades last, a full turn from now.
+
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        if (wheel_busy[level] == 0)
+            continue;
+
+        shift = WHEEL_BITS * level;
+        cur = (wheel_clk >> shift) & WHEEL_MASK;
+        rot = wheel_busy[level] >> ((cur + 1) & WHEEL_MASK);
+        rot |= wheel_busy[level] << ((WHEEL_SIZE - cur - 1) & WHEEL_MASK);
+        dist = __builtin_ctzll(rot) + 1;
+
+        event = ((wheel_clk >> shift) + dist) << shift << WHEEL_RES_SHIFT;
+
+        if (event < tnext)
+            tnext = event;
+    }
+
+    return tnext;
 }
 
 void enable_mmode_timer_intr(void) {
@@ -179,21 +620,18 @@ void enable_mmode_timer_intr(void) {
     asm ("ecall" ::: "memory");
 }
 
-#define MTIME_ADDR 0x200BFF8
 #define MTCMP_ADDR 0x2004000
 
-static inline uint64_t get_mtime(void) {
-    return *(volatile uint64_t*)MTIME_ADDR;
-}
-
 static inline void set_mtime(uint64_t val) {
     *(volatile uint64_t*)MTIME_ADDR = val;
 }
 
-static inline uint64_t get_mtcmp(void) {
-    return *(volatile uint64_t*)MTCMP_ADDR;
+// Each hart has its own mtimecmp register.
+
+static inline uint64_t get_mtcmp(int hartid) {
+    return *(volatile uint64_t*)(MTCMP_ADDR + 8UL * hartid);
 }
 
-static inline void set_mtcmp(uint64_t val) {
-    *(volatile uint64_t*)MTCMP_ADDR = val;
+static inline void set_mtcmp(int hartid, uint64_t val) {
+    *(volatile uint64_t*)(MTCMP_ADDR + 8UL * hartid) = val;
 }
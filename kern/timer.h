@@ -9,28 +9,63 @@
 #include "trap.h" // for struct trap_frame
 
 #define TIMER_FREQ 10000000UL // from QEMU include/hw/intc/riscv_aclint.h
+#define MTIME_ADDR 0x200BFF8UL
 
 struct alarm {
     struct condition cond;
     struct alarm * next;
+    struct alarm * prev;
     uint64_t twake;
+    signed char level; // timing wheel level, -1 if not on the wheel
+    unsigned char slot; // slot within the wheel level
+    char cancelled; // set by alarm_cancel for the sleeper to find
 };
 
 // EXPORTED FUNCTION DECLARATIONS
 //
 
 extern char timer_initialized;
+extern char timer_sstc_enabled; // harts program their own timer via stimecmp
 extern void timer_init(void);
 
+// Starts periodic ticks on a secondary hart (see smp.c). Alarms are serviced
+// by hart 0 only.
+
+extern void timer_init_hart(void);
+
+// Starts or stops the periodic tick of hart /hartid/. While its tick is
+// stopped, a hart takes no timer interrupts except, on hart 0, for alarms. The
+// scheduler stops the tick of a hart that has nothing else to run and restarts
+// it when a second thread becomes ready there. May be called from any hart.
+
+extern void timer_set_tick(int hartid, int enable);
+
+// Arms a one-shot timer event on hart /hartid/ at mtime /tend/, replacing any
+// earlier one, or disarms it if /tend/ is UINT64_MAX. The event is delivered
+// like a tick, through thread_tick. The scheduler uses it to end the run of an
+// EDF job whose budget runs out between ticks.
+
+extern void timer_set_budget(int hartid, uint64_t tend);
+
 // Initializes an alarm. The /name/ argument is optional.
 
 extern void alarm_init(struct alarm * al, const char * name);
 
 // Puts the current thread to sleep for some number of ticks. The /tcnt/
 // argument specifies the number of timer ticks relative to the most recent
-// alarm event, either init, wake-up, or reset.
+// alarm event, either init, wake-up, or reset. Returns 0 when the alarm
+// expires, or -EINTR if it was cancelled with alarm_cancel or the thread's
+// process is exiting (see condition_wait_intr). For a thread in
+// the EDF class, each call ends a job and each wake-up releases the next one
+// (see thread_set_deadline).
+
+extern int alarm_sleep(struct alarm * al, uint64_t tcnt);
 
-extern void alarm_sleep(struct alarm * al, uint64_t tcnt);
+// Cancels a pending alarm, waking the thread sleeping on it early. Returns 1
+// if the alarm was pending, 0 if it had already expired or was not in use.
+// May be called from any thread or from an ISR.
+
+extern int alarm_cancel(struct alarm * al);
 
 // Resets the alarm so that the next sleep increment is relative to the time
 // of this function call.
@@ -39,23 +74,46 @@ extern void alarm_reset(struct alarm * al);
 
 extern void timer_intr_handler(struct trap_frame * tfr); // called from intr.c
 
-static inline void alarm_sleep_sec(struct alarm * al, unsigned int sec);
-static inline void alarm_sleep_ms(struct alarm * al, unsigned long ms);
-static inline void alarm_sleep_us(struct alarm * al, unsigned long us);
+// Reprograms this hart's timer after another hart changed its next event.
+// Only needed with Sstc, since a hart can then only write its own stimecmp.
+// Called from smp_ipi_handler.
+
+extern void timer_resync(void);
+
+// Returns the current value of the machine timer (mtime), which counts at
+// TIMER_FREQ and is shared by all harts.
+
+static inline uint64_t get_mtime(void);
+
+// Converts a span of mtime ticks to microseconds, for reports.
+
+static inline unsigned long ticks_to_us(uint64_t t);
+
+static inline int alarm_sleep_sec(struct alarm * al, unsigned int sec);
+static inline int alarm_sleep_ms(struct alarm * al, unsigned long ms);
+static inline int alarm_sleep_us(struct alarm * al, unsigned long us);
 
 // INLINE FUNCTION DEFINITIONS
 //
 
-static inline void alarm_sleep_sec(struct alarm * al, unsigned int sec) {
-    alarm_sleep(al, sec * TIMER_FREQ);
+static inline uint64_t get_mtime(void) {
+    return *(volatile uint64_t*)MTIME_ADDR;
+}
+
+static inline unsigned long ticks_to_us(uint64_t t) {
+    return t / (TIMER_FREQ / 1000 / 1000);
+}
+
+static inline int alarm_sleep_sec(struct alarm * al, unsigned int sec) {
+    return alarm_sleep(al, sec * TIMER_FREQ);
 }
 
-static inline void alarm_sleep_ms(struct alarm * al, unsigned long ms) {
-    alarm_sleep(al, ms * (TIMER_FREQ / 1000));
+static inline int alarm_sleep_ms(struct alarm * al, unsigned long ms) {
+    return alarm_sleep(al, ms * (TIMER_FREQ / 1000));
 }
 
-static inline void alarm_sleep_us(struct alarm * al, unsigned long us) {
-    alarm_sleep(al, us * (TIMER_FREQ / 1000 / 1000));
+static inline int alarm_sleep_us(struct alarm * al, unsigned long us) {
+    return alarm_sleep(al, us * (TIMER_FREQ / 1000 / 1000));
 }
 
 
@@ -61,4 +61,12 @@ extern void smode_excp_handler(unsigned int code, struct trap_frame * tfr);
 extern void umode_excp_handler(unsigned int code, struct trap_frame * tfr);
 extern void intr_handler(int code, struct trap_frame * tfr);
 
+// Used to probe for optional hardware features. Between trap_probe_begin() and
+// trap_probe_end(), an exception taken in S mode does not panic; the faulting
+// instruction is skipped instead. trap_probe_end() returns the number of
+// exceptions taken since trap_probe_begin(). Probes must not be nested.
+
+extern void trap_probe_begin(void);
+extern int trap_probe_end(void);
+
 #endif // _TRAP_H_
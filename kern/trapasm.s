@@ -53,11 +53,19 @@
 
         .macro  restore_sstatus_and_sepc
         # Restores sstatus and sepc from trap frame to which sp points. We use
-        # t6 as a temporary, so must be used after this macro, not before.
+        # t4, t5 and t6 as temporaries, so must be used after this macro, not
+        # before. The FS field is not restored: it describes the FP registers
+        # of the hart, which the thread manager may have saved and handed to
+        # another thread since the trap was taken (lazy FP, see thread.c).
 
         ld      t6, 33*8(sp)
         csrw    sepc, t6
         ld      t6, 32*8(sp)
+        li      t5, 0x6000      # sstatus.FS
+        csrr    t4, sstatus
+        xor     t4, t4, t6
+        and     t4, t4, t5
+        xor     t6, t6, t4      # FS from the live sstatus, rest from frame
         csrw    sstatus, t6
         .endm
 
@@ -185,6 +193,7 @@ _trap_entry_from_umode:
         .global _entry_from_fork
 
         _entry_from_fork:
+        csrci sstatus, 2              # Disable interrupts (SIE) before stvec points to the U mode entry
         la t0, _trap_entry_from_umode # Get the address of _trap_entry_from_umode
         csrw stvec, t0                # Set the trap handler address
 
@@ -229,54 +238,83 @@ trap_umode_cont:
 #      setting MTIE and clearing STIP.
 #   3. When a M mode timer interrupt occurs, we set STIP and clear MTIE. S mode
 #      then needs to re-arm timer interrupts using (2).
+#   4. Inter-processor interrupts are sent by writing a hart's MSIP register
+#      in the CLINT, which raises a M mode software interrupt on that hart. We
+#      clear MSIP and set SSIP, passing the interrupt on to S mode.
 #
+# mscratch points to a per-hart save area (see start.s), so several harts can
+# be in this handler at the same time.
 
 _mmode_trap_entry:
-        # Stash t0 away in mscratch
+        # Swap t0 with the save area pointer in mscratch and save t1 there
 
-        csrw    mscratch, t0
+        csrrw   t0, mscratch, t0
+        sd      t1, 0*8(t0)
 
-        csrr    t0, mcause
-        bgez    t0, mmode_excp_handler
+        csrr    t1, mcause
+        bgez    t1, mmode_excp_handler
 
-        # If it's not a timer interrupt, panic
+        slli    t1, t1, 1       # clear msb
+        srli    t1, t1, 1
 
-        addi    t0, t0, -7      # subtract 7
-        slli    t0, t0, 1       # clear msb
-        bnez    t0, unexpected_mmode_trap
+        addi    t1, t1, -7      # machine timer interrupt?
+        beqz    t1, mmode_intr_handler
+        addi    t1, t1, 4       # machine software interrupt (code 3)?
+        beqz    t1, mmode_soft_intr_handler
+
+        # Anything else is unexpected
+
+        j       unexpected_mmode_trap
 
 mmode_intr_handler:
 
         # Set STIP, clear MTIE
 
-        li      t0, 0x20        # STIP
-        csrs    mip, t0
-        slli    t0, t0, 2       # MTIE
-        csrc    mie, t0
+        li      t1, 0x20        # STIP
+        csrs    mip, t1
+        slli    t1, t1, 2       # MTIE
+        csrc    mie, t1
+        j       mmode_trap_done
+
+mmode_soft_intr_handler:
+
+        # Clear this hart's MSIP register (CLINT base + 4 * hartid), set SSIP
+
+        sd      t2, 1*8(t0)
+        csrr    t1, mhartid
+        slli    t1, t1, 2
+        li      t2, 0x2000000   # CLINT MSIP
+        add     t1, t1, t2
+        sw      zero, 0(t1)
+        ld      t2, 1*8(t0)
+
+        li      t1, 0x2         # SSIP
+        csrs    mip, t1
         j       mmode_trap_done
 
 mmode_excp_handler:
         # We support one S mode to M mode environment call, which is to re-arm
         # the timer interrupt.
 
-        addi    t0, t0, -9
-        bnez    t0, unexpected_mmode_trap
+        addi    t1, t1, -9
+        bnez    t1, unexpected_mmode_trap
 
         # Clear STIP, set MTIE
 
-        li      t0, 0x20        # STIP
-        csrc    mip, t0
-        slli    t0, t0, 2       # MTIE
-        csrs    mie, t0
+        li      t1, 0x20        # STIP
+        csrc    mip, t1
+        slli    t1, t1, 2       # MTIE
+        csrs    mie, t1
 
         # Advance mepc past ecall instruction
 
-        csrr    t0, mepc
-        addi    t0, t0, 4
-        csrw    mepc, t0
+        csrr    t1, mepc
+        addi    t1, t1, 4
+        csrw    mepc, t1
        
 mmode_trap_done:
-        csrr    t0, mscratch
+        ld      t1, 0*8(t0)
+        csrrw   t0, mscratch, t0
         mret
 
 
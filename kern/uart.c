@@ -186,6 +186,7 @@ long uart_read(struct io_intf * io, void * buf, unsigned long bufsz) {
 	struct uart_device * const dev =
 		(void*)io - offsetof(struct uart_device, io_intf);
 	char * p = buf; // position in buf to put next byte
+	int saved_intr_state;
 
 	trace("%s(buf=%p,bufsz=%ld)", __func__, buf, bufsz);
 	assert (io != NULL);
@@ -202,18 +203,24 @@ long uart_read(struct io_intf * io, void * buf, unsigned long bufsz) {
 	// be to try to read some data without disabling interrupts first, and
 	// only disabling them and waiting on the condition if we need to.
 	// 
-	// Check your understanding: why do we need to disable interrupts? Can we
-	// call condition_wait(&dev->rxavail) without disabling interrupts?
+	// Check your understanding: why do we need the thread manager lock? Can we
+	// call condition_wait(&dev->rxavail) without holding it?
 	// 
 	// Could we implement this as a busy-wait?
 	// 
 
-	intr_disable();
+	saved_intr_state = thrmgr_lock_acquire();
 
-	while (rbuf_empty(&dev->rxbuf))
-		condition_wait(&dev->rxbnotempty);
+	// A reader blocked here leaves if its process exits
 
-	intr_enable();
+	while (rbuf_empty(&dev->rxbuf)) {
+		if (condition_wait_intr(&dev->rxbnotempty) < 0) {
+			thrmgr_lock_release(saved_intr_state);
+			return -EINTR;
+		}
+	}
+
+	thrmgr_lock_release(saved_intr_state);
 
 	while (!rbuf_empty(&dev->rxbuf) && p - (char*)buf < bufsz)
 		*p++ = rbuf_get(&dev->rxbuf);
@@ -227,6 +234,7 @@ long uart_write(struct io_intf * io, const void * buf, unsigned long n) {
 	struct uart_device * const dev =
 		(void*)io - offsetof(struct uart_device, io_intf);
 	const char * p = buf; // position in buf to get next byte
+	int saved_intr_state;
 	
 	trace("%s(n=%ld)", __func__, n);
 	assert (io != NULL);
@@ -239,10 +247,10 @@ long uart_write(struct io_intf * io, const void * buf, unsigned long n) {
 	// Wait until there is room in the transmit ring buffer.
 
 	while (p - (char*)buf < n) {
-		intr_disable();
+		saved_intr_state = thrmgr_lock_acquire();
 		while (rbuf_full(&dev->txbuf))
 			condition_wait(&dev->txbnotfull);
-		intr_enable();
+		thrmgr_lock_release(saved_intr_state);
 
 		while (!rbuf_full(&dev->txbuf) && p - (char*)buf < n)
 			rbuf_put(&dev->txbuf, *p++);
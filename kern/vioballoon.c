@@ -0,0 +1,513 @@
+//           vioballoon.c - VirtIO memory balloon
+//
+//           The balloon lets the host reclaim guest memory we are not using. The host
+//           sets a target size (num_pages) in the device config space and raises a
+//           config change interrupt. We inflate the balloon by taking pages off the
+//           free page list and sending their page frame numbers on the inflate queue,
+//           and deflate it by sending page frame numbers on the deflate queue and
+//           returning the pages to the page allocator.
+//
+//           We do not negotiate VIRTIO_BALLOON_F_MUST_TELL_HOST, so when the page
+//           allocator runs out of memory it may take pages back out of the balloon
+//           immediately (see vioballoon_reclaim_page), without waiting for the device.
+//
+//           The balloon spends almost all its time waiting for the host, so it runs as
+//           a stackless kernel task (ktask.h) rather than a thread of its own. The
+//           state that must survive a wait lives in the device struct.
+
+#include "virtio.h"
+#include "intr.h"
+#include "halt.h"
+#include "heap.h"
+#include "error.h"
+#include "string.h"
+#include "thread.h"
+#include "ktask.h"
+#include "memory.h"
+#include "config.h"
+#include "cache.h"
+#include "spinlock.h"
+
+#include <stdint.h>
+
+//           COMPILE-TIME PARAMETERS
+//
+
+#define VIOBALLOON_IRQ_PRIO 1
+
+//           Maximum number of page frame numbers sent in one request (the Linux driver
+//           uses the same batch size).
+
+#ifndef BALLOON_BATCH
+#define BALLOON_BATCH 256
+#endif
+
+//           Number of free pages we always keep for ourselves, whatever the host asks.
+
+#ifndef BALLOON_MIN_FREE
+#define BALLOON_MIN_FREE 64
+#endif
+
+//           INTERNAL CONSTANT DEFINITIONS
+//
+
+//           VirtIO balloon device feature bits (number, *not* mask)
+
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST     0
+#define VIRTIO_BALLOON_F_STATS_VQ           1
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM     2
+
+//           Page frame numbers are always in 4 KB units, whatever our page size.
+
+#define VIRTIO_BALLOON_PFN_SHIFT 12
+
+#define INFLATEQ 0
+#define DEFLATEQ 1
+
+#define USED_BUF_NOTIF 1
+#define CONFIG_CHANGE_NOTIF 2
+
+//           Steps of the balloon task (see vioballoon_step)
+
+#define BALLOON_WAIT_CONFIG 0 // waiting for a new target from the host
+#define BALLOON_NEXT_BATCH 1 // moving towards the target
+#define BALLOON_WAIT_USED 2 // waiting for the device to take a batch
+
+#define RAM_PAGE_CNT (RAM_SIZE / PAGE_SIZE)
+
+//           INTERNAL TYPE DEFINITIONS
+//
+
+//           We use a simple scheme of one request at a time per queue, like vioblk.
+
+struct vioballoon_virtq {
+    union {
+        struct virtq_avail avail;
+        char _avail_filler[VIRTQ_AVAIL_SIZE(1)];
+    };
+
+    union {
+        volatile struct virtq_used used;
+        char _used_filler[VIRTQ_USED_SIZE(1)];
+    };
+
+    struct virtq_desc desc[1] __attribute__ ((aligned(16)));
+};
+
+struct vioballoon_device {
+    volatile struct virtio_mmio_regs * regs;
+    uint16_t irqno;
+
+    //           signaled from ISR
+    struct condition used_updated;
+    struct condition config_changed;
+    int8_t config_pending;
+
+    struct vioballoon_virtq vq[2];
+
+    //           Page frame numbers of the request in flight
+    uint32_t pfns[BALLOON_BATCH];
+
+    //           Balloon task and its state between steps: the target being worked
+    //           towards and the batch in flight (queue and page count)
+    struct ktask task;
+    int8_t step;
+    uint32_t target;
+    int batch_qid;
+    uint32_t batch_cnt;
+
+    //           Protects actual, reclaimed and inflated; vioballoon_reclaim_page
+    //           may be called on any hart.
+    struct spinlock lock;
+
+    //           Number of pages in the balloon
+    uint32_t actual;
+    //           Number of pages taken back by vioballoon_reclaim_page
+    uint32_t reclaimed;
+
+    //           One bit per page of RAM; set if the page is in the balloon.
+    uint64_t inflated[(RAM_PAGE_CNT + 63) / 64];
+};
+
+//           INTERNAL GLOBAL VARIABLES
+//
+
+//           There is at most one balloon (the page allocator needs to find it).
+
+static struct vioballoon_device * balloon;
+
+//           INTERNAL FUNCTION DECLARATIONS
+//
+
+static void vioballoon_isr(int irqno, void * aux);
+static int vioballoon_step(struct ktask * task);
+
+static int vioballoon_next_batch(struct vioballoon_device * dev);
+static uint32_t vioballoon_inflate(struct vioballoon_device * dev, uint32_t cnt);
+static uint32_t vioballoon_deflate(struct vioballoon_device * dev, uint32_t cnt);
+static void vioballoon_finish_batch(struct vioballoon_device * dev);
+
+static void vioballoon_send (
+    struct vioballoon_device * dev, int qid, uint32_t cnt);
+
+static inline uint32_t page_to_pfn(const void * pp);
+static inline void * pfn_to_page(uint32_t pfn);
+static inline uint_fast32_t page_index(const void * pp);
+
+//           EXPORTED FUNCTION DEFINITIONS
+//
+
+//           Attaches a VirtIO balloon device. Declared and called directly from virtio.c.
+/*
+vioballoon_attach negotiates features with the device, sets up the inflate and
+deflate queues, registers the ISR and starts the balloon task, which does all
+inflating and deflating. Nothing is inflated until the host asks for it.
+inputs: volatile struct virtio_mmio_regs * regs, irqno
+outputs: none
+*/
+void vioballoon_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
+    virtio_featset_t enabled_features, wanted_features, needed_features;
+    struct vioballoon_device * dev;
+    int result;
+    int qid;
+
+    assert (regs->device_id == VIRTIO_ID_BALLOON);
+
+    if (balloon != NULL) {
+        kprintf("%p: second virtio balloon ignored\n", regs);
+        return;
+    }
+
+    //           Signal device that we found a driver
+
+    regs->status |= VIRTIO_STAT_DRIVER;
+    //           fence o,io
+    __sync_synchronize();
+
+    //           We need nothing. We want VIRTIO_BALLOON_F_DEFLATE_ON_OOM, which tells
+    //           the host we will take pages back when we run out of memory.
+
+    virtio_featset_init(needed_features);
+    virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_BALLOON_F_DEFLATE_ON_OOM);
+    result = virtio_negotiate_features(regs,
+        enabled_features, wanted_features, needed_features);
+
+    if (result != 0) {
+        kprintf("%p: virtio feature negotiation failed\n", regs);
+        return;
+    }
+
+    dev = kmalloc(sizeof(struct vioballoon_device));
+    memset(dev, 0, sizeof(struct vioballoon_device));
+
+    dev->regs = regs;
+    dev->irqno = irqno;
+    condition_init(&dev->used_updated, "balloon.used_updated");
+    condition_init(&dev->config_changed, "balloon.config_changed");
+    spinlock_init(&dev->lock, "balloon");
+
+    //           Check the current target once the task starts.
+    dev->config_pending = 1;
+    dev->step = BALLOON_WAIT_CONFIG;
+    ktask_setup(&dev->task, "balloon", vioballoon_step, dev);
+
+    for (qid = INFLATEQ; qid <= DEFLATEQ; qid++) {
+        //           Page frame numbers are device-readable
+        dev->vq[qid].desc[0].addr = (uint64_t)(uintptr_t)dev->pfns;
+        dev->vq[qid].desc[0].flags = 0;
+        dev->vq[qid].desc[0].next = 0;
+
+        virtio_attach_virtq(regs, qid, 1,
+            (uint64_t)(uintptr_t)dev->vq[qid].desc,
+            (uint64_t)(uintptr_t)&dev->vq[qid].used,
+            (uint64_t)(uintptr_t)&dev->vq[qid].avail);
+        virtio_enable_virtq(regs, qid);
+    }
+
+    intr_register_isr(irqno, VIOBALLOON_IRQ_PRIO, vioballoon_isr, dev);
+    intr_enable_irq(irqno);
+
+    balloon = dev;
+
+    regs->status |= VIRTIO_STAT_DRIVER_OK;
+    //           fence o,oi
+    __sync_synchronize();
+
+    ktask_init();
+    ktask_start(&dev->task);
+
+    kprintf("%p: virtio balloon attached (deflate on oom: %s)\n", regs,
+        virtio_featset_test(enabled_features,
+            VIRTIO_BALLOON_F_DEFLATE_ON_OOM) ? "yes" : "no");
+}
+
+//           Called by the page allocator when the free page list is empty. Takes a
+//           page out of the balloon without telling the device first, which is
+//           allowed because we did not negotiate VIRTIO_BALLOON_F_MUST_TELL_HOST.
+//           The contents of the page are undefined. Returns NULL if the balloon is
+//           empty.
+
+void * vioballoon_reclaim_page(void) {
+    struct vioballoon_device * const dev = balloon;
+    uint_fast32_t i;
+    int saved_intr_state;
+    void * pp = NULL;
+
+    if (dev == NULL || dev->actual == 0)
+        return NULL;
+
+    saved_intr_state = spinlock_acquire(&dev->lock);
+
+    for (i = 0; i < sizeof(dev->inflated)/sizeof(dev->inflated[0]); i++) {
+        if (dev->inflated[i] != 0) {
+            i = 64 * i + __builtin_ctzl(dev->inflated[i]);
+            dev->inflated[i / 64] &= ~(UINT64_C(1) << (i % 64));
+            pp = RAM_START + i * PAGE_SIZE;
+            break;
+        }
+    }
+
+    if (pp != NULL) {
+        dev->actual -= 1;
+        dev->reclaimed += 1;
+        dev->regs->config.balloon.actual = dev->actual;
+    }
+
+    spinlock_release(&dev->lock, saved_intr_state);
+
+    return pp;
+}
+
+//           Returns the number of pages vioballoon_reclaim_page could take back.
+//           Used to size up a fork before the copy starts.
+
+size_t vioballoon_reclaimable_count(void) {
+    struct vioballoon_device * const dev = balloon;
+
+    return (dev != NULL) ? dev->actual : 0;
+}
+
+//           INTERNAL FUNCTION DEFINITIONS
+//
+
+/*
+The ISR wakes the balloon task on a configuration change (new target size) and
+when the device returns a request on a used buffer notification.
+inputs: irqno, aux
+outputs: none
+*/
+void vioballoon_isr(int irqno, void * aux) {
+    struct vioballoon_device * const dev = aux;
+    const uint32_t status = dev->regs->interrupt_status;
+
+    if (status & USED_BUF_NOTIF) {
+        cache_dma_flush((void*)&dev->vq[INFLATEQ].used, sizeof(dev->vq[0].used));
+        cache_dma_flush((void*)&dev->vq[DEFLATEQ].used, sizeof(dev->vq[0].used));
+        condition_broadcast(&dev->used_updated);
+    }
+
+    if (status & CONFIG_CHANGE_NOTIF) {
+        dev->config_pending = 1;
+        condition_broadcast(&dev->config_changed);
+    }
+
+    dev->regs->interrupt_ack = status;
+}
+
+/*
+Runs the balloon task until it has to wait. The task waits for the host to set
+a new target, then moves the balloon towards it one batch at a time, waiting
+for the device to take each batch. Inflating stops early if we would drop below
+BALLOON_MIN_FREE free pages.
+inputs: task
+outputs: KTASK_WAIT
+*/
+int vioballoon_step(struct ktask * task) {
+    struct vioballoon_device * const dev = task->arg;
+    struct vioballoon_virtq * vq;
+    int saved_intr_state;
+
+    for (;;) {
+        switch (dev->step) {
+        case BALLOON_WAIT_CONFIG:
+            saved_intr_state = thrmgr_lock_acquire();
+            if (!dev->config_pending) {
+                ktask_wait(task, &dev->config_changed);
+                thrmgr_lock_release(saved_intr_state);
+                return KTASK_WAIT;
+            }
+            dev->config_pending = 0;
+            thrmgr_lock_release(saved_intr_state);
+
+            dev->target = dev->regs->config.balloon.num_pages;
+            dev->step = BALLOON_NEXT_BATCH;
+            break;
+
+        case BALLOON_NEXT_BATCH:
+            if (vioballoon_next_batch(dev))
+                dev->step = BALLOON_WAIT_USED;
+            else {
+                dev->regs->config.balloon.actual = dev->actual;
+                debug("balloon: target %u pages, actual %u pages, %u reclaimed",
+                    (unsigned int)dev->target, (unsigned int)dev->actual,
+                    (unsigned int)dev->reclaimed);
+                dev->step = BALLOON_WAIT_CONFIG;
+            }
+            break;
+
+        case BALLOON_WAIT_USED:
+            vq = &dev->vq[dev->batch_qid];
+            saved_intr_state = thrmgr_lock_acquire();
+            if (vq->avail.idx != vq->used.idx) {
+                ktask_wait(task, &dev->used_updated);
+                thrmgr_lock_release(saved_intr_state);
+                return KTASK_WAIT;
+            }
+            thrmgr_lock_release(saved_intr_state);
+
+            vioballoon_finish_batch(dev);
+            dev->step = BALLOON_NEXT_BATCH;
+            break;
+        }
+    }
+}
+
+//           Sends the next batch of pages towards dev->target on the inflate or
+//           deflate queue. Returns 1 if a batch was sent, 0 if the balloon is at its
+//           target or cannot get closer to it.
+
+int vioballoon_next_batch(struct vioballoon_device * dev) {
+    uint32_t cnt;
+
+    if (dev->actual < dev->target) {
+        cnt = dev->target - dev->actual;
+        if (BALLOON_BATCH < cnt)
+            cnt = BALLOON_BATCH;
+        dev->batch_qid = INFLATEQ;
+        dev->batch_cnt = vioballoon_inflate(dev, cnt);
+    } else if (dev->target < dev->actual) {
+        cnt = dev->actual - dev->target;
+        if (BALLOON_BATCH < cnt)
+            cnt = BALLOON_BATCH;
+        dev->batch_qid = DEFLATEQ;
+        dev->batch_cnt = vioballoon_deflate(dev, cnt);
+    } else
+        dev->batch_cnt = 0;
+
+    return (dev->batch_cnt != 0);
+}
+
+//           Sends up to /cnt/ free pages to the host on the inflate queue. Returns the
+//           number of pages sent; vioballoon_finish_batch adds them to the balloon
+//           once the device has taken them.
+
+uint32_t vioballoon_inflate(struct vioballoon_device * dev, uint32_t cnt) {
+    uint32_t n = 0;
+    void * pp;
+
+    while (n < cnt && BALLOON_MIN_FREE < memory_free_page_count()) {
+        pp = memory_reserve_page();
+        if (pp == NULL)
+            break;
+        dev->pfns[n++] = page_to_pfn(pp);
+    }
+
+    if (n == 0)
+        return 0;
+
+    vioballoon_send(dev, INFLATEQ, n);
+    return n;
+}
+
+//           Takes up to /cnt/ pages out of the balloon and sends them on the deflate
+//           queue. Returns the number of pages removed from the balloon;
+//           vioballoon_finish_batch returns them to the page allocator once the device
+//           has let go of them.
+
+uint32_t vioballoon_deflate(struct vioballoon_device * dev, uint32_t cnt) {
+    uint_fast32_t i, idx;
+    uint32_t n = 0;
+    int saved_intr_state;
+
+    //           Remove the pages from the balloon before telling the device, so that
+    //           vioballoon_reclaim_page cannot hand them out a second time.
+
+    saved_intr_state = spinlock_acquire(&dev->lock);
+
+    for (i = 0; n < cnt && i < sizeof(dev->inflated)/sizeof(dev->inflated[0]);) {
+        if (dev->inflated[i] == 0) {
+            i += 1;
+            continue;
+        }
+
+        idx = 64 * i + __builtin_ctzl(dev->inflated[i]);
+        dev->inflated[i] &= ~(UINT64_C(1) << (idx % 64));
+        dev->pfns[n++] = page_to_pfn(RAM_START + idx * PAGE_SIZE);
+    }
+
+    dev->actual -= n;
+    spinlock_release(&dev->lock, saved_intr_state);
+
+    if (n == 0)
+        return 0;
+
+    vioballoon_send(dev, DEFLATEQ, n);
+    return n;
+}
+
+//           Completes the batch the device has just returned.
+
+void vioballoon_finish_batch(struct vioballoon_device * dev) {
+    uint_fast32_t i, idx;
+    int saved_intr_state;
+
+    if (dev->batch_qid == DEFLATEQ) {
+        for (i = 0; i < dev->batch_cnt; i++)
+            memory_free_page(pfn_to_page(dev->pfns[i]));
+        return;
+    }
+
+    //           The pages belong to the host now; only vioballoon_reclaim_page and
+    //           vioballoon_deflate may hand them back out.
+
+    saved_intr_state = spinlock_acquire(&dev->lock);
+
+    for (i = 0; i < dev->batch_cnt; i++) {
+        idx = page_index(pfn_to_page(dev->pfns[i]));
+        dev->inflated[idx / 64] |= UINT64_C(1) << (idx % 64);
+    }
+
+    dev->actual += dev->batch_cnt;
+    spinlock_release(&dev->lock, saved_intr_state);
+}
+
+//           Sends the first /cnt/ entries of dev->pfns on queue /qid/. The balloon task
+//           waits for the device to return the buffer.
+
+void vioballoon_send(struct vioballoon_device * dev, int qid, uint32_t cnt) {
+    struct vioballoon_virtq * const vq = &dev->vq[qid];
+
+    vq->desc[0].len = cnt * sizeof(dev->pfns[0]);
+
+    vq->avail.ring[vq->avail.idx % 1] = 0;
+    __sync_synchronize();
+    vq->avail.idx++;
+    __sync_synchronize();
+    cache_dma_clean(dev->pfns, cnt * sizeof(dev->pfns[0]));
+    cache_dma_clean(vq, sizeof(struct vioballoon_virtq));
+
+    virtio_notify_avail(dev->regs, qid);
+}
+
+static inline uint32_t page_to_pfn(const void * pp) {
+    return (uintptr_t)pp >> VIRTIO_BALLOON_PFN_SHIFT;
+}
+
+static inline void * pfn_to_page(uint32_t pfn) {
+    return (void*)((uintptr_t)pfn << VIRTIO_BALLOON_PFN_SHIFT);
+}
+
+static inline uint_fast32_t page_index(const void * pp) {
+    return (pp - RAM_START) / PAGE_SIZE;
+}
@@ -12,6 +12,8 @@
 #include "thread.h"
 #include "plic.h"
 #include "lock.h"
+#include "cache.h"
+#include "workq.h"
 
 //           COMPILE-TIME PARAMETERS
 //          
@@ -114,6 +116,9 @@ struct vioblk_device {
 
     //          Lock
     struct lock RWLock;
+
+    //          Feature renegotiation after a config change, run on the system work queue
+    struct work config_work;
 };
 
 //           INTERNAL FUNCTION DECLARATIONS
@@ -138,6 +143,8 @@ static int vioblk_ioctl (
 
 static void vioblk_isr(int irqno, void * aux);
 
+static void vioblk_config_work(void * aux);
+
 //           IOCTLs
 
 static int vioblk_getlen(const struct vioblk_device * dev, uint64_t * lenptr);
@@ -269,6 +276,10 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     //          Initialize the lock
     lock_init(&dev->RWLock, "VIOLock");
 
+    //          Config change work runs on the system work queue
+    workq_init();
+    work_init(&dev->config_work, vioblk_config_work, dev);
+
     //register the ISR
     intr_register_isr(irqno, VIOBLK_IRQ_PRIO, vioblk_isr, dev);
 
@@ -401,16 +412,17 @@ long vioblk_read (
         __sync_synchronize();
         dev->vq.avail.idx++;
         __sync_synchronize();
+        cache_dma_clean(&dev->vq, sizeof(dev->vq));
 
         //          Notify the device that we have placed a buffer on avail
         virtio_notify_avail(dev->regs, VQ_NUM);
 
-        //          Thread sleeps until the device puts buf onto used (also disable interrupts)
-        intr_status = intr_disable();
+        //          Thread sleeps until the device puts buf onto used (holding the thread manager lock)
+        intr_status = thrmgr_lock_acquire();
         while(dev->vq.avail.idx != dev->vq.used.idx){
             condition_wait(&dev->vq.used_updated);
         }
-        intr_restore(intr_status);
+        thrmgr_lock_release(intr_status);
 
         //          Check status for successful read
         if(dev->vq.req_status != VIRTIO_BLK_S_OK) {
@@ -418,6 +430,7 @@ long vioblk_read (
             return -EIO;
         }
         //          Data is now in block buffer cache, write to buf
+        cache_dma_flush(dev->blkbuf, dev->blksz);
         memcpy(buf + bytes_read, dev->blkbuf + block_position, curr_read_size);
 
         //          Update variables to move onto next iteration or finish
@@ -503,16 +516,18 @@ long vioblk_write (
         dev->vq.avail.ring[dev->vq.avail.idx % 1] = 0;
         dev->vq.avail.idx++;
         __sync_synchronize();
+        cache_dma_clean(&dev->vq, sizeof(dev->vq));
+        cache_dma_clean(dev->blkbuf, dev->blksz);
 
         //          Notify the device that we have placed a buffer on avail
         virtio_notify_avail(dev->regs, VQ_NUM);   
 
         //          Thread sleeps until the device puts buf onto used
-        intr_status = intr_disable();
+        intr_status = thrmgr_lock_acquire();
         while(dev->vq.avail.idx != dev->vq.used.idx){
             condition_wait(&dev->vq.used_updated);
         }
-        intr_restore(intr_status);
+        thrmgr_lock_release(intr_status);
 
         //          Check status for successful read
         if(dev->vq.req_status != VIRTIO_BLK_S_OK) {
@@ -570,8 +585,6 @@ void vioblk_isr(int irqno, void * aux) {
     //          Variable Declarations
     #define USED_BUF_NOTIF 1
     #define CONFIG_CHANGE_NOTIF 2
-    virtio_featset_t enabled_features, wanted_features, needed_features;
-    int result;
 
     //          Gain access to the device, aux is the device pointer as specified in virtblk_attach
     struct vioblk_device * const dev = (struct vioblk_device *)(aux);
@@ -579,30 +592,48 @@ void vioblk_isr(int irqno, void * aux) {
 
     //          ISR signaled from used buffer filling, signal used_updated
     if(status == USED_BUF_NOTIF ){
+        //          Device wrote the used ring and the status byte
+        cache_dma_flush((void*)&dev->vq.used, sizeof(dev->vq.used));
+        cache_dma_flush(&dev->vq.req_status, sizeof(dev->vq.req_status));
         condition_broadcast(&dev->vq.used_updated);
     }
 
-    //          ISR signaled from configuration change, re-negotiate features
-    if(status == CONFIG_CHANGE_NOTIF){
-        virtio_featset_init(needed_features);
-        virtio_featset_add(needed_features, VIRTIO_F_RING_RESET);
-        virtio_featset_add(needed_features, VIRTIO_F_INDIRECT_DESC);
-        virtio_featset_init(wanted_features);
-        virtio_featset_add(wanted_features, VIRTIO_BLK_F_BLK_SIZE);
-        virtio_featset_add(wanted_features, VIRTIO_BLK_F_TOPOLOGY);
-        result = virtio_negotiate_features(dev->regs,
-        enabled_features, wanted_features, needed_features);
-
-        if (result != 0) {
-            kprintf("%p: virtio feature negotiation failed\n", dev->regs);
-            return;
-        }
-    }
+    //          ISR signaled from configuration change, re-negotiate features outside of interrupt context
+    if(status == CONFIG_CHANGE_NOTIF)
+        work_queue(&system_wq, &dev->config_work);
 
     //          Signal to the device that we handled the interrupt by writing to intr_ack
     dev->regs->interrupt_ack = status;
 }
 
+/*
+This function runs on the system work queue after a config change interrupt. It re-negotiates features
+with the device, holding the device lock so that no request is in flight meanwhile.
+inputs: aux
+outputs: none
+*/
+void vioblk_config_work(void * aux) {
+    struct vioblk_device * const dev = (struct vioblk_device *)(aux);
+    virtio_featset_t enabled_features, wanted_features, needed_features;
+    int result;
+
+    lock_acquire(&dev->RWLock);
+
+    virtio_featset_init(needed_features);
+    virtio_featset_add(needed_features, VIRTIO_F_RING_RESET);
+    virtio_featset_add(needed_features, VIRTIO_F_INDIRECT_DESC);
+    virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_BLK_SIZE);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_TOPOLOGY);
+    result = virtio_negotiate_features(dev->regs,
+    enabled_features, wanted_features, needed_features);
+
+    lock_release(&dev->RWLock);
+
+    if (result != 0)
+        kprintf("%p: virtio feature negotiation failed\n", dev->regs);
+}
+
 /*
 Put the device size in bytes into lenptr
 inputs: dev, lenptr
@@ -107,6 +107,13 @@ struct virtio_mmio_regs {
             uint32_t max_secure_erase_seg;
             uint32_t secure_erase_sector_alignment;
         } blk;
+        //           Memory balloon device config
+        struct {
+            uint32_t num_pages;
+            uint32_t actual;
+            uint32_t free_page_hint_cmd_id;
+            uint32_t poison_val;
+        } balloon;
         uint8_t raw[0];
     } config;
 };
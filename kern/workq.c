@@ -0,0 +1,163 @@
+// workq.c - Deferred work queues
+//
+
+#ifdef WORKQ_TRACE
+#define TRACE
+#endif
+
+#ifdef WORKQ_DEBUG
+#define DEBUG
+#endif
+
+#include "workq.h"
+#include "thread.h"
+#include "timer.h"
+#include "console.h"
+#include "halt.h"
+
+#include <stddef.h>
+
+// EXPORTED GLOBAL VARIABLE DEFINITIONS
+//
+
+struct workq system_wq;
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static char workq_initialized = 0;
+
+// Started queues, newest first. Queues are never stopped.
+
+static struct workq * workq_list;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void workq_worker(void * aux);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void workq_init(void) {
+    if (workq_initialized)
+        return;
+
+    workq_initialized = 1;
+    workq_start(&system_wq, "syswq");
+}
+
+void workq_start(struct workq * wq, const char * name) {
+    int saved_intr_state;
+    int tid;
+
+    trace("%s(%s)", __func__, name);
+
+    wq->name = name;
+    wq->head = NULL;
+    wq->tail = NULL;
+    condition_init(&wq->not_empty, name);
+    wq->queued_cnt = 0;
+    wq->run_cnt = 0;
+    wq->latency_max = 0;
+    wq->run_max = 0;
+
+    saved_intr_state = thrmgr_lock_acquire();
+    wq->next = workq_list;
+    workq_list = wq;
+    thrmgr_lock_release(saved_intr_state);
+
+    tid = thread_spawn(name, workq_worker, wq);
+    if (tid < 0)
+        panic("workq_start: thread_spawn failed");
+}
+
+void work_init(struct work * w, void (*func)(void * arg), void * arg) {
+    w->func = func;
+    w->arg = arg;
+    w->next = NULL;
+    w->queued_at = 0;
+    w->pending = 0;
+}
+
+int work_queue(struct workq * wq, struct work * w) {
+    int saved_intr_state;
+
+    saved_intr_state = thrmgr_lock_acquire();
+
+    if (w->pending) {
+        thrmgr_lock_release(saved_intr_state);
+        return 0;
+    }
+
+    w->pending = 1;
+    w->next = NULL;
+    w->queued_at = get_mtime();
+
+    if (wq->tail != NULL)
+        wq->tail->next = w;
+    else
+        wq->head = w;
+    wq->tail = w;
+
+    wq->queued_cnt++;
+    condition_signal(&wq->not_empty);
+
+    thrmgr_lock_release(saved_intr_state);
+    return 1;
+}
+
+void workq_report(void) {
+    const struct workq * wq;
+
+    kprintf("workq       queued       run  max wait us   max run us\n");
+
+    for (wq = workq_list; wq != NULL; wq = wq->next) {
+        kprintf("%8s  %8lu  %8lu  %11lu  %11lu\n", wq->name,
+            wq->queued_cnt, wq->run_cnt,
+            ticks_to_us(wq->latency_max), ticks_to_us(wq->run_max));
+    }
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void workq_worker(void * aux) {
+    struct workq * const wq = aux;
+    int saved_intr_state;
+    struct work * w;
+    uint64_t t0, t1;
+
+    for (;;) {
+        saved_intr_state = thrmgr_lock_acquire();
+
+        while (wq->head == NULL)
+            condition_wait(&wq->not_empty);
+
+        w = wq->head;
+        wq->head = w->next;
+        if (wq->head == NULL)
+            wq->tail = NULL;
+
+        // Once it is off the queue, the item may be queued again, even by its
+        // own work function.
+
+        w->pending = 0;
+        t0 = get_mtime();
+        if (wq->latency_max < t0 - w->queued_at)
+            wq->latency_max = t0 - w->queued_at;
+
+        thrmgr_lock_release(saved_intr_state);
+
+        debug("%s: running work %p", wq->name, w);
+        w->func(w->arg);
+
+        t1 = get_mtime();
+
+        saved_intr_state = thrmgr_lock_acquire();
+        wq->run_cnt++;
+        if (wq->run_max < t1 - t0)
+            wq->run_max = t1 - t0;
+        thrmgr_lock_release(saved_intr_state);
+    }
+}
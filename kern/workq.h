@@ -0,0 +1,81 @@
+// workq.h - Deferred work queues
+//
+
+#ifndef _WORKQ_H_
+#define _WORKQ_H_
+
+#include "thread.h" // struct condition
+
+#include <stdint.h>
+
+// A work queue runs work items, queued from threads or ISRs, on a dedicated
+// worker thread. ISRs use it for anything longer than acknowledging the device
+// and waking a thread, so that they run with interrupts disabled for as short
+// a time as possible. Work functions run in thread context and may sleep,
+// e.g. to take a device lock.
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// A work item is owned by its submitter and must stay valid while pending.
+// Queuing an item that is already pending does nothing, so an ISR that fires
+// repeatedly before the work runs causes a single run.
+
+struct work {
+    void (*func)(void * arg);
+    void * arg;
+    struct work * next;
+    uint64_t queued_at; // mtime of work_queue, for the latency statistics
+    char pending; // queued and not yet started
+};
+
+// The queue and its statistics are protected by the thread manager lock.
+
+struct workq {
+    const char * name;
+    struct work * head;
+    struct work * tail;
+    struct condition not_empty; // the worker waits here
+    struct workq * next; // list of started queues, for workq_report
+    unsigned long queued_cnt; // items queued
+    unsigned long run_cnt; // items run
+    uint64_t latency_max; // longest time from work_queue to start of run
+    uint64_t run_max; // longest run of a work function
+};
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+// The system work queue, started by workq_init. Drivers queue their deferred
+// interrupt work here.
+
+extern struct workq system_wq;
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Starts the system work queue. Must be called after thread_init; calls after
+// the first do nothing, so drivers that depend on the queue call it in their
+// attach function.
+
+extern void workq_init(void);
+
+// Initializes /wq/ and spawns its worker thread, named /name/.
+
+extern void workq_start(struct workq * wq, const char * name);
+
+// Initializes a work item that calls /func/(/arg/) when run.
+
+extern void work_init(struct work * w, void (*func)(void * arg), void * arg);
+
+// Appends /w/ to /wq/ unless it is already pending, and wakes the worker.
+// Returns 1 if the item was queued, 0 if it was pending. May be called from an
+// ISR.
+
+extern int work_queue(struct workq * wq, struct work * w);
+
+// Prints the statistics of every started work queue to the console.
+
+extern void workq_report(void);
+
+#endif // _WORKQ_H_
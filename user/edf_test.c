@@ -0,0 +1,123 @@
+// edf_test.c - Periodic task under the deadline (EDF) scheduling class
+//
+// Runs a periodic task that wakes every PERIOD_US, spins for WORK_US and must
+// be done within DEADLINE_US of its release, while HOG_CNT CPU-bound
+// processes at the highest priority keep every hart busy. The task runs once
+// as an ordinary thread, sharing the harts round-robin with the hogs, and
+// once in the EDF class, where it runs ahead of them. The test counts the
+// jobs that finished late itself, and in the EDF run also prints the misses
+// counted by the kernel. It also checks that _setdeadline rejects bad
+// parameters and a task that does not fit on the hart.
+
+#include "syscall.h"
+#include "string.h"
+#include "error.h"
+
+#include <stdint.h>
+
+#define HOG_CNT 8 // more than there are harts
+#define JOB_CNT 100
+#define PERIOD_US 10000
+#define DEADLINE_US 6000
+#define BUDGET_US 4000
+#define WORK_US 2000
+
+static unsigned int run_jobs(void);
+static void check_admission(void);
+static void spin_until(uint64_t t);
+
+void main(void) {
+    char linebuf[128];
+    struct rusage ru;
+    unsigned int late_normal, late_edf;
+    uint64_t deadline;
+    int result;
+    int i;
+
+    check_admission();
+
+    // The hogs spin for longer than both runs should take
+
+    deadline = rdtime() + US_TO_TICKS(3UL * JOB_CNT * PERIOD_US);
+
+    for (i = 0; i < HOG_CNT; i++) {
+        if (_fork() == 0) {
+            _setpriority(0);
+            spin_until(deadline);
+            _exit();
+        }
+    }
+
+    _setpriority(0);
+    late_normal = run_jobs();
+
+    result = _setdeadline(PERIOD_US, BUDGET_US, DEADLINE_US);
+    if (result < 0) {
+        snprintf(linebuf, sizeof(linebuf),
+            "edf_test: _setdeadline failed (%d)\n", result);
+        _msgout(linebuf);
+        _exit();
+    }
+
+    late_edf = run_jobs();
+    _getrusage(-1, &ru);
+    _setdeadline(0, 0, 0);
+
+    for (i = 0; i < HOG_CNT; i++)
+        _wait(0);
+
+    snprintf(linebuf, sizeof(linebuf),
+        "edf_test: normal class: %u of %d jobs late\n", late_normal, JOB_CNT);
+    _msgout(linebuf);
+    snprintf(linebuf, sizeof(linebuf),
+        "edf_test: EDF class: %u of %d jobs late, kernel counted %lu misses "
+        "in %lu jobs\n", late_edf, JOB_CNT, ru.edf_misses, ru.edf_jobs);
+    _msgout(linebuf);
+
+    _kreport(KREPORT_EDF | KREPORT_SMP);
+    _exit();
+}
+
+// Runs JOB_CNT jobs released every PERIOD_US and returns the number that
+// finished more than DEADLINE_US after their release.
+
+unsigned int run_jobs(void) {
+    uint64_t release, now;
+    unsigned int late = 0;
+    int i;
+
+    release = rdtime();
+
+    for (i = 0; i < JOB_CNT; i++) {
+        spin_until(rdtime() + US_TO_TICKS(WORK_US));
+
+        now = rdtime();
+        if (release + US_TO_TICKS(DEADLINE_US) < now)
+            late++;
+
+        release += US_TO_TICKS(PERIOD_US);
+        if (now < release)
+            _usleep((release - now) / US_TO_TICKS(1));
+    }
+
+    return late;
+}
+
+void check_admission(void) {
+    char linebuf[128];
+    int r1, r2, r3;
+
+    r1 = _setdeadline(PERIOD_US, DEADLINE_US + 1, DEADLINE_US);
+    r2 = _setdeadline(PERIOD_US, BUDGET_US, PERIOD_US + 1);
+    r3 = _setdeadline(PERIOD_US, PERIOD_US, PERIOD_US); // wants all of a hart
+
+    snprintf(linebuf, sizeof(linebuf),
+        "edf_test: admission checks %s\n",
+        (r1 == -EINVAL && r2 == -EINVAL && r3 == -EBUSY) ? "passed" : "FAILED");
+    _msgout(linebuf);
+}
+
+void spin_until(uint64_t t) {
+    while (rdtime() < t)
+        continue;
+}
@@ -1,11 +1,15 @@
 #include "syscall.h"
 #include "string.h"
 #include "stdint.h"
+#include "error.h"
 
 #define FILE_FID 1
+#define CHILD_SLEEP_US 2000000 // keeps the children around until forks fail
 
-void main(void) {   //Test to show 31 fork capacity
+void main(void) {   //Test that a fork storm fails forks with -EAGAIN instead of halting
+    char linebuf[128];
     int result;
+    int cnt;
     _msgout("Beginning fork overflow test:\n");
 
     // Open ser1 device as fd=0
@@ -20,7 +24,23 @@ void main(void) {   //Test to show 31 fork capacity
         _exit();
     }
 
-    for(int i=0; i<5; i++){ //Fork 32 times (2^5)
-        _fork();
+    for(cnt = 0; ; cnt++){ //Fork until the kernel runs out of processes or memory
+        result = _fork();
+        if(result == 0){ // child: hold on to the slot for a while
+            _usleep(CHILD_SLEEP_US);
+            _exit();
+        }
+        if(result < 0)
+            break;
     }
-}
\ No newline at end of file
+
+    snprintf(linebuf, sizeof(linebuf), "fork failed after %d children with %s\n",
+        cnt, (result == -EAGAIN) ? "-EAGAIN" : "an unexpected error");
+    _msgout(linebuf);
+
+    while(cnt-- > 0) // reap the children
+        _wait(0);
+
+    _msgout("fork overflow test done\n");
+    _exit();
+}
@@ -0,0 +1,96 @@
+// fp_bench.c - Context switch cost with lazy FP switching
+//
+// Runs WORKER_CNT processes that do nothing but _yield, so that almost all of
+// the time goes to context switches, and reports the cost of a switch in three
+// mixes: no worker uses FP, one worker does, and all of them do. The kernel
+// saves and loads FP registers only for threads that use them, so the first
+// two should cost about the same, and only the last should pay for moving the
+// FP registers. FP workers keep a running sum in an FP register across the
+// yields and check it at the end, which catches registers that were not saved
+// or were restored from the wrong thread.
+
+#include "syscall.h"
+#include "string.h"
+
+#include <stdint.h>
+
+#define WORKER_CNT 8 // more than there are harts
+#define ITER_CNT 2000
+
+static void run(const char * label, int fp_cnt);
+static void int_worker(void);
+static void fp_worker(int id);
+
+void main(void) {
+    run("no fp", 0);
+    run("one fp", 1);
+    run("all fp", WORKER_CNT);
+    _kreport(KREPORT_SMP);
+    _exit();
+}
+
+void run(const char * label, int fp_cnt) {
+    struct lockstat st0, st1;
+    char linebuf[128];
+    unsigned long sw;
+    uint64_t t0, t1;
+    int i;
+
+    _lockstat(&st0);
+    t0 = rdtime();
+
+    for (i = 0; i < WORKER_CNT; i++) {
+        if (_fork() == 0) {
+            if (i < fp_cnt)
+                fp_worker(i);
+            else
+                int_worker();
+        }
+    }
+
+    for (i = 0; i < WORKER_CNT; i++)
+        _wait(0);
+
+    t1 = rdtime();
+    _lockstat(&st1);
+
+    sw = st1.ctxsw - st0.ctxsw;
+    if (sw == 0)
+        sw = 1;
+
+    snprintf(linebuf, sizeof(linebuf),
+        "fp_bench %s: %lu switches, %lu ticks per switch\n",
+        label, sw, (unsigned long)(t1 - t0) / sw);
+    _msgout(linebuf);
+}
+
+void int_worker(void) {
+    int i;
+
+    for (i = 0; i < ITER_CNT; i++)
+        _yield();
+
+    _exit();
+}
+
+void fp_worker(int id) {
+    volatile double step = id + 1; // keep the compiler from folding the sum
+    char linebuf[64];
+    double sum;
+    int i;
+
+    sum = 0.0;
+
+    for (i = 0; i < ITER_CNT; i++) {
+        sum += step;
+        _yield();
+    }
+
+    if (sum != (double)ITER_CNT * step) {
+        snprintf(linebuf, sizeof(linebuf),
+            "fp_bench: worker %d FP state corrupted\n", id);
+        _msgout(linebuf);
+    }
+
+    _exit();
+}
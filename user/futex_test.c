@@ -0,0 +1,86 @@
+// futex_test.c - User-space mutex built on _futex
+//
+// First times lock/unlock pairs on a mutex no other thread touches, which
+// should cost a couple of atomic operations and no system calls. Then
+// THREAD_CNT threads increment a shared counter under the mutex, yielding
+// while holding it now and then so that the others find it locked and sleep.
+// The final count shows whether the mutex kept the increments apart, and the
+// context switch count how often threads slept instead of spinning.
+
+#include "syscall.h"
+#include "string.h"
+#include "mutex.h"
+
+#include <stdint.h>
+
+#define THREAD_CNT 4
+#define ITER_CNT 1000
+#define YIELD_EVERY 16 // iterations between yields while holding the mutex
+#define UNCONTENDED_CNT 100000
+#define STACK_SIZE 4096
+
+static struct mutex counter_lock = MUTEX_INITIALIZER;
+static volatile unsigned long counter;
+static char stacks[THREAD_CNT][STACK_SIZE] __attribute__ ((aligned (16)));
+
+static void incr_worker(void * arg);
+
+void main(void) {
+    struct lockstat st0, st1;
+    char linebuf[128];
+    int tids[THREAD_CNT];
+    uint64_t t0, t1;
+    int i;
+
+    t0 = rdtime();
+    for (i = 0; i < UNCONTENDED_CNT; i++) {
+        mutex_lock(&counter_lock);
+        mutex_unlock(&counter_lock);
+    }
+    t1 = rdtime();
+
+    snprintf(linebuf, sizeof(linebuf),
+        "futex_test: uncontended lock/unlock %lu ticks per 1000\n",
+        (unsigned long)((t1 - t0) * 1000 / UNCONTENDED_CNT));
+    _msgout(linebuf);
+
+    _lockstat(&st0);
+
+    for (i = 0; i < THREAD_CNT; i++) {
+        tids[i] = _thread_create(incr_worker, NULL, stacks[i] + STACK_SIZE);
+        if (tids[i] < 0) {
+            _msgout("futex_test: _thread_create failed\n");
+            _exit();
+        }
+    }
+
+    for (i = 0; i < THREAD_CNT; i++)
+        _thread_join(tids[i]);
+
+    _lockstat(&st1);
+
+    snprintf(linebuf, sizeof(linebuf),
+        "futex_test: counter %lu, expected %lu: %s, %lu switches\n",
+        counter, (unsigned long)THREAD_CNT * ITER_CNT,
+        (counter == (unsigned long)THREAD_CNT * ITER_CNT) ? "ok" : "FAILED",
+        st1.ctxsw - st0.ctxsw);
+    _msgout(linebuf);
+
+    _exit();
+}
+
+void incr_worker(void * arg) {
+    unsigned long val;
+    int i;
+
+    (void)arg;
+
+    for (i = 0; i < ITER_CNT; i++) {
+        mutex_lock(&counter_lock);
+        val = counter;
+        if (i % YIELD_EVERY == 0)
+            _yield(); // let the others find the mutex locked
+        counter = val + 1;
+        mutex_unlock(&counter_lock);
+    }
+}
@@ -0,0 +1,60 @@
+// mutex.h - Mutual exclusion between the threads of a process
+//
+
+#ifndef _MUTEX_H_
+#define _MUTEX_H_
+
+#include "syscall.h"
+
+#include <stdint.h>
+
+// A mutex is a futex word that is 0 when unlocked, 1 when locked, and 2 when
+// locked with threads possibly sleeping on it. Locking an unlocked mutex and
+// unlocking one without sleepers are a single atomic operation each; only a
+// thread that finds the mutex locked enters the kernel, to sleep, and so does
+// the thread that unlocks it, to wake a sleeper.
+
+struct mutex {
+    uint32_t state;
+};
+
+#define MUTEX_INITIALIZER { .state = 0 }
+
+static inline void mutex_init(struct mutex * mx);
+static inline void mutex_lock(struct mutex * mx);
+static inline void mutex_unlock(struct mutex * mx);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline void mutex_init(struct mutex * mx) {
+    mx->state = 0;
+}
+
+static inline void mutex_lock(struct mutex * mx) {
+    uint32_t c = 0;
+
+    if (__atomic_compare_exchange_n(&mx->state, &c, 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    // Mark the mutex contended before sleeping, so that the owner knows to
+    // wake us. We may have taken it in the process, if the exchange returns 0.
+
+    if (c != 2)
+        c = __atomic_exchange_n(&mx->state, 2, __ATOMIC_ACQUIRE);
+
+    while (c != 0) {
+        _futex(&mx->state, FUTEX_WAIT, 2);
+        c = __atomic_exchange_n(&mx->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline void mutex_unlock(struct mutex * mx) {
+    if (__atomic_fetch_sub(&mx->state, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(&mx->state, 0, __ATOMIC_RELEASE);
+        _futex(&mx->state, FUTEX_WAKE, 1);
+    }
+}
+
+#endif // _MUTEX_H_
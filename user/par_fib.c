@@ -0,0 +1,64 @@
+// par_fib.c - Parallel CPU-bound benchmark
+//
+// Times one fib computation in this process, then the same computation in
+// PROC_CNT forked processes at once. With at least PROC_CNT harts the parallel
+// run should take about as long as the single one; on one hart it takes
+// PROC_CNT times as long.
+
+#include "syscall.h"
+#include "string.h"
+
+#include <stdint.h>
+
+#define PROC_CNT 4
+#define FIB_N 30
+
+static unsigned int fib(unsigned int n);
+
+void main(void) {
+    char linebuf[128];
+    uint64_t t0, t1, t2;
+    uint64_t speedup;
+    unsigned int result;
+    int i;
+
+    t0 = rdtime();
+    result = fib(FIB_N);
+    t1 = rdtime();
+
+    for (i = 0; i < PROC_CNT; i++) {
+        if (_fork() == 0) {
+            fib(FIB_N);
+            _exit();
+        }
+    }
+
+    for (i = 0; i < PROC_CNT; i++)
+        _wait(0);
+
+    t2 = rdtime();
+
+    // Work done in parallel over time taken, relative to the single run
+
+    speedup = PROC_CNT * (t1 - t0) * 100 / (t2 - t1);
+
+    snprintf(linebuf, sizeof(linebuf),
+        "par_fib: fib(%d) = %u: 1 process %lu ms, %d processes %lu ms, "
+        "speedup %lu.%02lu\n",
+        FIB_N, result,
+        (unsigned long)((t1 - t0) * 1000 / TIMER_FREQ), PROC_CNT,
+        (unsigned long)((t2 - t1) * 1000 / TIMER_FREQ),
+        (unsigned long)(speedup / 100), (unsigned long)(speedup % 100));
+    _msgout(linebuf);
+
+    _exit();
+}
+
+unsigned int fib(unsigned int n) {
+    if (n == 0)
+        return 0;
+    else if (n == 1)
+        return 1;
+    else
+        return fib(n-2) + fib(n-1);
+}
@@ -0,0 +1,113 @@
+// preempt_lat.c - Wake-up latency percentiles under a fork-heavy load
+//
+// Measures how late a high-priority process runs after its _usleep expires,
+// first on an otherwise idle system and then while FORKER_CNT low-priority
+// processes fork and reap children in a loop. Each forker owns BUF_SIZE of
+// touched memory, so most of its time goes to memory_space_clone copying
+// pages in S mode. With a preemptible kernel the sleeper does not have to
+// wait for a fork to finish, so the tail of the loaded distribution should
+// stay within a small multiple of the idle one. Prints the median, 90th and
+// 99th percentile and the maximum lateness of each run, and the per-hart
+// scheduler counters, including kernel preemptions, at the end.
+
+#include "syscall.h"
+#include "string.h"
+
+#include <stdint.h>
+
+#define FORKER_CNT 4
+#define BUF_SIZE (256 * 1024) // per forker, copied by every fork
+#define SAMPLE_CNT 200
+#define SLEEP_US 2000
+#define PRIO_LOW 3 // THREAD_PRIO_LOW
+
+static void measure(uint64_t * lat);
+static void report(const char * label, uint64_t * lat);
+static void forker(uint64_t deadline);
+
+static char buf[BUF_SIZE];
+static uint64_t idle_lat[SAMPLE_CNT];
+static uint64_t loaded_lat[SAMPLE_CNT];
+
+void main(void) {
+    uint64_t deadline;
+    int i;
+
+    _setpriority(0);
+    measure(idle_lat);
+
+    // Forkers run for twice as long as the measurement should take, so that
+    // they are still running when it ends.
+
+    deadline = rdtime() + 2 * US_TO_TICKS((uint64_t)SAMPLE_CNT * SLEEP_US);
+
+    for (i = 0; i < FORKER_CNT; i++) {
+        if (_fork() == 0)
+            forker(deadline);
+    }
+
+    measure(loaded_lat);
+
+    for (i = 0; i < FORKER_CNT; i++)
+        _wait(0);
+
+    report("idle", idle_lat);
+    report("fork load", loaded_lat);
+    _kreport(KREPORT_SMP);
+    _exit();
+}
+
+void measure(uint64_t * lat) {
+    uint64_t t0;
+    int i;
+
+    for (i = 0; i < SAMPLE_CNT; i++) {
+        t0 = rdtime();
+        _usleep(SLEEP_US);
+        lat[i] = rdtime() - t0 - US_TO_TICKS(SLEEP_US);
+    }
+}
+
+void report(const char * label, uint64_t * lat) {
+    char linebuf[128];
+    uint64_t t;
+    int i, j;
+
+    for (i = 1; i < SAMPLE_CNT; i++) {
+        t = lat[i];
+        for (j = i; j > 0 && t < lat[j-1]; j--)
+            lat[j] = lat[j-1];
+        lat[j] = t;
+    }
+
+    snprintf(linebuf, sizeof(linebuf),
+        "preempt_lat: %s: p50 %lu us, p90 %lu us, p99 %lu us, max %lu us\n",
+        label,
+        (unsigned long)(lat[SAMPLE_CNT * 50 / 100] / US_TO_TICKS(1)),
+        (unsigned long)(lat[SAMPLE_CNT * 90 / 100] / US_TO_TICKS(1)),
+        (unsigned long)(lat[SAMPLE_CNT * 99 / 100] / US_TO_TICKS(1)),
+        (unsigned long)(lat[SAMPLE_CNT - 1] / US_TO_TICKS(1)));
+    _msgout(linebuf);
+}
+
+void forker(uint64_t deadline) {
+    int result;
+    int i;
+
+    _setpriority(PRIO_LOW);
+
+    // Touch every page so that each fork has to copy it
+
+    for (i = 0; i < BUF_SIZE; i += 4096)
+        buf[i] = i;
+
+    while (rdtime() < deadline) {
+        result = _fork();
+        if (result == 0)
+            _exit();
+        if (result > 0)
+            _wait(0);
+    }
+
+    _exit();
+}
@@ -0,0 +1,95 @@
+// sched_lat.c - Wake-up latency of an interactive process under load
+//
+// Measures how late an interactive process wakes up from _usleep, first on an
+// otherwise idle system and then while BATCH_CNT CPU-bound processes compete
+// for the harts. The scheduler demotes the batch processes once they use up
+// their time slices, while the sleeping process is boosted when it wakes, so
+// its latency under load should stay within a tick or so of the idle case.
+
+#include "syscall.h"
+#include "string.h"
+
+#include <stdint.h>
+
+#define BATCH_CNT 8 // more than there are harts
+#define SAMPLE_CNT 50
+#define SLEEP_US 5000
+
+struct lat_stats {
+    uint64_t total;
+    uint64_t max;
+};
+
+static void measure(struct lat_stats * st);
+static void report(const char * label, const struct lat_stats * st);
+static unsigned int fib(unsigned int n);
+
+void main(void) {
+    struct lat_stats idle, loaded;
+    uint64_t deadline;
+    int i;
+
+    measure(&idle);
+
+    // Batch processes spin for twice as long as the measurement should take,
+    // so that they are still running when it ends.
+
+    deadline = rdtime() + 2 * SAMPLE_CNT * SLEEP_US * (TIMER_FREQ / 1000000);
+
+    for (i = 0; i < BATCH_CNT; i++) {
+        if (_fork() == 0) {
+            while (rdtime() < deadline)
+                fib(20);
+            _exit();
+        }
+    }
+
+    measure(&loaded);
+
+    for (i = 0; i < BATCH_CNT; i++)
+        _wait(0);
+
+    report("idle", &idle);
+    report("loaded", &loaded);
+
+    _exit();
+}
+
+void measure(struct lat_stats * st) {
+    uint64_t t0, late;
+    int i;
+
+    st->total = 0;
+    st->max = 0;
+
+    for (i = 0; i < SAMPLE_CNT; i++) {
+        t0 = rdtime();
+        _usleep(SLEEP_US);
+        late = rdtime() - t0 - SLEEP_US * (TIMER_FREQ / 1000000);
+
+        st->total += late;
+        if (st->max < late)
+            st->max = late;
+    }
+}
+
+void report(const char * label, const struct lat_stats * st) {
+    char linebuf[128];
+
+    snprintf(linebuf, sizeof(linebuf),
+        "sched_lat: %s: avg %lu us, max %lu us over %d sleeps of %d us\n",
+        label,
+        (unsigned long)(st->total / SAMPLE_CNT / (TIMER_FREQ / 1000000)),
+        (unsigned long)(st->max / (TIMER_FREQ / 1000000)),
+        SAMPLE_CNT, SLEEP_US);
+    _msgout(linebuf);
+}
+
+unsigned int fib(unsigned int n) {
+    if (n == 0)
+        return 0;
+    else if (n == 1)
+        return 1;
+    else
+        return fib(n-2) + fib(n-1);
+}
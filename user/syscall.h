@@ -5,6 +5,55 @@
 #define _SYSCALL_H_
 
 #include <stddef.h>
+#include <stdint.h>
+
+// Frequency of the timer read by rdtime, which also counts the times in struct
+// rusage.
+
+#define TIMER_FREQ 10000000UL // QEMU virt mtime frequency
+#define US_TO_TICKS(us) ((us) * (TIMER_FREQ / 1000000))
+
+// Returns the timer value. Reading it needs no system call.
+
+static inline uint64_t rdtime(void) {
+    uint64_t val;
+    asm volatile ("rdtime %0" : "=r" (val));
+    return val;
+}
+
+// Filled in by _lockstat; must match struct lockstat in kern/lock.h.
+
+struct lockstat {
+    unsigned long acquires; // kernel sleep lock acquisitions
+    unsigned long contended; // acquisitions that had to wait
+    unsigned long ctxsw; // context switches on all harts
+};
+
+// Filled in by _getrusage; must match struct rusage in kern/process.h. Times
+// are in timer ticks (see TIMER_FREQ).
+
+struct rusage {
+    int id; // process or thread id
+    int nthreads; // live threads
+    uint64_t run_time; // time spent running
+    uint64_t ready_time; // time spent waiting for a hart
+    uint64_t wait_time; // time spent sleeping
+    uint64_t cycles; // cycles spent running
+    unsigned long nvcsw; // voluntary context switches
+    unsigned long nivcsw; // involuntary context switches
+    unsigned long edf_jobs; // jobs released under _setdeadline
+    unsigned long edf_misses; // jobs that finished after their deadline
+    unsigned long resident; // resident pages (0 for a thread)
+    unsigned long wss; // pages recently accessed, smoothed
+    unsigned long dirty_rate; // pages recently written, smoothed
+};
+
+// Operations of _futex; must match kern/futex.h. FUTEX_WAIT sleeps while the
+// word at /uaddr/ holds /val/ and fails with -EAGAIN if it does not; FUTEX_WAKE
+// wakes up to /val/ threads sleeping on the word. See mutex.h.
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
 
 extern void __attribute__ ((noreturn)) _exit(void);
 extern void _msgout(const char * msg);
@@ -16,7 +65,52 @@ extern int _devopen(int fd, const char * name, int instno);
 extern int _fsopen(int fd, const char * name);
 extern int _exec(int fd);
 extern int _fork(void);
+
+// Threads of a process share its memory and open files. _thread_create starts
+// /start/(/arg/) in a new thread on the stack ending at /stack_top/ (16-byte
+// aligned) and returns its thread id. Returning from /start/ is the same as
+// calling _thread_exit, which exits only the calling thread; _exit exits all
+// threads of the process. A thread is reaped with _thread_join by the thread
+// that created it.
+
+extern int _thread_create(void (*start)(void *), void * arg, void * stack_top);
+extern void __attribute__ ((noreturn)) _thread_exit(void);
+extern int _thread_join(int tid);
 extern int _wait(int tid);
 extern int _usleep(unsigned long us);
+extern int _yield(void);
+extern int _setpriority(int prio);
+extern int _lockstat(struct lockstat * st);
+extern int _futex(uint32_t * uaddr, int op, uint32_t val);
+
+// Reports on the process with the lowest id of at least /pid/ and returns its
+// id, or -ENOENT if there is none. A negative /pid/ reports on the calling
+// thread alone.
+
+extern int _getrusage(int pid, struct rusage * ru);
+
+// Makes the calling thread a periodic task in the deadline (EDF) class, which
+// runs ahead of all priorities. Each wake-up from _usleep releases a job that
+// must sleep again within /deadline_us/ of its release and may use up to
+// /budget_us/ of CPU time; a job that runs over is demoted to its normal
+// priority until the next release. Returns -EINVAL unless 0 < budget <=
+// deadline <= period, or -EBUSY if the hart is fully booked. A /period_us/ of
+// 0 returns the thread to the normal class.
+
+extern int _setdeadline (
+    unsigned long period_us, unsigned long budget_us, unsigned long deadline_us);
+
+// Prints kernel statistics to the console. /what/ is one or more of the
+// KREPORT_ selectors or-ed together; must match kern/syscall.h.
+
+#define KREPORT_LOCKS   0x01 // most contended sleep locks
+#define KREPORT_SMP     0x02 // per-hart scheduler counters
+#define KREPORT_INTR    0x04 // ISR run times
+#define KREPORT_WORKQ   0x08 // work queue latencies
+#define KREPORT_KTASK   0x10 // kernel task statistics
+#define KREPORT_EDF     0x20 // EDF threads
+#define KREPORT_ALL     0x3f
+
+extern int _kreport(int what);
 
 #endif // _SYSCALL_H_
@@ -0,0 +1,90 @@
+// thread_test.c - Threads sharing a process's memory
+//
+// Splits the sum of an array among THREAD_CNT threads of this process. Each
+// thread writes its partial sum into a shared array, which the main thread
+// reads after joining them all. With forked processes, the partial sums would
+// land in copies of the array and never be seen. While the threads run, the
+// main thread also forks a child and checks that _wait reaps the child and
+// not one of the threads.
+
+#include "syscall.h"
+#include "string.h"
+
+#include <stdint.h>
+
+#define THREAD_CNT 4
+#define ELEM_CNT 4096
+#define STACK_SIZE 4096
+
+struct slice {
+    const uint32_t * start;
+    int cnt;
+    uint64_t sum;
+};
+
+static uint32_t data[ELEM_CNT];
+static struct slice slices[THREAD_CNT];
+static char stacks[THREAD_CNT][STACK_SIZE] __attribute__ ((aligned (16)));
+
+static void sum_slice(void * arg);
+
+void main(void) {
+    char linebuf[128];
+    int tids[THREAD_CNT];
+    uint64_t expected, total;
+    int result;
+    int i;
+
+    expected = 0;
+    for (i = 0; i < ELEM_CNT; i++) {
+        data[i] = i * 7 + 1;
+        expected += data[i];
+    }
+
+    for (i = 0; i < THREAD_CNT; i++) {
+        slices[i].start = data + i * (ELEM_CNT / THREAD_CNT);
+        slices[i].cnt = ELEM_CNT / THREAD_CNT;
+        slices[i].sum = 0;
+        tids[i] = _thread_create(sum_slice, &slices[i], stacks[i] + STACK_SIZE);
+        if (tids[i] < 0) {
+            _msgout("thread_test: _thread_create failed\n");
+            _exit();
+        }
+    }
+
+    if (_fork() == 0)
+        _exit();
+
+    if (_wait(tids[0]) >= 0)
+        _msgout("thread_test: _wait reaped a thread\n");
+
+    result = _wait(0);
+    for (i = 0; i < THREAD_CNT; i++) {
+        if (result == tids[i])
+            _msgout("thread_test: _wait reaped a thread\n");
+    }
+
+    total = 0;
+    for (i = 0; i < THREAD_CNT; i++) {
+        if (_thread_join(tids[i]) != tids[i])
+            _msgout("thread_test: _thread_join failed\n");
+        total += slices[i].sum;
+    }
+
+    snprintf(linebuf, sizeof(linebuf), "thread_test: sum %lu, expected %lu: %s\n",
+        (unsigned long)total, (unsigned long)expected,
+        (total == expected) ? "ok" : "FAILED");
+    _msgout(linebuf);
+
+    _exit();
+}
+
+void sum_slice(void * arg) {
+    struct slice * const sl = arg;
+    int i;
+
+    for (i = 0; i < sl->cnt; i++)
+        sl->sum += sl->start[i];
+
+    // Returning exits the thread through _thread_exit
+}
@@ -0,0 +1,72 @@
+// top.c - Per-process CPU usage monitor
+//
+// Redraws a table of all processes on ser1 every REFRESH_MS: the share of a
+// hart each used since the last refresh, how long its threads waited on a
+// ready list and slept, its voluntary and involuntary context switches, the
+// deadlines its EDF threads missed, and its resident and working set sizes in
+// pages. The kernel only samples working sets while something like top reads
+// them, so the sizes start out at 0.
+// A process using 100% keeps one hart busy; with several harts the column can
+// add up to more. The times in the last columns are totals since the process
+// started.
+
+#include "syscall.h"
+#include "string.h"
+
+#include <stdint.h>
+
+#define SER_FD 0
+#define REFRESH_MS 1000
+#define TRACKED_PID_CNT 64 // processes with a larger id show no %CPU
+
+static void print(const char * s);
+
+void main(void) {
+    static uint64_t last_run[TRACKED_PID_CNT];
+    char linebuf[128];
+    struct rusage ru;
+    uint64_t now, last, elapsed, ran;
+    unsigned long pct;
+    int pid;
+
+    if (_devopen(SER_FD, "ser", 1) < 0) {
+        _msgout("top: _devopen failed\n");
+        _exit();
+    }
+
+    last = rdtime();
+
+    for (;;) {
+        _usleep(REFRESH_MS * 1000UL);
+        now = rdtime();
+        elapsed = now - last;
+        last = now;
+
+        print("\033[H\033[J"); // home and clear screen
+        print("  pid  thr   %cpu    run ms  ready ms   wait ms     vcsw    ivcsw  misses    res    wss\r\n");
+
+        for (pid = 0; _getrusage(pid, &ru) >= 0; pid = ru.id + 1) {
+            pct = 0;
+            if (ru.id < TRACKED_PID_CNT) {
+                ran = ru.run_time - last_run[ru.id];
+                if (ru.run_time < last_run[ru.id]) // id reused by a new process
+                    ran = ru.run_time;
+                last_run[ru.id] = ru.run_time;
+                pct = (elapsed != 0) ? ran * 1000 / elapsed : 0;
+            }
+
+            snprintf(linebuf, sizeof(linebuf),
+                "%5d  %3d  %3lu.%lu  %8lu  %8lu  %8lu  %7lu  %7lu  %6lu  %5lu  %5lu\r\n",
+                ru.id, ru.nthreads, pct / 10, pct % 10,
+                (unsigned long)(ru.run_time / (TIMER_FREQ / 1000)),
+                (unsigned long)(ru.ready_time / (TIMER_FREQ / 1000)),
+                (unsigned long)(ru.wait_time / (TIMER_FREQ / 1000)),
+                ru.nvcsw, ru.nivcsw, ru.edf_misses, ru.resident, ru.wss);
+            print(linebuf);
+        }
+    }
+}
+
+void print(const char * s) {
+    _write(SER_FD, s, strlen(s));
+}